@@ -0,0 +1,77 @@
+#include "collation.h"
+
+// Lettera base di U+00C0 - U+00FF. '*' = legatura (vedi _expand), '.' = simbolo (× e ÷)
+static const char s_latin1[] =
+    "aaaaaa*ceeeeiiiidnooooo.ouuuuy**"
+    "aaaaaa*ceeeeiiiidnooooo.ouuuuy*y";
+// Lettera base di U+0100 - U+017F (Latin Extended-A)
+static const char s_latin_ext_a[] =
+    "aaaaaaccccccccddddeeeeeeeeeegggggggghhhhiiiiiiiiii**jjkkkllllllllllnnnnnnnnnoooooo**rrrrrrssssssssttttttuuuuuuuuuuuuwwyyyzzzzzzs";
+
+// Legature che diventano due lettere
+static const char* _expand(uint32_t cp) {
+    switch (cp) {
+        case 0x00C6: case 0x00E6: return "ae";
+        case 0x00DE: case 0x00FE: return "th";
+        case 0x00DF: return "ss";
+        case 0x0132: case 0x0133: return "ij";
+        case 0x0152: case 0x0153: return "oe";
+    }
+    return nullptr;
+}
+
+// Lettera base del codepoint, 0 se non va ripiegato
+static char _fold(uint32_t cp) {
+    if (cp >= 0x00C0 && cp <= 0x00FF) return s_latin1[cp - 0x00C0];
+    if (cp >= 0x0100 && cp <= 0x017F) return s_latin_ext_a[cp - 0x0100];
+    return 0;
+}
+
+size_t Collation::makeKey(const char* utf8, uint8_t* key, size_t len) {
+    const uint8_t* p = (const uint8_t*)utf8;
+    size_t out = 0;
+    auto emit = [&](uint8_t byte) {
+        if (out < len) key[out] = byte;
+        out++;
+    };
+
+    while (*p) {
+        uint8_t c = *p;
+        if (c < 0x80) {
+            emit((c >= 'A' && c <= 'Z') ? c + ('a' - 'A') : c);
+            p++;
+            continue;
+        }
+        // Sequenza a due byte (U+0080 - U+07FF): contiene tutte le lettere ripiegate
+        if ((c & 0xE0) == 0xC0 && (p[1] & 0xC0) == 0x80) {
+            uint32_t cp = ((uint32_t)(c & 0x1F) << 6) | (p[1] & 0x3F);
+            char base = _fold(cp);
+            if (base == '*') {
+                for (const char* s = _expand(cp); *s; s++) emit(*s);
+                p += 2;
+                continue;
+            }
+            if (base && base != '.') {
+                emit(base);
+                p += 2;
+                continue;
+            }
+        }
+        // Tutto il resto resta com'e': l'ordine dei byte UTF-8 e' quello dei codepoint
+        emit(c);
+        p++;
+    }
+    for (size_t i = out; i < len; i++) key[i] = 0;
+    return out;
+}
+
+int Collation::compare(const char* a, const char* b) {
+    uint8_t key_a[COLLATION_FULL_KEY_LEN];
+    uint8_t key_b[COLLATION_FULL_KEY_LEN];
+    size_t len_a = makeKey(a, key_a, sizeof(key_a));
+    size_t len_b = makeKey(b, key_b, sizeof(key_b));
+    size_t common = len_a < len_b ? len_a : len_b;
+    int cmp = memcmp(key_a, key_b, common < sizeof(key_a) ? common : sizeof(key_a));
+    if (cmp != 0) return cmp;
+    return len_a < len_b ? -1 : (len_a > len_b ? 1 : 0);
+}
@@ -0,0 +1,28 @@
+#pragma once
+#include <Arduino.h>
+
+// Chiavi di ordinamento dei titoli: il titolo UTF-8 viene ridotto a byte confrontabili con memcmp.
+// Maiuscole e minuscole coincidono, le lettere accentate latine (Latin-1 e Latin Extended-A, cioe'
+// i caratteri di montserrat_*_extended) valgono come la lettera base e le legature si espandono
+// ("Ä" = "a", "ß" = "ss", "Œ" = "oe"). Gli altri caratteri non ASCII restano in UTF-8:
+// vengono dopo la 'z', nell'ordine dei codepoint.
+// La chiave corta ha lunghezza fissa e completa di zeri: se e' piena, due titoli con la stessa
+// chiave vanno confrontati per intero con compare().
+#define COLLATION_KEY_LEN 16
+// Chiave completa di un titolo (MAX_TITLE_LEN byte, al massimo due byte di chiave per byte UTF-8)
+#define COLLATION_FULL_KEY_LEN 128
+// Valore di letter() per i titoli che non iniziano con una lettera A-Z
+#define COLLATION_OTHER_LETTER 26
+
+class Collation {
+public:
+    // Scrive in 'key' i primi 'len' byte della chiave di 'utf8', completando con zeri.
+    // Restituisce la lunghezza della chiave intera, anche se 'key' e' stata troncata.
+    static size_t makeKey(const char* utf8, uint8_t* key, size_t len);
+    // Confronto completo tra due titoli con lo stesso criterio delle chiavi (<0, 0, >0)
+    static int compare(const char* a, const char* b);
+    // Lettera iniziale della chiave: 0 = A ... 25 = Z, COLLATION_OTHER_LETTER per cifre, simboli e altri alfabeti
+    static uint8_t letter(const uint8_t* key) {
+        return (key[0] >= 'a' && key[0] <= 'z') ? key[0] - 'a' : COLLATION_OTHER_LETTER;
+    }
+};
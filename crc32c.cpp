@@ -0,0 +1,54 @@
+#include "crc32c.h"
+
+static uint32_t s_table[8][256];
+static volatile bool s_ready = false;
+
+void Crc32c::_init() {
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t crc = i;
+        for (int k = 0; k < 8; k++) crc = (crc >> 1) ^ (CRC32C_POLY & (0u - (crc & 1)));
+        s_table[0][i] = crc;
+    }
+    // Tabella t: contributo di un byte seguito da t byte a zero
+    for (uint32_t i = 0; i < 256; i++) {
+        for (int t = 1; t < 8; t++) {
+            s_table[t][i] = (s_table[t - 1][i] >> 8) ^ s_table[0][s_table[t - 1][i] & 0xFF];
+        }
+    }
+    s_ready = true;
+}
+
+uint32_t Crc32c::update(uint32_t crc, const void* data, size_t len) {
+    if (!s_ready) _init();  // Una doppia inizializzazione concorrente scrive gli stessi valori
+    const uint8_t* p = (const uint8_t*)data;
+    crc = ~crc;
+
+    // Byte iniziali fino all'allineamento a 4, poi blocchi da 8 (l'ESP32 e' little-endian)
+    while (len > 0 && ((uintptr_t)p & 3)) {
+        crc = (crc >> 8) ^ s_table[0][(crc ^ *p++) & 0xFF];
+        len--;
+    }
+    while (len >= 8) {
+        uint32_t lo = *(const uint32_t*)p ^ crc;
+        uint32_t hi = *(const uint32_t*)(p + 4);
+        crc = s_table[7][lo & 0xFF] ^ s_table[6][(lo >> 8) & 0xFF] ^
+              s_table[5][(lo >> 16) & 0xFF] ^ s_table[4][lo >> 24] ^
+              s_table[3][hi & 0xFF] ^ s_table[2][(hi >> 8) & 0xFF] ^
+              s_table[1][(hi >> 16) & 0xFF] ^ s_table[0][hi >> 24];
+        p += 8;
+        len -= 8;
+    }
+    while (len-- > 0) {
+        crc = (crc >> 8) ^ s_table[0][(crc ^ *p++) & 0xFF];
+    }
+    return ~crc;
+}
+
+bool Crc32c::selfTest() {
+    static const char vector[] = "123456789";
+    if (compute(vector, 9) != 0xE3069283u) return false;
+    // A pezzi e disallineato: stesso risultato
+    uint32_t crc = update(0, vector, 3);
+    crc = update(crc, vector + 3, 6);
+    return crc == 0xE3069283u;
+}
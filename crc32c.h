@@ -0,0 +1,20 @@
+#pragma once
+#include <Arduino.h>
+
+// CRC32C (Castagnoli, polinomio riflesso 0x82F63B78), usato per l'integrita' del vault e del giornale.
+// Implementazione slice-by-8: otto tabelle da 256 voci, 8 byte per iterazione.
+// Le tabelle (8 KB) vengono calcolate alla prima chiamata.
+#define CRC32C_POLY 0x82F63B78u
+
+class Crc32c {
+public:
+    // 'crc' e' il valore restituito dalla chiamata precedente (0 per iniziare): i dati possono
+    // essere passati a pezzi e il risultato e' lo stesso di un'unica chiamata.
+    static uint32_t update(uint32_t crc, const void* data, size_t len);
+    static uint32_t compute(const void* data, size_t len) { return update(0, data, len); }
+    // Vettore di verifica standard: CRC32C("123456789") = 0xE3069283
+    static bool selfTest();
+
+private:
+    static void _init();
+};
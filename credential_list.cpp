@@ -0,0 +1,274 @@
+#include "credential_list.h"
+#include <math.h>
+
+CredentialList::CredentialList()
+    : m_obj(NULL), m_band(NULL), m_row_count(0), m_row_height(1), m_text_cb(NULL), m_user(NULL), m_count(0),
+      m_offset(0), m_velocity(0), m_remainder(0), m_drag_distance(0), m_last_drag_tick(0), m_timer(NULL),
+      m_retry_timer(NULL) {
+    for (uint8_t i = 0; i < CREDENTIAL_LIST_MAX_ROWS; i++) {
+        m_labels[i] = NULL;
+        m_label_rows[i] = -1;
+        m_label_selected[i] = false;
+        m_label_pending[i] = false;
+    }
+}
+
+lv_obj_t* CredentialList::create(lv_obj_t* parent, lv_coord_t row_height, TextCallback text_cb, void* user) {
+    m_row_height = row_height > 0 ? row_height : 1;
+    m_text_cb = text_cb;
+    m_user = user;
+    m_count = 0;
+    m_offset = 0;
+
+    m_obj = lv_obj_create(parent);
+    lv_obj_clear_flag(m_obj, LV_OBJ_FLAG_SCROLLABLE);  // Lo scorrimento e' gestito qui, non da LVGL
+    lv_obj_add_event_cb(m_obj, _eventCb, LV_EVENT_ALL, this);
+
+    m_band = lv_obj_create(m_obj);
+    lv_obj_remove_style_all(m_band);
+    lv_obj_clear_flag(m_band, LV_OBJ_FLAG_CLICKABLE);
+    lv_obj_set_style_bg_opa(m_band, LV_OPA_COVER, 0);
+
+    for (uint8_t i = 0; i < CREDENTIAL_LIST_MAX_ROWS; i++) {
+        m_labels[i] = lv_label_create(m_obj);
+        lv_label_set_long_mode(m_labels[i], LV_LABEL_LONG_DOT);
+        lv_label_set_text_static(m_labels[i], "");
+        lv_obj_add_flag(m_labels[i], LV_OBJ_FLAG_HIDDEN);
+        m_label_rows[i] = -1;
+        m_label_selected[i] = false;
+        m_label_pending[i] = false;
+    }
+    return m_obj;
+}
+
+int32_t CredentialList::_maxOffset() const {
+    return m_count > 0 ? (int32_t)(m_count - 1) * m_row_height : 0;
+}
+
+// Posizione, nel contenuto della lista, del bordo superiore della vista
+int32_t CredentialList::_top() const {
+    return m_offset - (lv_obj_get_content_height(m_obj) - m_row_height) / 2;
+}
+
+uint32_t CredentialList::getSelected() const {
+    if (m_count == 0) return 0;
+    uint32_t row = (m_offset + m_row_height / 2) / m_row_height;
+    return row < m_count ? row : m_count - 1;
+}
+
+const char* CredentialList::getSelectedText() const {
+    if (!m_obj || m_count == 0) return "";
+    int32_t selected = getSelected();
+    for (uint8_t i = 0; i < m_row_count; i++) {
+        if (m_label_rows[i] == selected) return m_label_pending[i] ? "" : lv_label_get_text(m_labels[i]);
+    }
+    return "";
+}
+
+void CredentialList::setCount(uint32_t count) {
+    if (!m_obj) return;
+    _stopMotion();
+    m_count = count;
+    if (m_offset > _maxOffset()) m_offset = _maxOffset();
+
+    // Dimensioni definitive: numero di etichette e banda centrale dipendono dall'altezza
+    lv_obj_update_layout(m_obj);
+    lv_coord_t height = lv_obj_get_content_height(m_obj);
+    uint32_t rows = (height + m_row_height - 1) / m_row_height + 1;
+    m_row_count = rows < CREDENTIAL_LIST_MAX_ROWS ? rows : CREDENTIAL_LIST_MAX_ROWS;
+    for (uint8_t i = 0; i < CREDENTIAL_LIST_MAX_ROWS; i++) {
+        lv_obj_set_size(m_labels[i], lv_obj_get_content_width(m_obj), m_row_height);
+        if (i >= m_row_count) lv_obj_add_flag(m_labels[i], LV_OBJ_FLAG_HIDDEN);
+    }
+    lv_obj_set_style_bg_color(m_band, lv_obj_get_style_bg_color(m_obj, LV_PART_SELECTED), 0);
+    lv_obj_set_size(m_band, lv_obj_get_width(m_obj), m_row_height);
+    lv_obj_set_pos(m_band, -lv_obj_get_style_pad_left(m_obj, 0), (height - m_row_height) / 2);
+    if (m_count == 0) {
+        lv_obj_add_flag(m_band, LV_OBJ_FLAG_HIDDEN);
+    } else {
+        lv_obj_clear_flag(m_band, LV_OBJ_FLAG_HIDDEN);
+    }
+    _render(true);
+}
+
+void CredentialList::setSelected(uint32_t row, lv_anim_enable_t anim) {
+    if (!m_obj || m_count == 0) return;
+    _stopMotion();
+    if (row >= m_count) row = m_count - 1;
+    int32_t target = (int32_t)row * m_row_height;
+    if (anim == LV_ANIM_OFF || target == m_offset) {
+        _setOffset(target);
+        return;
+    }
+    lv_anim_t a;
+    lv_anim_init(&a);
+    lv_anim_set_var(&a, this);
+    lv_anim_set_exec_cb(&a, _snapAnimCb);
+    lv_anim_set_values(&a, m_offset, target);
+    lv_anim_set_time(&a, CREDENTIAL_LIST_SNAP_MS);
+    lv_anim_set_path_cb(&a, lv_anim_path_ease_out);
+    lv_anim_start(&a);
+}
+
+void CredentialList::_setOffset(int32_t offset) {
+    if (offset < 0) offset = 0;
+    if (offset > _maxOffset()) offset = _maxOffset();
+    if (offset == m_offset) return;
+    m_offset = offset;
+    _render(false);
+}
+
+void CredentialList::_styleRow(uint8_t label, bool selected) {
+    lv_obj_t* obj = m_labels[label];
+    if (selected) {
+        lv_obj_set_style_text_font(obj, lv_obj_get_style_text_font(m_obj, LV_PART_SELECTED), 0);
+        lv_obj_set_style_text_opa(obj, lv_obj_get_style_text_opa(m_obj, LV_PART_SELECTED), 0);
+    } else {
+        lv_obj_remove_local_style_prop(obj, LV_STYLE_TEXT_FONT, 0);
+        lv_obj_remove_local_style_prop(obj, LV_STYLE_TEXT_OPA, 0);
+    }
+    // Testo centrato in verticale nella riga, con il font appena scelto
+    lv_coord_t line_height = lv_font_get_line_height(lv_obj_get_style_text_font(obj, 0));
+    lv_obj_set_style_pad_top(obj, (m_row_height - line_height) / 2, 0);
+    m_label_selected[label] = selected;
+}
+
+void CredentialList::_render(bool reload) {
+    int32_t top = _top();
+    // Prima riga almeno in parte visibile (divisione arrotondata verso il basso anche per top < 0)
+    int32_t first = top >= 0 ? top / m_row_height : -((m_row_height - 1 - top) / m_row_height);
+    int32_t selected = getSelected();
+
+    // La riga r usa sempre l'etichetta r % m_row_count: scorrendo, solo le righe che entrano nella vista
+    // cambiano testo, le altre vengono soltanto spostate
+    for (uint8_t i = 0; i < m_row_count; i++) {
+        int32_t row = first + i;
+        uint8_t label = ((row % m_row_count) + m_row_count) % m_row_count;
+        lv_obj_t* obj = m_labels[label];
+        if (row < 0 || row >= (int32_t)m_count) {
+            lv_obj_add_flag(obj, LV_OBJ_FLAG_HIDDEN);
+            m_label_rows[label] = -1;
+            continue;
+        }
+        if (reload || m_label_rows[label] != row || m_label_pending[label]) {
+            char text[CREDENTIAL_LIST_TEXT_LEN];
+            text[0] = '\0';
+            bool ready = !m_text_cb || m_text_cb(row, text, sizeof(text), m_user);
+            lv_label_set_text(obj, ready ? text : CREDENTIAL_LIST_PLACEHOLDER);
+            m_label_rows[label] = row;
+            m_label_pending[label] = !ready;
+            lv_obj_clear_flag(obj, LV_OBJ_FLAG_HIDDEN);
+            if (!ready && !m_retry_timer) {
+                m_retry_timer = lv_timer_create(_retryCb, CREDENTIAL_LIST_RETRY_MS, this);
+                m_retry_timer->repeat_count = 1;
+            }
+        }
+        if (reload || m_label_selected[label] != (row == selected)) _styleRow(label, row == selected);
+        lv_obj_set_y(obj, row * m_row_height - top);
+    }
+}
+
+void CredentialList::_stopMotion() {
+    lv_anim_del(this, _snapAnimCb);
+    if (m_timer) {
+        lv_timer_del(m_timer);
+        m_timer = NULL;
+    }
+    m_velocity = 0;
+    m_remainder = 0;
+}
+
+void CredentialList::_retryCb(lv_timer_t* timer) {
+    CredentialList* list = (CredentialList*)timer->user_data;
+    list->m_retry_timer = NULL;  // Timer a ripetizione singola: LVGL lo elimina dopo questa chiamata
+    list->_render(false);        // Solo le righe ancora provvisorie chiedono di nuovo il testo
+}
+
+void CredentialList::_snapAnimCb(void* var, int32_t value) {
+    ((CredentialList*)var)->_setOffset(value);
+}
+
+void CredentialList::_momentumCb(lv_timer_t* timer) {
+    CredentialList* list = (CredentialList*)timer->user_data;
+    float step = list->m_velocity * CREDENTIAL_LIST_FRAME_MS + list->m_remainder;
+    int32_t pixels = (int32_t)step;
+    list->m_remainder = step - pixels;
+    int32_t before = list->m_offset;
+    list->_setOffset(before + pixels);
+    list->m_velocity *= CREDENTIAL_LIST_FRICTION;
+
+    // Fine dell'inerzia (o bordo della lista raggiunto): allineamento sulla riga piu' vicina
+    bool at_edge = pixels != 0 && list->m_offset == before;
+    if (at_edge || fabsf(list->m_velocity) < CREDENTIAL_LIST_MIN_SPEED) {
+        list->setSelected(list->getSelected(), LV_ANIM_ON);  // Ferma anche questo timer
+    }
+}
+
+void CredentialList::_release(bool tap) {
+    if (tap) {
+        // Tocco senza trascinamento: la riga toccata viene portata al centro
+        lv_point_t point;
+        lv_indev_get_point(lv_indev_get_act(), &point);
+        lv_area_t area;
+        lv_obj_get_content_coords(m_obj, &area);
+        int32_t y = _top() + (point.y - area.y1);
+        if (y >= 0) setSelected(y / m_row_height, LV_ANIM_ON);
+        return;
+    }
+    if (lv_tick_elaps(m_last_drag_tick) > CREDENTIAL_LIST_IDLE_MS) m_velocity = 0;
+    if (fabsf(m_velocity) < CREDENTIAL_LIST_MIN_SPEED) {
+        setSelected(getSelected(), LV_ANIM_ON);
+        return;
+    }
+    float velocity = m_velocity;
+    _stopMotion();
+    m_velocity = velocity;
+    m_timer = lv_timer_create(_momentumCb, CREDENTIAL_LIST_FRAME_MS, this);
+}
+
+void CredentialList::_eventCb(lv_event_t* e) {
+    CredentialList* list = (CredentialList*)lv_event_get_user_data(e);
+    switch (lv_event_get_code(e)) {
+        case LV_EVENT_PRESSED:
+            list->_stopMotion();
+            list->m_drag_distance = 0;
+            list->m_last_drag_tick = lv_tick_get();
+            break;
+        case LV_EVENT_PRESSING: {
+            lv_point_t vect;
+            lv_indev_get_vect(lv_indev_get_act(), &vect);
+            if (vect.y == 0) break;
+            uint32_t elapsed = lv_tick_elaps(list->m_last_drag_tick);
+            list->m_last_drag_tick = lv_tick_get();
+            list->m_drag_distance += abs(vect.y);
+            // Il contenuto segue il dito: trascinare verso l'alto porta verso il fondo della lista
+            list->m_velocity = -(float)vect.y / (float)(elapsed > 0 ? elapsed : 1);
+            list->_setOffset(list->m_offset - vect.y);
+            break;
+        }
+        case LV_EVENT_RELEASED:
+            list->_release(list->m_drag_distance < CREDENTIAL_LIST_TAP_SLOP);
+            break;
+        case LV_EVENT_PRESS_LOST:
+            list->_release(false);
+            break;
+        case LV_EVENT_DELETE:
+            list->_stopMotion();
+            if (list->m_retry_timer) {
+                lv_timer_del(list->m_retry_timer);
+                list->m_retry_timer = NULL;
+            }
+            list->m_obj = NULL;
+            list->m_band = NULL;
+            for (uint8_t i = 0; i < CREDENTIAL_LIST_MAX_ROWS; i++) {
+                list->m_labels[i] = NULL;
+                list->m_label_rows[i] = -1;
+                list->m_label_pending[i] = false;
+            }
+            list->m_row_count = 0;
+            list->m_count = 0;
+            break;
+        default:
+            break;
+    }
+}
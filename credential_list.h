@@ -0,0 +1,83 @@
+#pragma once
+#include <Arduino.h>
+#include <lvgl.h>
+
+// Lista virtuale delle credenziali per la schermata principale. Al posto delle opzioni di lv_roller
+// (tutti i titoli concatenati in un'unica stringa, copiata e misurata da LVGL) esistono solo le
+// etichette delle righe visibili: scorrendo vengono riposizionate, e il testo di una riga viene
+// chiesto al callback solo quando la riga entra nella vista. Gli oggetti LVGL e la memoria del widget
+// non dipendono dal numero di voci (misurati da measure_credential_list() nei test di backend).
+// Come nel rullo, la voce selezionata e' quella nella banda centrale. La posizione e' in pixel a 32 bit:
+// lv_coord_t (16 bit) non basterebbe per decine di migliaia di righe.
+#define CREDENTIAL_LIST_MAX_ROWS 10     // Etichette massime: righe visibili piu' una parzialmente visibile
+#define CREDENTIAL_LIST_TEXT_LEN 96     // Testo di una riga: titolo (MAX_TITLE_LEN) ed eventuali simboli
+#define CREDENTIAL_LIST_TAP_SLOP 8      // Movimento massimo (px) perche' il tocco selezioni la riga toccata
+#define CREDENTIAL_LIST_FRAME_MS 16     // Periodo del timer dello scorrimento inerziale
+#define CREDENTIAL_LIST_FRICTION 0.95f  // Frazione della velocita' conservata a ogni passo dell'inerzia
+#define CREDENTIAL_LIST_MIN_SPEED 0.05f // px/ms: sotto questa velocita' l'inerzia si ferma sulla riga piu' vicina
+#define CREDENTIAL_LIST_IDLE_MS 100     // Dito fermo da piu' di cosi' al rilascio: nessuna inerzia
+#define CREDENTIAL_LIST_SNAP_MS 200     // Durata dell'allineamento animato su una riga
+#define CREDENTIAL_LIST_RETRY_MS 100    // Nuova richiesta del testo delle righe rimaste provvisorie
+#define CREDENTIAL_LIST_PLACEHOLDER "..."  // Testo provvisorio di una riga non ancora disponibile
+
+class CredentialList {
+public:
+    // Scrive in 'buffer' il testo della riga 'row' (0 <= row < getCount()). Viene chiamato durante il
+    // disegno e non deve bloccare: se il testo non e' disponibile subito restituisce false, la riga
+    // mostra CREDENTIAL_LIST_PLACEHOLDER e viene richiesta di nuovo dopo CREDENTIAL_LIST_RETRY_MS.
+    typedef bool (*TextCallback)(uint32_t row, char* buffer, size_t len, void* user);
+
+    CredentialList();
+    CredentialList(const CredentialList&) = delete;
+    CredentialList& operator=(const CredentialList&) = delete;
+
+    // Crea l'oggetto LVGL. Le righe ereditano font e colore del testo dallo stile principale;
+    // la riga selezionata usa font, opacita' del testo e colore di sfondo di LV_PART_SELECTED, come lv_roller.
+    // Gli stili e le dimensioni vanno impostati prima della prima setCount().
+    lv_obj_t* create(lv_obj_t* parent, lv_coord_t row_height, TextCallback text_cb, void* user);
+    // Vero finche' l'oggetto esiste (lv_obj_clean della schermata lo elimina)
+    bool isValid() const { return m_obj != NULL; }
+    lv_obj_t* obj() const { return m_obj; }
+
+    // Nuovo contenuto: i testi visibili vengono richiesti di nuovo e la selezione resta entro i limiti
+    void setCount(uint32_t count);
+    uint32_t getCount() const { return m_count; }
+    void setSelected(uint32_t row, lv_anim_enable_t anim);
+    uint32_t getSelected() const;
+    // Testo mostrato per la riga selezionata ("" se la lista e' vuota o il testo e' ancora provvisorio)
+    const char* getSelectedText() const;
+
+private:
+    static void _eventCb(lv_event_t* e);
+    static void _momentumCb(lv_timer_t* timer);
+    static void _snapAnimCb(void* var, int32_t value);
+    static void _retryCb(lv_timer_t* timer);
+
+    void _release(bool tap);
+    void _setOffset(int32_t offset);
+    void _render(bool reload);
+    void _styleRow(uint8_t label, bool selected);
+    void _stopMotion();
+    int32_t _maxOffset() const;
+    int32_t _top() const;
+
+    lv_obj_t* m_obj;
+    lv_obj_t* m_band;                                // Sfondo della riga selezionata, fermo al centro
+    lv_obj_t* m_labels[CREDENTIAL_LIST_MAX_ROWS];
+    int32_t m_label_rows[CREDENTIAL_LIST_MAX_ROWS];  // Riga mostrata da ogni etichetta (-1 = nessuna)
+    bool m_label_selected[CREDENTIAL_LIST_MAX_ROWS];
+    bool m_label_pending[CREDENTIAL_LIST_MAX_ROWS];  // Testo provvisorio: il callback ha restituito false
+    uint8_t m_row_count;                             // Etichette usate con l'altezza attuale
+    lv_coord_t m_row_height;
+    TextCallback m_text_cb;
+    void* m_user;
+    uint32_t m_count;
+
+    int32_t m_offset;           // La riga r e' al centro quando m_offset == r * m_row_height
+    float m_velocity;           // px/ms, positiva verso il fondo della lista
+    float m_remainder;          // Frazione di pixel non ancora applicata dall'inerzia
+    int32_t m_drag_distance;    // Movimento totale del dito dall'ultima pressione
+    uint32_t m_last_drag_tick;
+    lv_timer_t* m_timer;        // Scorrimento inerziale in corso
+    lv_timer_t* m_retry_timer;  // Nuova richiesta delle righe provvisorie
+};
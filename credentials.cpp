@@ -1,50 +1,800 @@
 #include "credentials.h"
 #include <SD_MMC.h>
 #include <Arduino.h>
+#include <algorithm>
+#include <unistd.h>
+#include "esp_heap_caps.h"
+#include "mbedtls/platform_util.h"
+#include "crc32c.h"
 
 extern HWCDC USBSerial;
 
-CredentialsManager::CredentialsManager() : m_credential_count(0) {}
+CredentialsManager::CredentialsManager()
+    : m_credential_count(0), m_tombstone_count(0), m_dead_bytes(0), m_corrupt_count(0), m_records_crc(0),
+      m_vault_features(0), m_secrets_id(0), m_secrets_ok(false), m_secrets_size(0), m_inline_count(0),
+      m_format_version(0), m_generation(0), m_table_offset(0), m_header_size(0), m_wipe_running(false),
+      m_mutex(xSemaphoreCreateRecursiveMutex()), m_batch_depth(0), m_title_index_carry(false) {}
+
+CredentialsManager::Lock::Lock(const CredentialsManager& manager) : Lock(manager.m_mutex, portMAX_DELAY) {}
+
+CredentialsManager::Lock::Lock(const CredentialsManager& manager, TickType_t wait) : Lock(manager.m_mutex, wait) {}
+
+CredentialsManager::Lock::Lock(SemaphoreHandle_t mutex, TickType_t wait)
+    : m_mutex(mutex), m_held(mutex && xSemaphoreTakeRecursive(mutex, wait) == pdTRUE) {}
+
+CredentialsManager::Lock::~Lock() {
+    if (m_held) xSemaphoreGiveRecursive(m_mutex);
+}
 
 void CredentialsManager::begin() {
+    Lock lock(*this);
     USBSerial.println("DEBUG CredMan: Esecuzione di begin()...");
+    _commitJournal();  // Un batch aperto va scritto prima di ricaricare l'indice dal file
+    _resetIndex();
+
+    // Sovrascrittura di un vault cancellato interrotta da un riavvio: la riprende
+    if (SD_MMC.exists(CREDENTIALS_WIPE_FILE) || SD_MMC.exists(CREDENTIALS_SECRETS_WIPE_FILE) ||
+        SD_MMC.exists(JOURNAL_WIPE_FILE)) {
+        USBSerial.println("ATTENZIONE CredMan: Trovato un vault da sovrascrivere. Riprendo la cancellazione.");
+        _startBackgroundWipe();
+    }
+
+    // Una migrazione (o un cambio PIN) interrotta tra remove() e rename() lascia solo il file temporaneo
+    if (!SD_MMC.exists(CREDENTIALS_FILE) && SD_MMC.exists(CREDENTIALS_TMP_FILE)) {
+        USBSerial.println("ATTENZIONE CredMan: Trovato solo il file temporaneo. Completo la sostituzione interrotta.");
+        SD_MMC.rename(CREDENTIALS_TMP_FILE, CREDENTIALS_FILE);
+    }
+
+    bool offsets_loaded = false;
     if (SD_MMC.exists(CREDENTIALS_FILE)) {
         File file = SD_MMC.open(CREDENTIALS_FILE, FILE_READ);
         if (file) {
-            long file_size = file.size();
-            USBSerial.printf("DEBUG CredMan: Trovato credentials.bin. Dimensione: %ld bytes.\n", file_size);
-            if (file_size > 0 && file_size % CREDENTIAL_RECORD_SIZE == 0) {
-                 m_credential_count = file_size / CREDENTIAL_RECORD_SIZE;
+            size_t file_size = file.size();
+            USBSerial.printf("DEBUG CredMan: Trovato credentials.bin. Dimensione: %d bytes.\n", file_size);
+
+            char magic[4] = {0};
+            // Un vault vuoto dei formati precedenti e' solo l'header corto (VAULT_HEADER_MIN_SIZE)
+            bool is_v2 = file_size >= VAULT_HEADER_MIN_SIZE && file.read((uint8_t*)magic, 4) == 4 && memcmp(magic, VAULT_MAGIC, 4) == 0;
+            if (file_size == 0) {
+                USBSerial.println("DEBUG CredMan: credentials.bin e' vuoto. Lo rimuovo.");
+                file.close();
+                SD_MMC.remove(CREDENTIALS_FILE);
+            } else if (is_v2) {
+                offsets_loaded = _loadV2Offsets(file, file_size);
+            } else if (file_size > 0 && file_size % CREDENTIAL_RECORD_SIZE == 0) {
+                offsets_loaded = _loadV1Offsets(file_size);
             } else {
-                USBSerial.printf("ATTENZIONE CredMan: La dimensione del file (%ld) non e' un multiplo di %d. Imposto conteggio a 0.\n", file_size, CREDENTIAL_RECORD_SIZE);
-                m_credential_count = 0;
+                USBSerial.printf("ATTENZIONE CredMan: Formato non riconosciuto o dimensione del file (%d) non multipla di %d. Imposto conteggio a 0.\n", file_size, CREDENTIAL_RECORD_SIZE);
             }
-            file.close();
+            file.close(); // La scansione usa il proprio handle (RangeReader)
         } else {
             USBSerial.println("ERRORE CredMan: Impossibile aprire credentials.bin, anche se esiste. Imposto conteggio a 0.");
-            m_credential_count = 0;
         }
     } else {
         USBSerial.println("DEBUG CredMan: Il file credentials.bin non esiste. Imposto conteggio a 0.");
-        m_credential_count = 0;
     }
-    USBSerial.printf("INFO CredMan: Conteggio credenziali impostato a %d.\n", m_credential_count);
+
+    // Modifiche sul posto interrotte: il giornale le completa prima che l'indice legga i record
+    if (offsets_loaded && m_format_version == VAULT_VERSION) {
+        File vault = SD_MMC.open(CREDENTIALS_FILE, "r+");
+        if (vault) {
+            VaultJournal::replay(vault, m_generation, m_table_offset);
+            vault.close();
+        }
+    } else {
+        VaultJournal::reset();  // Nessun vault v2 a cui applicarlo
+    }
+    if (offsets_loaded && m_format_version == VAULT_VERSION) _openSecrets();
+
+    if (offsets_loaded) {
+        // Costruisce l'indice con un'unica lettura sequenziale, a blocchi
+        size_t total = m_credential_count;
+        size_t indexed = 0;
+        uint32_t live_bytes = 0;
+        uint32_t records_crc = 0;
+        uint32_t header_records_crc = m_records_crc;
+        uint32_t scan_start = millis();
+        m_deleted.assign(total, false);
+        m_corrupt.assign(total, false);
+        RangeReader reader(*this, 0, SIZE_MAX, false);  // Solo metadati: le password non servono all'indice
+        const Credential* cred;
+        while ((cred = reader.next()) != nullptr) {
+            _indexStrings(m_index[reader.index()], *cred);
+            records_crc ^= cred->crc;
+            bool external = cred->flags & VAULT_FLAG_SECRET_FILE;
+            if (m_format_version == VAULT_VERSION && !external && !(cred->flags & VAULT_FLAG_CORRUPT)) {
+                m_inline_count++;
+            }
+            // Senza un file delle password valido le password dei record esterni non sono leggibili
+            if ((cred->flags & VAULT_FLAG_CORRUPT) || (external && !m_secrets_ok)) {
+                m_corrupt[reader.index()] = true;
+                m_corrupt_count++;
+            }
+            if (cred->flags & VAULT_FLAG_TOMBSTONE) {
+                m_deleted[reader.index()] = true;
+                m_tombstone_count++;
+            } else {
+                live_bytes += _recordSize(*cred);
+            }
+            indexed++;
+        }
+        if (indexed != total) {
+            USBSerial.printf("ERRORE CredMan: Lettura interrotta al record %d di %d.\n", indexed, total);
+            m_index.resize(indexed);
+            m_deleted.resize(indexed);
+            m_corrupt.resize(indexed);
+            m_credential_count = indexed;
+        }
+        m_records_crc = records_crc;
+        if (m_corrupt_count > 0) {
+            USBSerial.printf("ERRORE CredMan: %d record con CRC non valido. Sono segnalati nella lista.\n", m_corrupt_count);
+        }
+        if ((m_vault_features & VAULT_FEATURE_CRC) && indexed == total && records_crc != header_records_crc) {
+            USBSerial.println("ERRORE CredMan: Il digest dei record nell'header non corrisponde al contenuto del vault.");
+        }
+        USBSerial.printf("DEBUG CredMan: Indice costruito e verificato in %u ms.\n", millis() - scan_start);
+        // Tutto cio' che sta tra header e tabella, o nel file delle password, e non appartiene
+        // a un record valido e' spazio perso
+        uint32_t stored_bytes = m_table_offset - m_header_size;
+        if (m_secrets_ok) stored_bytes += m_secrets_size - sizeof(VaultSecretsHeader);
+        if (m_format_version == VAULT_VERSION && stored_bytes >= live_bytes) {
+            m_dead_bytes = stored_bytes - live_bytes;
+        }
+    }
+    USBSerial.printf("INFO CredMan: Vault v%d, conteggio credenziali impostato a %d (indice: %d bytes di stringhe).\n", m_format_version, m_credential_count, m_string_pool.size());
+    if (m_tombstone_count > 0 || m_dead_bytes > 0) {
+        USBSerial.printf("DEBUG CredMan: %d record eliminati, %d bytes recuperabili con la compattazione.\n", m_tombstone_count, m_dead_bytes);
+    }
+
+    // Migrazione una tantum dal formato v1 (record fissi) al formato v2 compatto
+    if (m_format_version == 1 && m_credential_count > 0) {
+        if (_migrateV1toV2()) {
+            begin();
+            return;
+        }
+        USBSerial.println("ERRORE CredMan: Migrazione a v2 fallita. Il vault resta in formato v1 (sola lettura).");
+    }
+
+    // Separazione una tantum delle password dai metadati, per i vault scritti prima del file delle password
+    if (m_format_version == VAULT_VERSION && m_inline_count > 0) {
+        USBSerial.printf("INFO CredMan: %d record con la password nel vault. Le sposto nel file delle password...\n", m_inline_count);
+        if (compact()) return;  // compact() ricarica l'indice
+        USBSerial.println("ERRORE CredMan: Separazione delle password fallita. Il vault resta utilizzabile cosi' com'e'.");
+    }
+    _loadTitleIndex();
 }
 
+bool CredentialsManager::_loadV1Offsets(size_t file_size) {
+    size_t total = file_size / CREDENTIAL_RECORD_SIZE;
+    m_index.resize(total);
+    for (size_t i = 0; i < total; i++) {
+        m_index[i] = { (uint32_t)(i * CREDENTIAL_RECORD_SIZE), 0, 0 };
+    }
+    m_format_version = 1;
+    m_credential_count = total;
+    return true;
+}
+
+bool CredentialsManager::_loadV2Offsets(File& file, size_t file_size) {
+    VaultHeader header;
+    memset(&header, 0, sizeof(header));
+    file.seek(0);
+    if (file.read((uint8_t*)&header, VAULT_HEADER_MIN_SIZE) != VAULT_HEADER_MIN_SIZE) return false;
+    // Header piu' corto (vault precedenti): i campi aggiunti dopo restano a 0
+    size_t extra = std::min((size_t)header.header_size, sizeof(header)) - std::min((size_t)header.header_size, VAULT_HEADER_MIN_SIZE);
+    if (extra > 0 && file.read((uint8_t*)&header + VAULT_HEADER_MIN_SIZE, extra) != extra) return false;
+
+    uint64_t table_end = (uint64_t)header.table_offset + (uint64_t)header.record_count * sizeof(uint32_t);
+    if (header.version != VAULT_VERSION || header.header_size < VAULT_HEADER_MIN_SIZE ||
+        header.table_offset < header.header_size || table_end > file_size) {
+        USBSerial.printf("ERRORE CredMan: Header v2 non valido (versione %d, tabella a %d, %d record).\n", header.version, header.table_offset, header.record_count);
+        return false;
+    }
 
-bool CredentialsManager::importFromSD(const char* filepath, Crypto& crypto) {
-    // --- 1. Carica le credenziali esistenti in memoria ---
-    begin(); // Assicurati che il conteggio sia aggiornato
-    std::vector<Credential> existing_creds;
-    if (m_credential_count > 0) {
-        File existing_file = SD_MMC.open(CREDENTIALS_FILE, FILE_READ);
-        if (existing_file) {
-            existing_creds.resize(m_credential_count);
-            existing_file.read((uint8_t*)existing_creds.data(), m_credential_count * sizeof(Credential));
-            existing_file.close();
-            USBSerial.printf("DEBUG Import: Caricate %d credenziali esistenti in memoria per il controllo.\n", m_credential_count);
+    std::vector<uint32_t> offsets(header.record_count);
+    if (header.record_count > 0) {
+        file.seek(header.table_offset);
+        size_t bytes = header.record_count * sizeof(uint32_t);
+        if (file.read((uint8_t*)offsets.data(), bytes) != bytes) return false;
+    }
+    // Una tabella danneggiata viene segnalata; i singoli offset sono comunque verificati qui sotto
+    // e i record raggiunti hanno il proprio CRC.
+    if ((header.features & VAULT_FEATURE_CRC) &&
+        Crc32c::compute(offsets.data(), header.record_count * sizeof(uint32_t)) != header.table_crc) {
+        USBSerial.println("ERRORE CredMan: CRC della tabella degli offset non valido. Il vault potrebbe essere danneggiato.");
+    }
+
+    m_index.resize(header.record_count);
+    for (size_t i = 0; i < header.record_count; i++) {
+        if (offsets[i] < header.header_size || offsets[i] >= header.table_offset) {
+            USBSerial.printf("ERRORE CredMan: Offset non valido per il record %d.\n", i);
+            m_index.clear();
+            return false;
         }
+        m_index[i] = { offsets[i], 0, 0 };
+    }
+    m_format_version = VAULT_VERSION;
+    m_vault_features = header.features;
+    m_secrets_id = header.secrets_id;
+    m_records_crc = header.records_crc;  // Sostituito dal valore calcolato durante la scansione
+    m_generation = header.generation;
+    m_table_offset = header.table_offset;
+    m_header_size = header.header_size;
+    m_credential_count = header.record_count;
+    return true;
+}
+
+bool CredentialsManager::_migrateV1toV2() {
+    USBSerial.printf("INFO CredMan: Migrazione di %d credenziali dal formato v1 al formato v2...\n", m_credential_count);
+    VaultWriter writer;
+    if (!writer.create(CREDENTIALS_TMP_FILE, CREDENTIALS_SECRETS_TMP_FILE)) return false;
+
+    RangeReader reader(*this);
+    const Credential* cred;
+    while ((cred = reader.next()) != nullptr) {
+        if (!writer.add(*cred)) break;
     }
+    reader.close();
+
+    if (writer.count() != m_credential_count || !writer.finish()) {
+        writer.rollback();
+        return false;
+    }
+    _replaceWithTmp();
+    USBSerial.println("OK CredMan: Migrazione a v2 completata.");
+    return true;
+}
+
+void CredentialsManager::_resetIndex() {
+    m_index.clear();
+    m_string_pool.clear();
+    m_deleted.clear();
+    m_corrupt.clear();
+    m_corrupt_count = 0;
+    m_records_crc = 0;
+    m_vault_features = 0;
+    m_secrets_id = 0;
+    m_secrets_ok = false;
+    m_secrets_size = 0;
+    m_inline_count = 0;
+    m_credential_count = 0;
+    m_tombstone_count = 0;
+    m_dead_bytes = 0;
+    m_format_version = 0;
+    m_generation = 0;
+    m_table_offset = 0;
+    m_header_size = 0;
+}
+
+void CredentialsManager::_loadTitleIndex() {
+    bool carry = m_title_index_carry;
+    m_title_index_carry = false;
+    if (m_credential_count == 0) {
+        m_title_index.clear();
+        TitleIndex::remove();
+        return;
+    }
+    if (m_title_index.load(m_generation, m_credential_count, m_records_crc)) {
+        USBSerial.println("DEBUG CredMan: Indice dei titoli caricato da credentials.idx.");
+        return;
+    }
+
+    uint32_t start = millis();
+    size_t known = m_title_index.size();
+    if (carry && m_title_index.extend(m_index, m_string_pool.data())) {
+        USBSerial.printf("DEBUG CredMan: Indice dei titoli aggiornato con %d nuove voci in %u ms.\n",
+                         m_credential_count - known, millis() - start);
+    } else {
+        m_title_index.rebuild(m_index, m_string_pool.data());
+        USBSerial.printf("DEBUG CredMan: Indice dei titoli ricostruito (%d voci) in %u ms.\n", m_credential_count, millis() - start);
+    }
+    _saveTitleIndex();
+}
+
+void CredentialsManager::_saveTitleIndex() {
+    m_title_index.save(m_generation, m_records_crc);
+}
+
+size_t CredentialsManager::getSortedIndex(size_t position) const {
+    Lock lock(*this);
+    return position < m_title_index.size() ? m_title_index.at(position) : position;
+}
+
+size_t CredentialsManager::getLetterStart(uint8_t letter) const {
+    Lock lock(*this);
+    return letter < TITLE_INDEX_LETTERS ? m_title_index.letterStart(letter) : m_title_index.size();
+}
+
+void CredentialsManager::_indexStrings(CredentialIndexEntry& entry, const Credential& cred) {
+    size_t title_len = strlen(cred.title);
+    size_t username_len = strlen(cred.username);
+
+    entry.title_pos = m_string_pool.size();
+    m_string_pool.insert(m_string_pool.end(), cred.title, cred.title + title_len + 1);
+    Collation::makeKey(cred.title, entry.title_key, COLLATION_KEY_LEN);
+
+    entry.username_pos = m_string_pool.size();
+    m_string_pool.insert(m_string_pool.end(), cred.username, cred.username + username_len + 1);
+}
+
+const char* CredentialsManager::getTitle(size_t index) const {
+    Lock lock(*this);
+    if (index >= m_index.size()) return "";
+    return &m_string_pool[m_index[index].title_pos];
+}
+
+const char* CredentialsManager::getUsername(size_t index) const {
+    Lock lock(*this);
+    if (index >= m_index.size()) return "";
+    return &m_string_pool[m_index[index].username_pos];
+}
+
+// Header v2 di un record, senza spazio di riserva (slot_len = byte effettivamente usati).
+// I record scritti ora hanno sempre il CRC e la password nel file delle password.
+// Restituisce false se la password binaria non entra nel formato.
+bool CredentialsManager::_encodeRecordHeader(const Credential& cred, VaultRecordHeader* hdr) {
+    memset(hdr, 0, sizeof(*hdr));
+    hdr->flags = cred.flags | VAULT_FLAG_CRC | VAULT_FLAG_SECRET_FILE;
+    hdr->title_len = strnlen(cred.title, MAX_TITLE_LEN - 1);
+    hdr->username_len = strnlen(cred.username, MAX_USERNAME_LEN - 1);
+    if (cred.flags & VAULT_FLAG_BINARY_CIPHER) {
+        // Il testo cifrato binario puo' contenere zeri: la lunghezza e' quella dichiarata
+        if (cred.encrypted_len >= MAX_ENCRYPTED_PASS_LEN) return false;
+        hdr->password_len = cred.encrypted_len;
+    } else {
+        hdr->password_len = strnlen(cred.encrypted_password, MAX_ENCRYPTED_PASS_LEN - 1);
+    }
+    hdr->slot_len = _recordDataLen(*hdr) + sizeof(uint32_t);
+    return true;
+}
+
+size_t CredentialsManager::_recordDataLen(const VaultRecordHeader& hdr) {
+    size_t password_bytes = (hdr.flags & VAULT_FLAG_SECRET_FILE) ? sizeof(VaultSecretRef) : hdr.password_len;
+    return sizeof(hdr) + hdr.title_len + hdr.username_len + password_bytes;
+}
+
+uint32_t CredentialsManager::_writeRecord(uint8_t* out, const VaultRecordHeader& hdr, const Credential& cred, const VaultSecretRef& secret) {
+    uint8_t* p = out;
+    memcpy(p, &hdr, sizeof(hdr));
+    p += sizeof(hdr);
+    memcpy(p, cred.title, hdr.title_len);
+    p += hdr.title_len;
+    memcpy(p, cred.username, hdr.username_len);
+    p += hdr.username_len;
+    if (hdr.flags & VAULT_FLAG_SECRET_FILE) {
+        memcpy(p, &secret, sizeof(secret));
+        p += sizeof(secret);
+    } else {
+        memcpy(p, cred.encrypted_password, hdr.password_len);
+        p += hdr.password_len;
+    }
+    uint32_t crc = _recordCrc(out, p - out);
+    memcpy(p, &crc, sizeof(crc));
+    return crc;
+}
+
+uint32_t CredentialsManager::_recordCrc(const uint8_t* record, size_t data_len) {
+    // Il flag TOMBSTONE e' escluso: l'eliminazione riscrive un solo byte senza invalidare il CRC
+    VaultRecordHeader hdr;
+    memcpy(&hdr, record, sizeof(hdr));
+    hdr.flags &= ~VAULT_FLAG_TOMBSTONE;
+    uint32_t crc = Crc32c::update(0, &hdr, sizeof(hdr));
+    return Crc32c::update(crc, record + sizeof(hdr), data_len - sizeof(hdr));
+}
+
+size_t CredentialsManager::_recordSize(const VaultRecordHeader& hdr) {
+    size_t size = _recordDataLen(hdr) + ((hdr.flags & VAULT_FLAG_CRC) ? sizeof(uint32_t) : 0);
+    if (hdr.flags & VAULT_FLAG_SECRET_FILE) size += hdr.password_len;
+    return size;
+}
+
+size_t CredentialsManager::_recordSize(const Credential& cred) {
+    VaultRecordHeader hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.flags = cred.flags;
+    hdr.title_len = strnlen(cred.title, MAX_TITLE_LEN - 1);
+    hdr.username_len = strnlen(cred.username, MAX_USERNAME_LEN - 1);
+    hdr.password_len = cred.encrypted_len;
+    return _recordSize(hdr);
+}
+
+// Decodifica un record a partire da 'data'. Restituisce i byte occupati dal record:
+// se il valore supera 'avail' il record non e' completo nel buffer, se e' 0 il record e' corrotto.
+// Con VAULT_FLAG_SECRET_FILE la password non e' nel record: encrypted_password resta vuoto
+// (encrypted_len ne indica la lunghezza) finche' non viene letta con _readSecret().
+size_t CredentialsManager::_decodeRecord(uint16_t version, const uint8_t* data, size_t avail, Credential* out) {
+    if (version == 1) {
+        if (avail < CREDENTIAL_RECORD_SIZE) return CREDENTIAL_RECORD_SIZE;
+        memcpy(out->title, data, MAX_TITLE_LEN);
+        memcpy(out->username, data + MAX_TITLE_LEN, MAX_USERNAME_LEN);
+        memcpy(out->encrypted_password, data + MAX_TITLE_LEN + MAX_USERNAME_LEN, MAX_ENCRYPTED_PASS_LEN);
+        // I campi su disco non sono garantiti terminati da '\0'
+        out->title[MAX_TITLE_LEN - 1] = '\0';
+        out->username[MAX_USERNAME_LEN - 1] = '\0';
+        out->encrypted_password[MAX_ENCRYPTED_PASS_LEN - 1] = '\0';
+        out->encrypted_len = strlen(out->encrypted_password);
+        out->flags = 0; // Il formato v1 contiene solo password base64
+        out->crc = 0;
+        return CREDENTIAL_RECORD_SIZE;
+    }
+
+    if (avail < sizeof(VaultRecordHeader)) return sizeof(VaultRecordHeader);
+    VaultRecordHeader hdr;
+    memcpy(&hdr, data, sizeof(hdr));
+    size_t data_len = _recordDataLen(hdr);
+    size_t used = data_len + ((hdr.flags & VAULT_FLAG_CRC) ? sizeof(uint32_t) : 0);
+    if (hdr.title_len >= MAX_TITLE_LEN || hdr.username_len >= MAX_USERNAME_LEN ||
+        hdr.password_len >= MAX_ENCRYPTED_PASS_LEN || hdr.slot_len < used) {
+        return 0;
+    }
+    if (avail < used) return used;
+
+    const uint8_t* p = data + sizeof(hdr);
+    memcpy(out->title, p, hdr.title_len);
+    out->title[hdr.title_len] = '\0';
+    p += hdr.title_len;
+    memcpy(out->username, p, hdr.username_len);
+    out->username[hdr.username_len] = '\0';
+    p += hdr.username_len;
+    if (hdr.flags & VAULT_FLAG_SECRET_FILE) {
+        memcpy(&out->secret, p, sizeof(out->secret));
+        out->encrypted_password[0] = '\0';
+    } else {
+        memcpy(out->encrypted_password, p, hdr.password_len);
+        out->encrypted_password[hdr.password_len] = '\0';
+    }
+    out->encrypted_len = hdr.password_len;
+    out->flags = hdr.flags;
+    out->crc = 0;
+    if (hdr.flags & VAULT_FLAG_CRC) {
+        memcpy(&out->crc, data + data_len, sizeof(out->crc));
+        if (_recordCrc(data, data_len) != out->crc) out->flags |= VAULT_FLAG_CORRUPT;
+    }
+    return used;
+}
+
+bool CredentialsManager::_readSecret(File& secrets, Credential* cred) {
+    size_t len = cred->encrypted_len;
+    bool ok = secrets && secrets.seek(cred->secret.offset) &&
+              secrets.read((uint8_t*)cred->encrypted_password, len) == len &&
+              Crc32c::compute(cred->encrypted_password, len) == cred->secret.crc;
+    if (!ok) {
+        mbedtls_platform_zeroize(cred->encrypted_password, sizeof(cred->encrypted_password));
+        cred->flags |= VAULT_FLAG_CORRUPT;
+        return false;
+    }
+    cred->encrypted_password[len] = '\0';
+    return true;
+}
+
+bool CredentialsManager::_appendSecret(const Credential& cred, uint32_t length, VaultSecretRef* ref) {
+    File secrets = SD_MMC.open(CREDENTIALS_SECRETS_FILE, FILE_APPEND);
+    if (!secrets) return false;
+    ref->offset = secrets.size();
+    ref->crc = Crc32c::compute(cred.encrypted_password, length);
+    // Reso persistente prima che il record lo punti; se il record non viene scritto resta spazio perso
+    bool ok = secrets.write((const uint8_t*)cred.encrypted_password, length) == length;
+    secrets.flush();
+    secrets.close();
+    if (ok) m_secrets_size = ref->offset + length;
+    return ok;
+}
+
+void CredentialsManager::_openSecrets() {
+    // Sostituzione interrotta dopo la pubblicazione del nuovo vault: il file temporaneo e' quello giusto
+    if (SD_MMC.exists(CREDENTIALS_SECRETS_TMP_FILE)) {
+        VaultSecretsHeader tmp_header = {0};
+        File tmp = SD_MMC.open(CREDENTIALS_SECRETS_TMP_FILE, FILE_READ);
+        bool current = tmp && tmp.read((uint8_t*)&tmp_header, sizeof(tmp_header)) == sizeof(tmp_header) &&
+                       memcmp(tmp_header.magic, VAULT_SECRETS_MAGIC, 4) == 0 &&
+                       (m_vault_features & VAULT_FEATURE_SECRETS) && tmp_header.secrets_id == m_secrets_id;
+        if (tmp) tmp.close();
+        if (current) {
+            USBSerial.println("ATTENZIONE CredMan: Completo la sostituzione interrotta del file delle password.");
+            SD_MMC.remove(CREDENTIALS_SECRETS_FILE);
+            SD_MMC.rename(CREDENTIALS_SECRETS_TMP_FILE, CREDENTIALS_SECRETS_FILE);
+        } else {
+            SD_MMC.remove(CREDENTIALS_SECRETS_TMP_FILE);  // Resto di una scrittura mai pubblicata
+        }
+    }
+    if (!(m_vault_features & VAULT_FEATURE_SECRETS)) return;
+
+    VaultSecretsHeader header = {0};
+    File secrets = SD_MMC.open(CREDENTIALS_SECRETS_FILE, FILE_READ);
+    m_secrets_ok = secrets && secrets.read((uint8_t*)&header, sizeof(header)) == sizeof(header) &&
+                   memcmp(header.magic, VAULT_SECRETS_MAGIC, 4) == 0 && header.secrets_id == m_secrets_id;
+    if (secrets) {
+        m_secrets_size = secrets.size();
+        secrets.close();
+    }
+    if (!m_secrets_ok) {
+        USBSerial.println("ERRORE CredMan: File delle password mancante o di un altro vault. Le password non sono leggibili.");
+    }
+}
+
+void CredentialsManager::_replaceWithTmp() {
+    // Il vault e' il punto di commit: se il riavvio arriva prima della seconda rename,
+    // _openSecrets() riconosce il file delle password temporaneo dal suo identificativo
+    SD_MMC.remove(CREDENTIALS_FILE);
+    SD_MMC.rename(CREDENTIALS_TMP_FILE, CREDENTIALS_FILE);
+    SD_MMC.remove(CREDENTIALS_SECRETS_FILE);
+    SD_MMC.rename(CREDENTIALS_SECRETS_TMP_FILE, CREDENTIALS_SECRETS_FILE);
+}
+
+bool CredentialsManager::encryptPassword(Crypto& crypto, const String& plain_pass, Credential* cred) {
+    return encryptPassword(crypto, plain_pass.c_str(), plain_pass.length(), cred);
+}
+
+bool CredentialsManager::encryptPassword(Crypto& crypto, const char* plain_pass, size_t plain_len, Credential* cred) {
+    // L'ultimo byte resta libero: il campo viene sempre terminato da '\0' in lettura
+    size_t len = crypto.encrypt((const uint8_t*)plain_pass, plain_len, (uint8_t*)cred->encrypted_password, MAX_ENCRYPTED_PASS_LEN - 1);
+    if (len == 0) return false;
+    cred->encrypted_len = len;
+    cred->flags |= VAULT_FLAG_BINARY_CIPHER;
+    return true;
+}
+
+String CredentialsManager::decryptPassword(Crypto& crypto, const Credential& cred) {
+    char plain[MAX_ENCRYPTED_PASS_LEN];
+    size_t len = decryptPassword(crypto, cred, plain, sizeof(plain));
+    if (len == 0) return "";
+    String result(plain);
+    mbedtls_platform_zeroize(plain, len);
+    return result;
+}
+
+size_t CredentialsManager::decryptPassword(Crypto& crypto, const Credential& cred, char* out, size_t out_capacity) {
+    if (!out || out_capacity == 0) return 0;
+    size_t len;
+    if (cred.flags & VAULT_FLAG_BINARY_CIPHER) {
+        len = crypto.decrypt((const uint8_t*)cred.encrypted_password, cred.encrypted_len, (uint8_t*)out, out_capacity - 1);
+    } else {
+        len = crypto.decryptBase64(cred.encrypted_password, strlen(cred.encrypted_password), (uint8_t*)out, out_capacity - 1);
+    }
+    out[len] = '\0';
+    return len;
+}
+
+
+// Insieme di chiavi (titolo, utente) per il controllo duplicati dell'importazione:
+// hash FNV-1a a 64 bit in una tabella a indirizzamento aperto (sondaggio lineare).
+// Due credenziali diverse con lo stesso hash a 64 bit sono trattate come duplicati:
+// con poche migliaia di voci la probabilita' e' trascurabile.
+class CredentialKeySet {
+public:
+    explicit CredentialKeySet(size_t expected) : m_count(0) {
+        size_t capacity = 64;
+        while (capacity < expected * 2) capacity <<= 1;
+        m_slots.assign(capacity, 0);
+    }
+
+    static uint64_t hash(const char* title, const char* username) {
+        uint64_t h = 14695981039346656037ULL;  // FNV-1a: offset basis
+        for (const char* p = title; *p; p++) h = (h ^ (uint8_t)*p) * 1099511628211ULL;
+        h = (h ^ 0xFF) * 1099511628211ULL;    // Separatore: ("ab","c") != ("a","bc")
+        for (const char* p = username; *p; p++) h = (h ^ (uint8_t)*p) * 1099511628211ULL;
+        return h ? h : 1;                      // 0 indica uno slot libero
+    }
+
+    // Impronta FNV-1a di una password, per confrontarla senza conservarla in chiaro
+    static uint64_t hash(const char* data, size_t len) {
+        uint64_t h = 14695981039346656037ULL;
+        for (size_t i = 0; i < len; i++) h = (h ^ (uint8_t)data[i]) * 1099511628211ULL;
+        return h;
+    }
+
+    bool contains(uint64_t key) const {
+        size_t mask = m_slots.size() - 1;
+        for (size_t i = key & mask; m_slots[i] != 0; i = (i + 1) & mask) {
+            if (m_slots[i] == key) return true;
+        }
+        return false;
+    }
+
+    // Inserisce la chiave. Restituisce false se era gia' presente.
+    bool insert(uint64_t key) {
+        if ((m_count + 1) * 2 > m_slots.size()) _grow();
+        size_t mask = m_slots.size() - 1;
+        for (size_t i = key & mask;; i = (i + 1) & mask) {
+            if (m_slots[i] == key) return false;
+            if (m_slots[i] == 0) {
+                m_slots[i] = key;
+                m_count++;
+                return true;
+            }
+        }
+    }
+
+private:
+    void _grow() {
+        std::vector<uint64_t> old;
+        old.swap(m_slots);
+        m_slots.assign(old.size() * 2, 0);
+        m_count = 0;
+        for (uint64_t key : old) {
+            if (key) insert(key);
+        }
+    }
+
+    std::vector<uint64_t> m_slots;
+    size_t m_count;
+};
+
+// --- Pipeline di importazione ---
+// Parser (task chiamante) -> cifratura -> scrittura, tutti su IMPORT_PIPELINE_CORE quando il chiamante e' il
+// VaultWorker: la cifratura lavora mentre il parser aspetta la SD e la scrittura aspetta la flush.
+// Gli stadi si scambiano indici di slot di un pool fisso tramite code FreeRTOS limitate:
+// nessuna allocazione per record, e al massimo IMPORT_PIPELINE_SLOTS record in volo.
+struct ImportSlot {
+    Credential cred;
+    int32_t replace_index;  // IMPORT_ROW_ADD o indice del record da sostituire
+    char plain[CSV_MAX_FIELD_LEN + 1];
+    uint16_t plain_len;
+    bool ok;
+};
+
+struct ImportPipeline {
+    CredentialsManager::VaultWriter* writer;
+    Crypto* crypto;
+    ImportSlot* slots;
+    QueueHandle_t free_slots;   // Slot liberi, verso il parser
+    QueueHandle_t to_encrypt;   // Parser -> cifratura
+    QueueHandle_t to_write;     // Cifratura -> scrittura
+    QueueHandle_t done;         // Fine della scrittura, verso il parser
+    ImportProgress* progress;   // Facoltativo
+    volatile bool write_failed;
+    int written;
+    int replaced;
+};
+
+static void importEncryptTask(void* param) {
+    ImportPipeline* pipe = static_cast<ImportPipeline*>(param);
+    uint8_t idx;
+    for (;;) {
+        xQueueReceive(pipe->to_encrypt, &idx, portMAX_DELAY);
+        if (idx != IMPORT_PIPELINE_END) {
+            ImportSlot& slot = pipe->slots[idx];
+            slot.ok = CredentialsManager::encryptPassword(*pipe->crypto, slot.plain, slot.plain_len, &slot.cred);
+            mbedtls_platform_zeroize(slot.plain, sizeof(slot.plain));
+        }
+        xQueueSend(pipe->to_write, &idx, portMAX_DELAY);
+        if (idx == IMPORT_PIPELINE_END) break;
+    }
+    vTaskDelete(NULL);
+}
+
+static void importWriteTask(void* param) {
+    ImportPipeline* pipe = static_cast<ImportPipeline*>(param);
+    uint8_t idx;
+    for (;;) {
+        xQueueReceive(pipe->to_write, &idx, portMAX_DELAY);
+        if (idx == IMPORT_PIPELINE_END) break;
+        ImportSlot& slot = pipe->slots[idx];
+        if (slot.ok && !pipe->write_failed) {
+            if (slot.replace_index >= 0) {
+                if (pipe->writer->replace(slot.replace_index, slot.cred)) {
+                    pipe->replaced++;
+                    if (pipe->progress) pipe->progress->updated = pipe->replaced;
+                } else {
+                    pipe->write_failed = true;
+                }
+            } else if (pipe->writer->add(slot.cred)) {
+                pipe->written++;
+                if (pipe->progress) pipe->progress->imported = pipe->written;
+            } else {
+                pipe->write_failed = true;
+            }
+        }
+        xQueueSend(pipe->free_slots, &idx, portMAX_DELAY);
+    }
+    xQueueSend(pipe->done, &idx, portMAX_DELAY);
+    vTaskDelete(NULL);
+}
+
+// Stessi limiti di encryptPassword(): le righe che non li rispettano vengono saltate
+static bool importPasswordViable(const CsvField& password) {
+    return password.len > 0 && !password.truncated && Crypto::binarySize(password.len) <= MAX_ENCRYPTED_PASS_LEN - 1;
+}
+
+// Riga del CSV nel piano di aggiornamento: solo impronte, nessun dato in chiaro
+struct ImportKeyRow {
+    uint64_t key;       // Titolo e utente
+    uint64_t password;  // Impronta della password
+    uint32_t row;
+};
+
+// Coppia riga del CSV / record del vault con lo stesso titolo e utente
+struct ImportMatch {
+    uint32_t vault_index;
+    uint32_t row;
+    uint64_t password;
+};
+
+bool CredentialsManager::_planImportUpdate(const char* filepath, const CsvColumnMap& map, Crypto& crypto,
+                                           std::vector<int32_t>& actions, ImportProgress* progress) {
+    // --- 1. Impronte delle righe del CSV, in un passaggio separato con un secondo handle ---
+    File csvFile = SD_MMC.open(filepath);
+    if (!csvFile) return false;
+    std::vector<ImportKeyRow> rows;
+    uint32_t row = 0;
+    {
+        CsvReader reader(csvFile);
+        reader.next();  // Intestazione
+        reader.setColumnFilter(CsvReader::columnMask(map));
+        for (; reader.next(); row++) {
+            if (progress && progress->cancel) {
+                progress->cancelled = true;
+                return false;
+            }
+            CsvField title = reader.field(map.title);
+            CsvField username = reader.field(map.username);
+            CsvField password = reader.field(map.password);
+            if (title.len == 0 || !importPasswordViable(password)) continue;
+            char title_buf[MAX_TITLE_LEN] = {0};
+            char username_buf[MAX_USERNAME_LEN] = {0};
+            strncpy(title_buf, title.data, MAX_TITLE_LEN - 1);
+            strncpy(username_buf, username.data, MAX_USERNAME_LEN - 1);
+            rows.push_back({ CredentialKeySet::hash(title_buf, username_buf), CredentialKeySet::hash(password.data, password.len), row });
+        }
+    }
+    csvFile.close();
+    actions.assign(row, IMPORT_ROW_ADD);
+
+    // --- 2. Entrambi i lati ordinati per chiave ---
+    std::sort(rows.begin(), rows.end(), [](const ImportKeyRow& a, const ImportKeyRow& b) {
+        return a.key != b.key ? a.key < b.key : a.row < b.row;
+    });
+    std::vector<std::pair<uint64_t, uint32_t>> vault_keys;
+    vault_keys.reserve(m_credential_count);
+    for (size_t i = 0; i < m_credential_count; i++) {
+        if (m_deleted[i]) continue;  // Una voce eliminata e poi reimportata torna come nuova
+        vault_keys.push_back({ CredentialKeySet::hash(getTitle(i), getUsername(i)), (uint32_t)i });
+    }
+    std::sort(vault_keys.begin(), vault_keys.end());
+
+    // --- 3. Merge join: le righe senza corrispondenza sono nuove ---
+    std::vector<ImportMatch> matches;
+    size_t v = 0;
+    for (size_t i = 0; i < rows.size(); i++) {
+        if (i > 0 && rows[i].key == rows[i - 1].key) {
+            actions[rows[i].row] = IMPORT_ROW_DUPLICATE;  // Vale la prima occorrenza nel CSV
+            continue;
+        }
+        while (v < vault_keys.size() && vault_keys[v].first < rows[i].key) v++;
+        if (v < vault_keys.size() && vault_keys[v].first == rows[i].key) {
+            matches.push_back({ vault_keys[v].second, rows[i].row, rows[i].password });
+        }
+    }
+    std::vector<ImportKeyRow>().swap(rows);
+    std::vector<std::pair<uint64_t, uint32_t>>().swap(vault_keys);
+
+    // --- 4. Confronto delle password, con una sola scansione sequenziale del vault ---
+    std::sort(matches.begin(), matches.end(), [](const ImportMatch& a, const ImportMatch& b) {
+        return a.vault_index < b.vault_index;
+    });
+    if (matches.empty()) return true;
+    char plain[MAX_ENCRYPTED_PASS_LEN];
+    size_t m = 0;
+    RangeReader reader(*this, matches.front().vault_index, SIZE_MAX, true, false);
+    const Credential* cred;
+    while (m < matches.size() && (cred = reader.next()) != nullptr) {
+        if (reader.index() != matches[m].vault_index) continue;
+        size_t len = decryptPassword(crypto, *cred, plain, sizeof(plain));
+        bool same = len > 0 && CredentialKeySet::hash(plain, len) == matches[m].password;
+        actions[matches[m].row] = same ? IMPORT_ROW_UNCHANGED : (int32_t)matches[m].vault_index;
+        m++;
+    }
+    mbedtls_platform_zeroize(plain, sizeof(plain));
+    return true;
+}
+
+bool CredentialsManager::importFromSD(const char* filepath, Crypto& crypto, const CsvColumnMap* columns,
+                                      ImportProgress* progress, ImportMode mode) {
+    // Nessun Lock per tutta l'importazione: l'indice in RAM cambia solo dentro begin(), che lo prende.
+    // Fino ad allora il writer accoda al file e l'interfaccia continua a leggere l'indice precedente.
+    // --- 1. Aggiorna l'indice in RAM, usato per il controllo duplicati ---
+    begin(); // Assicurati che il conteggio e l'indice siano aggiornati
+    size_t existing_count = m_credential_count;
 
     // --- 2. Apri il file CSV da importare ---
     File csvFile = SD_MMC.open(filepath);
@@ -53,87 +803,881 @@ bool CredentialsManager::importFromSD(const char* filepath, Crypto& crypto) {
         return false;
     }
     
-    // Apri il file binario in modalità APPEND.
-    File binFile = SD_MMC.open(CREDENTIALS_FILE, FILE_APPEND);
-    if (!binFile) {
+    // Accoda al vault v2 esistente oppure ne crea uno nuovo.
+    VaultWriter writer;
+    bool writer_ok;
+    if (m_format_version == VAULT_VERSION) {
+        writer_ok = writer.openAppend(*this);
+    } else if (!SD_MMC.exists(CREDENTIALS_FILE)) {
+        writer_ok = writer.create(CREDENTIALS_FILE);
+    } else {
+        USBSerial.println("ERRORE CredMan: Il vault esistente non e' in formato v2. Importazione annullata per non danneggiarlo.");
+        writer_ok = false;
+    }
+    if (!writer_ok) {
         csvFile.close();
-        USBSerial.println("ERRORE CredMan: Impossibile aprire il file binario in modalità append!");
+        USBSerial.println("ERRORE CredMan: Impossibile aprire il vault in scrittura!");
         return false;
     }
 
-    // Salta l'intestazione
-    if (csvFile.available()) {
-        csvFile.readStringUntil('\n');
+    // Intestazione: serve a riconoscere le colonne (Chrome, Bitwarden, ...) se non sono indicate
+    CsvReader reader(csvFile);
+
+    // --- 3. Chiavi esistenti per il controllo duplicati, calcolate una volta sola dall'indice ---
+    CredentialKeySet keys(mode == ImportMode::APPEND ? existing_count + 256 : 0);
+    for (size_t i = 0; i < existing_count && mode == ImportMode::APPEND; i++) {
+        if (m_deleted[i]) continue;
+        keys.insert(CredentialKeySet::hash(getTitle(i), getUsername(i)));
+    }
+
+    CsvColumnMap map = { 0, 1, 2 };
+    if (reader.next()) {
+        map = columns ? *columns : CsvReader::detectColumns(reader);
+    }
+    // Vengono conservate solo le tre colonne usate: note e altri campi lunghi non occupano memoria
+    reader.setColumnFilter(CsvReader::columnMask(map));
+
+    // In aggiornamento l'esito di ogni riga e' deciso prima di cifrare: vengono cifrate solo le righe nuove o cambiate
+    std::vector<int32_t> actions;
+    if (mode == ImportMode::UPDATE && !_planImportUpdate(filepath, map, crypto, actions, progress)) {
+        csvFile.close();
+        writer.rollback();
+        if (!progress || !progress->cancelled) {
+            USBSerial.println("ERRORE CredMan: Impossibile confrontare il CSV con il vault.");
+        }
+        begin();
+        return false;
+    }
+
+    ImportPipeline pipe = {0};
+    pipe.writer = &writer;
+    pipe.crypto = &crypto;
+    pipe.progress = progress;
+    if (progress) {
+        progress->bytes_total = csvFile.size();
+        progress->bytes_read = 0;
+        progress->parsed = 0;
+        progress->imported = 0;
+        progress->updated = 0;
+        progress->unchanged = 0;
+        progress->skipped = 0;
+        progress->cancelled = false;
+    }
+    pipe.slots = (ImportSlot*)heap_caps_calloc(IMPORT_PIPELINE_SLOTS, sizeof(ImportSlot), MALLOC_CAP_8BIT);
+    pipe.free_slots = xQueueCreate(IMPORT_PIPELINE_SLOTS, sizeof(uint8_t));
+    pipe.to_encrypt = xQueueCreate(IMPORT_PIPELINE_SLOTS + 1, sizeof(uint8_t));
+    pipe.to_write = xQueueCreate(IMPORT_PIPELINE_SLOTS + 1, sizeof(uint8_t));
+    pipe.done = xQueueCreate(1, sizeof(uint8_t));
+    bool pipeline_ok = pipe.slots && pipe.free_slots && pipe.to_encrypt && pipe.to_write && pipe.done;
+    if (pipeline_ok) {
+        for (uint8_t i = 0; i < IMPORT_PIPELINE_SLOTS; i++) xQueueSend(pipe.free_slots, &i, 0);
+        // Il task di scrittura parte per primo: se la cifratura non si avvia, riceve subito la fine
+        pipeline_ok = xTaskCreatePinnedToCore(importWriteTask, "import_write", 4096, &pipe, 1, NULL, IMPORT_PIPELINE_CORE) == pdPASS;
+        if (pipeline_ok && xTaskCreatePinnedToCore(importEncryptTask, "import_encrypt", 4096, &pipe, 1, NULL, IMPORT_PIPELINE_CORE) != pdPASS) {
+            uint8_t end = IMPORT_PIPELINE_END;
+            xQueueSend(pipe.to_write, &end, portMAX_DELAY);
+            xQueueReceive(pipe.done, &end, portMAX_DELAY);
+            pipeline_ok = false;
+        }
     }
 
     int record_count = 0;
     int skipped_count = 0;
-    while (csvFile.available()) {
-        String line = csvFile.readStringUntil('\n');
-        line.trim();
-        if (line.length() == 0) continue;
-
-        int first_comma = line.indexOf(',');
-        int second_comma = line.indexOf(',', first_comma + 1);
-
-        if (first_comma > 0 && second_comma > first_comma) {
-            String title = line.substring(0, first_comma);
-            String username = line.substring(first_comma + 1, second_comma);
-            
-            // --- 3. CONTROLLO DUPLICATI ---
-            bool is_duplicate = false;
-            for (const auto& existing : existing_creds) {
-                // Un duplicato è definito da titolo E utente uguali.
-                if (title == existing.title && username == existing.username) {
-                    is_duplicate = true;
+    int unchanged_count = 0;
+    size_t row = 0;
+    uint32_t start_ms = millis();
+    if (pipeline_ok) {
+        while (!pipe.write_failed && reader.next()) {
+            if (progress) {
+                if (progress->cancel) {
+                    progress->cancelled = true;
                     break;
                 }
+                progress->parsed++;
+                progress->bytes_read = csvFile.position();
             }
+            CsvField title = reader.field(map.title);
+            CsvField username = reader.field(map.username);
+            CsvField password = reader.field(map.password);
+            int32_t action = row < actions.size() ? actions[row] : IMPORT_ROW_ADD;
+            row++;
+            if (title.len == 0) continue;
 
-            if (is_duplicate) {
+            // Un duplicato è definito da titolo E utente uguali, rispetto al vault e alle righe gia' importate.
+            char title_buf[MAX_TITLE_LEN] = {0};
+            char username_buf[MAX_USERNAME_LEN] = {0};
+            strncpy(title_buf, title.data, MAX_TITLE_LEN - 1);
+            strncpy(username_buf, username.data, MAX_USERNAME_LEN - 1);
+            if (action == IMPORT_ROW_UNCHANGED) {
+                unchanged_count++;
+                if (progress) progress->unchanged = unchanged_count;
+                continue;
+            }
+            uint64_t key = CredentialKeySet::hash(title_buf, username_buf);
+            if (action == IMPORT_ROW_DUPLICATE || (mode == ImportMode::APPEND && keys.contains(key))) {
                 skipped_count++;
-                USBSerial.printf("  - DUPLICATO: La credenziale '%s' con utente '%s' esiste gia'. Saltata.\n", title.c_str(), username.c_str());
+                if (progress) progress->skipped = skipped_count;
+                USBSerial.printf("  - DUPLICATO: La credenziale '%s' con utente '%s' esiste gia'. Saltata.\n", title_buf, username_buf);
                 continue; // Salta al prossimo ciclo del while
             }
 
-            // --- 4. Aggiungi solo se non è un duplicato ---
-            String plain_pass = line.substring(second_comma + 1);
-            String encrypted_pass = crypto.encrypt(plain_pass);
-
-            if (encrypted_pass.length() > 0 && encrypted_pass.length() < MAX_ENCRYPTED_PASS_LEN) {
-                Credential cred = {0};
-                strncpy(cred.title, title.c_str(), MAX_TITLE_LEN - 1);
-                strncpy(cred.username, username.c_str(), MAX_USERNAME_LEN - 1);
-                strncpy(cred.encrypted_password, encrypted_pass.c_str(), MAX_ENCRYPTED_PASS_LEN - 1);
-                binFile.write((uint8_t*)&cred, sizeof(Credential));
-                record_count++;
-            } else {
-                USBSerial.printf("  - ATTENZIONE: Password vuota per '%s'. Credenziale saltata.\n", title.c_str());
+            // Gli stessi limiti di encryptPassword(), verificati qui: la chiave va registrata subito
+            if (!importPasswordViable(password)) {
+                USBSerial.printf("  - ATTENZIONE: Password vuota o troppo lunga per '%s' (riga %d). Credenziale saltata.\n", title_buf, reader.lineNumber());
+                continue;
             }
+            if (mode == ImportMode::APPEND) keys.insert(key);  // Le righe successive con lo stesso titolo e utente sono duplicati
+
+            // --- 4. Passa il record allo stadio di cifratura ---
+            uint8_t idx;
+            xQueueReceive(pipe.free_slots, &idx, portMAX_DELAY);  // Attesa: gli stadi successivi sono pieni
+            ImportSlot& slot = pipe.slots[idx];
+            memset(&slot.cred, 0, sizeof(slot.cred));
+            memcpy(slot.cred.title, title_buf, MAX_TITLE_LEN);
+            memcpy(slot.cred.username, username_buf, MAX_USERNAME_LEN);
+            memcpy(slot.plain, password.data, password.len);
+            slot.plain_len = password.len;
+            slot.replace_index = action;
+            slot.ok = false;
+            xQueueSend(pipe.to_encrypt, &idx, portMAX_DELAY);
+            record_count++;
         }
+
+        // Fine del flusso: attraversa la cifratura e la scrittura, poi il parser viene sbloccato
+        uint8_t end = IMPORT_PIPELINE_END;
+        xQueueSend(pipe.to_encrypt, &end, portMAX_DELAY);
+        xQueueReceive(pipe.done, &end, portMAX_DELAY);
+        record_count = pipe.written + pipe.replaced;
+    } else {
+        USBSerial.println("ERRORE CredMan: Impossibile avviare la pipeline di importazione.");
+        pipe.write_failed = true;
+    }
+
+    if (pipe.slots) {
+        mbedtls_platform_zeroize(pipe.slots, IMPORT_PIPELINE_SLOTS * sizeof(ImportSlot));
+        heap_caps_free(pipe.slots);
     }
+    if (pipe.free_slots) vQueueDelete(pipe.free_slots);
+    if (pipe.to_encrypt) vQueueDelete(pipe.to_encrypt);
+    if (pipe.to_write) vQueueDelete(pipe.to_write);
+    if (pipe.done) vQueueDelete(pipe.done);
+
+    uint32_t elapsed_ms = millis() - start_ms;
+
     csvFile.close();
-    binFile.close();
-    
-    USBSerial.printf("DEBUG Import: Importazione terminata. Aggiunti %d nuovi record. Saltati %d duplicati.\n", record_count, skipped_count);
+    if (progress && progress->cancelled) {
+        USBSerial.println("INFO CredMan: Importazione annullata. Il vault torna alla lunghezza precedente.");
+        writer.rollback();
+        begin();
+        return false;
+    }
+    if (pipe.write_failed || !writer.finish()) {
+        USBSerial.println("ERRORE CredMan: Scrittura del vault fallita. Il vault precedente resta invariato.");
+        writer.rollback();
+        begin();
+        return false;
+    }
+    if (progress) progress->bytes_read = progress->bytes_total;
+
+    if (mode == ImportMode::UPDATE) {
+        USBSerial.printf("INFO CredMan: Aggiornamento terminato in %u ms. Aggiunti %d, aggiornati %d, invariati %d. Saltati %d duplicati.\n",
+                         elapsed_ms, pipe.written, pipe.replaced, unchanged_count, skipped_count);
+    } else {
+        USBSerial.printf("INFO CredMan: Importazione terminata in %u ms. Aggiunti %d nuovi record. Saltati %d duplicati.\n",
+                         elapsed_ms, record_count, skipped_count);
+    }
 
-    // Ricalcola il conteggio finale
+    // Ricalcola il conteggio finale. I record gia' presenti mantengono il titolo (UPDATE cambia solo
+    // la password): l'ordine dei titoli va solo esteso con le voci aggiunte.
+    m_title_index_carry = true;
     begin();
     return true;
 }
 size_t CredentialsManager::getCount() const { return m_credential_count; }
 
 bool CredentialsManager::getCredential(size_t index, Credential* cred) const {
+    Lock lock(*this);
     if (index >= m_credential_count || !cred) return false;
     File file = SD_MMC.open(CREDENTIALS_FILE);
     if (!file) return false;
-    file.seek(index * CREDENTIAL_RECORD_SIZE);
-    bool success = file.read((uint8_t*)cred, sizeof(Credential)) == sizeof(Credential);
+    uint8_t buf[VAULT_MAX_SLOT_SIZE];
+    file.seek(m_index[index].file_offset);
+    size_t read = file.read(buf, sizeof(buf));
     file.close();
-    return success;
+    size_t used = _decodeRecord(m_format_version, buf, read, cred);
+    if (used == 0 || used > read) return false;
+    if (!(cred->flags & VAULT_FLAG_SECRET_FILE)) return true;
+
+    // Solo qui (Visualizza/Invia) la password viene letta dal file delle password
+    if (!m_secrets_ok) return false;
+    File secrets = SD_MMC.open(CREDENTIALS_SECRETS_FILE, FILE_READ);
+    bool ok = _readSecret(secrets, cred);
+    if (secrets) secrets.close();
+    if (!ok) USBSerial.printf("ERRORE CredMan: Password del record %d illeggibile o con CRC non valido.\n", index);
+    return ok;
+}
+
+size_t CredentialsManager::readRange(size_t start, size_t count, Credential* out) const {
+    if (!out) return 0;
+    size_t read = 0;
+    RangeReader reader(*this, start, count);
+    const Credential* cred;
+    while ((cred = reader.next()) != nullptr) {
+        out[read++] = *cred;
+    }
+    return read;
 }
 
 void CredentialsManager::clear() {
+    Lock lock(*this);
+    m_journal.discard();
+    VaultJournal::reset();
     if (SD_MMC.exists(CREDENTIALS_FILE)) SD_MMC.remove(CREDENTIALS_FILE);
-    m_credential_count = 0;
-}
\ No newline at end of file
+    if (SD_MMC.exists(CREDENTIALS_SECRETS_FILE)) SD_MMC.remove(CREDENTIALS_SECRETS_FILE);
+    _resetIndex();
+    m_title_index.clear();
+    TitleIndex::remove();
+}
+
+bool CredentialsManager::isDeleted(size_t index) const {
+    Lock lock(*this);
+    return index < m_deleted.size() && m_deleted[index];
+}
+
+bool CredentialsManager::isCorrupt(size_t index) const {
+    Lock lock(*this);
+    return index < m_corrupt.size() && m_corrupt[index];
+}
+
+bool CredentialsManager::needsCompaction() const {
+    return m_tombstone_count >= VAULT_COMPACT_TOMBSTONES || m_dead_bytes >= VAULT_COMPACT_DEAD_BYTES;
+}
+
+bool CredentialsManager::_readRecordHeader(File& file, size_t index, VaultRecordHeader* hdr) const {
+    return file.seek(m_index[index].file_offset) && file.read((uint8_t*)hdr, sizeof(*hdr)) == sizeof(*hdr);
+}
+
+void CredentialsManager::beginBatch() {
+    Lock lock(*this);
+    m_batch_depth++;
+}
+
+bool CredentialsManager::commitBatch() {
+    Lock lock(*this);
+    if (m_batch_depth > 0) m_batch_depth--;
+    return m_batch_depth > 0 || _commitJournal();
+}
+
+bool CredentialsManager::_commitJournal() {
+    if (!m_journal.hasPending()) return true;
+    File vault = SD_MMC.open(CREDENTIALS_FILE, "r+");
+    if (!vault) {
+        m_journal.discard();
+        return false;
+    }
+    bool ok = m_journal.commit(vault);
+    vault.close();
+    return ok;
+}
+
+bool CredentialsManager::_journalWrite(uint32_t offset, const uint8_t* data, uint16_t length) {
+    // Transazione piena: viene chiusa e la scrittura apre la successiva
+    if (!m_journal.stage(m_generation, offset, data, length)) {
+        if (!_commitJournal() || !m_journal.stage(m_generation, offset, data, length)) return false;
+    }
+    return m_batch_depth > 0 || _commitJournal();
+}
+
+bool CredentialsManager::deleteCredential(size_t index) {
+    Lock lock(*this);
+    if (m_format_version != VAULT_VERSION || index >= m_credential_count || m_deleted[index]) return false;
+    File file = SD_MMC.open(CREDENTIALS_FILE, FILE_READ);
+    if (!file) return false;
+    VaultRecordHeader hdr;
+    bool ok = _readRecordHeader(file, index, &hdr);
+    file.close();
+
+    // Si riscrive solo il byte dei flag: il record resta nella tabella e gli indici non cambiano
+    uint8_t flags = hdr.flags | VAULT_FLAG_TOMBSTONE;
+    ok = ok && _journalWrite(m_index[index].file_offset + offsetof(VaultRecordHeader, flags), &flags, 1);
+    if (!ok) {
+        USBSerial.printf("ERRORE CredMan: Impossibile eliminare il record %d.\n", index);
+        return false;
+    }
+    m_deleted[index] = true;
+    m_tombstone_count++;
+    m_dead_bytes += _recordSize(hdr);
+    USBSerial.printf("DEBUG CredMan: Record %d eliminato (%d record eliminati in attesa di compattazione).\n", index, m_tombstone_count);
+    return true;
+}
+
+bool CredentialsManager::updateCredential(size_t index, const Credential& cred) {
+    Lock lock(*this);
+    if (m_format_version != VAULT_VERSION || index >= m_credential_count || m_deleted[index]) return false;
+    Credential record = cred;
+    record.flags &= ~(VAULT_FLAG_TOMBSTONE | VAULT_FLAG_CORRUPT);
+    VaultRecordHeader hdr;
+    if (!_encodeRecordHeader(record, &hdr)) return false;
+
+    File file = SD_MMC.open(CREDENTIALS_FILE, FILE_READ);
+    if (!file) return false;
+    VaultRecordHeader old_hdr;
+    uint32_t old_crc = 0;
+    bool read_ok = _readRecordHeader(file, index, &old_hdr);
+    if (read_ok && (old_hdr.flags & VAULT_FLAG_CRC)) {
+        read_ok = file.seek(m_index[index].file_offset + _recordDataLen(old_hdr)) && file.read((uint8_t*)&old_crc, sizeof(old_crc)) == sizeof(old_crc);
+    }
+    file.close();
+    if (!read_ok) return false;
+
+    // Sul posto solo se il file delle password e' valido: altrimenti lo crea il VaultWriter
+    if (hdr.slot_len <= old_hdr.slot_len && m_secrets_ok) {
+        // Il nuovo record entra nello spazio del precedente: la password va in coda al file
+        // delle password, poi un'unica scrittura sul posto del record che la punta.
+        // slot_len resta quello originale, l'eventuale coda inutilizzata viene ignorata in lettura.
+        VaultSecretRef secret;
+        if (!_appendSecret(record, hdr.password_len, &secret)) {
+            USBSerial.printf("ERRORE CredMan: Scrittura della password del record %d fallita.\n", index);
+            return false;
+        }
+        uint8_t buf[VAULT_MAX_SLOT_SIZE];
+        size_t used = hdr.slot_len;
+        hdr.slot_len = old_hdr.slot_len;
+        uint32_t crc = _writeRecord(buf, hdr, record, secret);
+
+        // Record e digest dell'header nella stessa transazione del giornale
+        uint32_t records_crc = m_records_crc ^ old_crc ^ crc;
+        beginBatch();
+        bool ok = _journalWrite(m_index[index].file_offset, buf, used);
+        if (ok && (m_vault_features & VAULT_FEATURE_CRC)) {
+            ok = _journalWrite(offsetof(VaultHeader, records_crc), (const uint8_t*)&records_crc, sizeof(records_crc));
+        }
+        bool committed = commitBatch();
+        ok = ok && committed;
+        mbedtls_platform_zeroize(buf, sizeof(buf));
+        if (!ok) {
+            USBSerial.printf("ERRORE CredMan: Scrittura sul posto del record %d fallita.\n", index);
+            return false;
+        }
+        m_records_crc = records_crc;
+        if (m_corrupt[index]) {
+            m_corrupt[index] = false;
+            m_corrupt_count--;
+        }
+        // Il record precedente (e la sua password) diventa spazio perso; la nuova password e' viva
+        m_dead_bytes = m_dead_bytes + _recordSize(old_hdr) - used;
+        _indexStrings(m_index[index], record);
+        m_title_index.reposition(index, m_index, m_string_pool.data());
+        _saveTitleIndex();  // Anche con lo stesso titolo: il digest dei record e' cambiato
+        return true;
+    }
+
+    // Record piu' grande: nuova versione in coda, la tabella viene ripubblicata con la stessa posizione.
+    // Il batch aperto va applicato prima: le sue voci si riferiscono alla generazione attuale.
+    if (!_commitJournal()) return false;
+    VaultWriter writer;
+    if (!writer.openAppend(*this) || !writer.replace(index, record) || !writer.finish()) {
+        writer.rollback();
+        USBSerial.printf("ERRORE CredMan: Aggiornamento del record %d fallito.\n", index);
+        return false;
+    }
+    // Posizione aggiornata prima di ricaricare: begin() salva l'ordine con la nuova generazione
+    _indexStrings(m_index[index], record);
+    m_title_index.reposition(index, m_index, m_string_pool.data());
+    m_title_index_carry = true;
+    begin();
+    return true;
+}
+
+bool CredentialsManager::compact() {
+    {
+        Lock lock(*this);
+        if (!_commitJournal()) return false;
+    }
+    if (m_format_version != VAULT_VERSION) return false;
+    size_t live = m_credential_count - m_tombstone_count;
+    USBSerial.printf("INFO CredMan: Compattazione del vault: %d record, %d eliminati, %d bytes da recuperare...\n",
+                     m_credential_count, m_tombstone_count, m_dead_bytes);
+
+    // Stesso schema della migrazione: file temporaneo completo, poi sostituzione con rename()
+    VaultWriter writer;
+    if (!writer.create(CREDENTIALS_TMP_FILE, CREDENTIALS_SECRETS_TMP_FILE, m_generation + 1)) return false;
+    // La riscrittura legge senza Lock (vedi Lock): l'indice resta quello pubblicato fino alla sostituzione
+    RangeReader reader(*this, 0, SIZE_MAX, true, false);
+    const Credential* cred;
+    while ((cred = reader.next()) != nullptr) {
+        if (cred->flags & VAULT_FLAG_TOMBSTONE) continue;
+        if (!writer.add(*cred)) break;
+    }
+    reader.close();
+
+    if (writer.count() != live || !writer.finish()) {
+        writer.rollback();
+        USBSerial.println("ERRORE CredMan: Compattazione fallita. Il vault resta invariato.");
+        return false;
+    }
+    Lock lock(*this);
+    _replaceWithTmp();
+    // I record restano nello stesso ordine relativo: basta rinumerare, senza riordinare
+    m_title_index.compact(m_deleted);
+    m_title_index_carry = true;
+    begin();
+    USBSerial.printf("OK CredMan: Compattazione completata (generazione %d).\n", m_generation);
+    return true;
+}
+
+// File cancellati da secureWipe(): nome del file e nome durante la sovrascrittura in background
+static const char* const s_wipe_files[][2] = {
+    { CREDENTIALS_FILE, CREDENTIALS_WIPE_FILE },
+    { CREDENTIALS_SECRETS_FILE, CREDENTIALS_SECRETS_WIPE_FILE },
+    { JOURNAL_FILE, JOURNAL_WIPE_FILE },
+};
+
+void CredentialsManager::secureWipe() {
+    Lock lock(*this);
+    m_journal.discard();  // Il file del giornale viene sovrascritto con il vault (s_wipe_files)
+    _resetIndex();
+    m_title_index.clear();
+    TitleIndex::remove();
+
+    // Anche i file temporanei contengono dati cifrati con la stessa chiave
+    if (SD_MMC.exists(CREDENTIALS_TMP_FILE)) SD_MMC.remove(CREDENTIALS_TMP_FILE);
+    if (SD_MMC.exists(CREDENTIALS_SECRETS_TMP_FILE)) SD_MMC.remove(CREDENTIALS_SECRETS_TMP_FILE);
+
+    bool renamed = false;
+    for (const auto& files : s_wipe_files) {
+        if (!SD_MMC.exists(files[0])) continue;
+        if (m_wipe_running) {
+            // Un'altra sovrascrittura e' in corso sui file .wipe: il file corrente va solo rimosso
+            SD_MMC.remove(files[0]);
+            continue;
+        }
+        if (SD_MMC.exists(files[1])) SD_MMC.remove(files[1]);
+
+        // rename() modifica solo la voce di directory: richiede millisecondi qualunque sia la dimensione
+        if (!SD_MMC.rename(files[0], files[1])) {
+            USBSerial.printf("ERRORE CredMan: Rinomina di %s per la cancellazione fallita. Rimuovo il file direttamente.\n", files[0]);
+            SD_MMC.remove(files[0]);
+            continue;
+        }
+        renamed = true;
+    }
+    if (!renamed) return;
+    USBSerial.println("DEBUG CredMan: Vault rimosso. Sovrascrittura in background avviata.");
+    _startBackgroundWipe();
+}
+
+void CredentialsManager::_startBackgroundWipe() {
+    if (m_wipe_running) return;
+    m_wipe_running = true;
+    if (xTaskCreate(_wipeTask, "vault_wipe", 4096, this, 1, NULL) != pdPASS) {
+        USBSerial.println("ERRORE CredMan: Impossibile avviare il task di cancellazione. Rimuovo i file senza sovrascriverli.");
+        for (const auto& files : s_wipe_files) SD_MMC.remove(files[1]);
+        m_wipe_running = false;
+    }
+}
+
+void CredentialsManager::_wipeTask(void* param) {
+    CredentialsManager* self = static_cast<CredentialsManager*>(param);
+
+    uint8_t* zeros = (uint8_t*)heap_caps_calloc(1, VAULT_WIPE_CHUNK_SIZE, MALLOC_CAP_DMA);
+    for (const auto& files : s_wipe_files) {
+        if (!SD_MMC.exists(files[1])) continue;
+        File file = SD_MMC.open(files[1], "r+");
+        if (file && zeros) {
+            size_t total = file.size();
+            size_t written = 0;
+            while (written < total) {
+                size_t chunk = std::min((size_t)VAULT_WIPE_CHUNK_SIZE, total - written);
+                if (file.write(zeros, chunk) != chunk) {
+                    USBSerial.printf("ERRORE CredMan: Sovrascrittura interrotta a %d di %d bytes.\n", written, total);
+                    break;
+                }
+                written += chunk;
+                vTaskDelay(1); // Lascia spazio alla UI tra un blocco e l'altro
+            }
+            file.flush();
+            USBSerial.printf("DEBUG CredMan: Sovrascritti %d bytes di %s.\n", written, files[1]);
+        }
+        if (file) file.close();
+        SD_MMC.remove(files[1]);
+    }
+    if (zeros) heap_caps_free(zeros);
+
+    self->m_wipe_running = false;
+    vTaskDelete(NULL);
+}
+
+// --- RangeReader ---
+
+CredentialsManager::RangeReader::RangeReader(const CredentialsManager& manager, size_t start, size_t count, bool secrets,
+                                             bool lock)
+    : m_lock(lock ? manager.m_mutex : nullptr, portMAX_DELAY), m_manager(manager), m_buffer(nullptr), m_with_secrets(secrets), m_next(start), m_end(start),
+      m_buf_offset(0), m_buf_len(0) {
+    size_t total = manager.m_credential_count;
+    if (start >= total) return;
+    m_end = start + std::min(count, total - start);
+    if (secrets && manager.m_secrets_ok) m_secrets = SD_MMC.open(CREDENTIALS_SECRETS_FILE, FILE_READ);
+
+    m_file = SD_MMC.open(CREDENTIALS_FILE, FILE_READ);
+    if (!m_file) {
+        USBSerial.println("ERRORE CredMan: RangeReader non riesce ad aprire credentials.bin.");
+        m_end = start;
+        return;
+    }
+    // Buffer allineato e DMA-capable: il driver SDMMC puo' trasferire i settori
+    // direttamente, senza passare da un buffer di appoggio.
+    m_buffer = (uint8_t*)heap_caps_aligned_alloc(4, RANGE_READ_BUFFER_SIZE, MALLOC_CAP_DMA);
+    if (!m_buffer) {
+        m_buffer = (uint8_t*)heap_caps_malloc(RANGE_READ_BUFFER_SIZE, MALLOC_CAP_8BIT);
+    }
+    if (!m_buffer) {
+        USBSerial.println("ERRORE CredMan: Memoria insufficiente per il buffer del RangeReader.");
+        m_file.close();
+        m_end = start;
+    }
+}
+
+CredentialsManager::RangeReader::~RangeReader() {
+    close();
+}
+
+void CredentialsManager::RangeReader::close() {
+    if (m_buffer) {
+        heap_caps_free(m_buffer);
+        m_buffer = nullptr;
+    }
+    if (m_file) m_file.close();
+    if (m_secrets) m_secrets.close();
+    m_end = m_next;
+}
+
+bool CredentialsManager::RangeReader::_fill(uint32_t offset) {
+    if (!m_file.seek(offset)) return false;
+    m_buf_offset = offset;
+    m_buf_len = m_file.read(m_buffer, RANGE_READ_BUFFER_SIZE);
+    return m_buf_len > 0;
+}
+
+const Credential* CredentialsManager::RangeReader::next() {
+    if (!m_buffer || m_next >= m_end) return nullptr;
+    uint32_t offset = m_manager.m_index[m_next].file_offset;
+
+    // Al primo tentativo si usa il buffer corrente; se il record non e' (tutto) contenuto
+    // si ricarica il buffer a partire dal suo offset e si riprova una volta.
+    for (int attempt = 0; attempt < 2; attempt++) {
+        if (offset >= m_buf_offset && offset < m_buf_offset + m_buf_len) {
+            size_t avail = m_buf_offset + m_buf_len - offset;
+            size_t used = _decodeRecord(m_manager.m_format_version, m_buffer + (offset - m_buf_offset), avail, &m_current);
+            if (used == 0) {
+                // Header del record illeggibile: la voce resta nell'indice, segnalata come corrotta,
+                // e la scansione prosegue (la posizione del record successivo viene dalla tabella)
+                USBSerial.printf("ERRORE CredMan: Record %d corrotto.\n", m_next);
+                memset(&m_current, 0, sizeof(m_current));
+                m_current.flags = VAULT_FLAG_CORRUPT;
+                m_next++;
+                return &m_current;
+            }
+            if (used <= avail) {
+                // Password nel file delle password: letta solo se richiesta, dal secondo handle
+                if ((m_current.flags & VAULT_FLAG_SECRET_FILE) && m_with_secrets) {
+                    if (m_secrets) {
+                        _readSecret(m_secrets, &m_current);
+                    } else {
+                        m_current.flags |= VAULT_FLAG_CORRUPT;
+                    }
+                }
+                m_next++;
+                return &m_current;
+            }
+        }
+        if (attempt == 0 && !_fill(offset)) break;
+    }
+    m_end = m_next; // Errore di lettura: chiudi l'intervallo
+    return nullptr;
+}
+
+// --- VaultWriter ---
+
+CredentialsManager::VaultWriter::VaultWriter()
+    : m_buffer(nullptr), m_buf_used(0), m_write_pos(0), m_records_crc(0), m_start_size(0), m_created(false),
+      m_sec_buffer(nullptr), m_sec_used(0), m_sec_pos(0), m_sec_start_size(0), m_sec_created(false), m_secrets_id(0),
+      m_generation(0), m_failed(false) {}
+
+CredentialsManager::VaultWriter::~VaultWriter() {
+    _abort();
+}
+
+bool CredentialsManager::VaultWriter::create(const char* path, const char* secrets_path, uint32_t generation) {
+    m_file = SD_MMC.open(path, FILE_WRITE);
+    m_buffer = (uint8_t*)heap_caps_aligned_alloc(4, VAULT_WRITE_BUFFER_SIZE, MALLOC_CAP_DMA);
+    if (!m_file || !m_buffer) {
+        USBSerial.printf("ERRORE CredMan: Impossibile creare il vault '%s'.\n", path);
+        _abort();
+        return false;
+    }
+    // Segnaposto per l'header: viene scritto per davvero solo da finish()
+    memset(m_buffer, 0, sizeof(VaultHeader));
+    m_buf_used = sizeof(VaultHeader);
+    m_write_pos = 0;
+    m_path = path;
+    m_start_size = 0;
+    m_created = true;
+    m_generation = generation;
+    if (!_createSecrets(secrets_path, generation)) {
+        rollback();
+        return false;
+    }
+    return true;
+}
+
+bool CredentialsManager::VaultWriter::_createSecrets(const char* path, uint32_t secrets_id) {
+    m_secrets = SD_MMC.open(path, FILE_WRITE);
+    m_sec_buffer = (uint8_t*)heap_caps_aligned_alloc(4, VAULT_WRITE_BUFFER_SIZE, MALLOC_CAP_DMA);
+    if (!m_secrets || !m_sec_buffer) {
+        USBSerial.printf("ERRORE CredMan: Impossibile creare il file delle password '%s'.\n", path);
+        return false;
+    }
+    VaultSecretsHeader header = {0};
+    memcpy(header.magic, VAULT_SECRETS_MAGIC, 4);
+    header.secrets_id = secrets_id;
+    memcpy(m_sec_buffer, &header, sizeof(header));
+    m_sec_used = sizeof(header);
+    m_sec_pos = 0;
+    m_sec_path = path;
+    m_sec_start_size = 0;
+    m_sec_created = true;
+    m_secrets_id = secrets_id;
+    return true;
+}
+
+bool CredentialsManager::VaultWriter::openAppend(const CredentialsManager& manager) {
+    if (manager.m_format_version != VAULT_VERSION) return false;
+    // finish() scrive sempre l'header completo: con un header corto (vault precedenti) coprirebbe l'inizio
+    // del primo record. Quei vault vengono riscritti da begin(); qui si accoda solo a uno vuoto.
+    if (manager.m_header_size < sizeof(VaultHeader) && manager.m_credential_count > 0) {
+        USBSerial.println("ERRORE CredMan: Vault con header corto non ancora riscritto. Scrittura rifiutata.");
+        return false;
+    }
+    m_file = SD_MMC.open(CREDENTIALS_FILE, "r+");
+    m_buffer = (uint8_t*)heap_caps_aligned_alloc(4, VAULT_WRITE_BUFFER_SIZE, MALLOC_CAP_DMA);
+    if (!m_file || !m_buffer) {
+        _abort();
+        return false;
+    }
+    // I nuovi record vanno in coda al file, dopo la tabella attuale: finche' l'header
+    // non viene riscritto, header e tabella precedenti restano intatti e coerenti.
+    m_start_size = m_file.size();
+    m_write_pos = std::max(m_start_size, (uint32_t)sizeof(VaultHeader));  // Spazio per l'header completo
+    m_path = CREDENTIALS_FILE;
+    m_created = false;
+    if (!m_file.seek(m_write_pos)) {
+        _abort();
+        return false;
+    }
+    m_offsets.reserve(manager.m_credential_count);
+    for (size_t i = 0; i < manager.m_credential_count; i++) {
+        m_offsets.push_back(manager.m_index[i].file_offset);
+    }
+    m_records_crc = manager.m_records_crc;
+    m_generation = manager.m_generation + 1;
+
+    // Le password vanno in coda al file delle password. Se manca ne viene scritto uno nuovo sotto il
+    // nome temporaneo, pubblicato da finish() come dopo una compattazione. Un file presente ma non
+    // valido per questo vault non viene mai sovrascritto: potrebbe essere l'unica copia delle password.
+    if (!manager.m_secrets_ok && SD_MMC.exists(CREDENTIALS_SECRETS_FILE)) {
+        USBSerial.println("ERRORE CredMan: File delle password presente ma non valido per questo vault. Scrittura rifiutata.");
+        _abort();
+        return false;
+    }
+    if (manager.m_secrets_ok) {
+        m_secrets = SD_MMC.open(CREDENTIALS_SECRETS_FILE, "r+");
+        m_sec_buffer = (uint8_t*)heap_caps_aligned_alloc(4, VAULT_WRITE_BUFFER_SIZE, MALLOC_CAP_DMA);
+        if (!m_secrets || !m_sec_buffer) {
+            _abort();
+            return false;
+        }
+        m_sec_pos = m_secrets.size();
+        m_sec_path = CREDENTIALS_SECRETS_FILE;
+        m_sec_start_size = m_sec_pos;
+        m_sec_created = false;
+        m_secrets_id = manager.m_secrets_id;
+        if (!m_secrets.seek(m_sec_pos)) {
+            _abort();
+            return false;
+        }
+    } else if (!_createSecrets(CREDENTIALS_SECRETS_TMP_FILE, m_generation)) {
+        _abort();
+        return false;
+    }
+    return true;
+}
+
+bool CredentialsManager::VaultWriter::add(const Credential& cred) {
+    uint32_t offset;
+    if (!_append(cred, &offset)) return false;
+    m_offsets.push_back(offset);
+    return true;
+}
+
+bool CredentialsManager::VaultWriter::replace(size_t index, const Credential& cred) {
+    uint32_t offset;
+    if (index >= m_offsets.size()) return false;
+    uint32_t old_crc = _crcAt(m_offsets[index]);
+    if (!_append(cred, &offset)) return false;
+    m_records_crc ^= old_crc;  // Il record sostituito esce dalla tabella
+    m_offsets[index] = offset;
+    return true;
+}
+
+uint32_t CredentialsManager::VaultWriter::_crcAt(uint32_t offset) {
+    VaultRecordHeader hdr;
+    uint32_t crc = 0;
+    if (offset >= m_write_pos) {
+        // Record ancora nel buffer
+        const uint8_t* p = m_buffer + (offset - m_write_pos);
+        memcpy(&hdr, p, sizeof(hdr));
+        if (hdr.flags & VAULT_FLAG_CRC) memcpy(&crc, p + _recordDataLen(hdr), sizeof(crc));
+        return crc;
+    }
+    if (m_file.seek(offset) && m_file.read((uint8_t*)&hdr, sizeof(hdr)) == sizeof(hdr) && (hdr.flags & VAULT_FLAG_CRC)) {
+        if (!m_file.seek(offset + _recordDataLen(hdr)) || m_file.read((uint8_t*)&crc, sizeof(crc)) != sizeof(crc)) crc = 0;
+    }
+    m_file.seek(m_write_pos);  // _flush() scrive dalla posizione corrente
+    return crc;
+}
+
+bool CredentialsManager::VaultWriter::_append(const Credential& cred, uint32_t* outOffset) {
+    if (!m_buffer || !m_sec_buffer || m_failed) return false;
+
+    VaultRecordHeader hdr;
+    if (!_encodeRecordHeader(cred, &hdr)) return false;
+
+    // 1. Password nel file delle password
+    if (m_sec_used + hdr.password_len > VAULT_WRITE_BUFFER_SIZE && !_flushSecrets()) return false;
+    VaultSecretRef secret;
+    secret.offset = m_sec_pos + m_sec_used;
+    secret.crc = Crc32c::compute(cred.encrypted_password, hdr.password_len);
+    memcpy(m_sec_buffer + m_sec_used, cred.encrypted_password, hdr.password_len);
+    m_sec_used += hdr.password_len;
+
+    // 2. Metadati e riferimento alla password nel vault
+    if (m_buf_used + hdr.slot_len > VAULT_WRITE_BUFFER_SIZE && !_flush()) return false;
+    *outOffset = m_write_pos + m_buf_used;
+    m_records_crc ^= _writeRecord(m_buffer + m_buf_used, hdr, cred, secret);
+    m_buf_used += hdr.slot_len;
+    return true;
+}
+
+bool CredentialsManager::VaultWriter::finish() {
+    if (!m_buffer || m_failed) {
+        _abort();
+        return false;
+    }
+
+    // 1. Password: devono essere sulla SD prima che un header le renda raggiungibili
+    if (!_flushSecrets(true)) {
+        _abort();
+        return false;
+    }
+    m_secrets.flush();
+
+    // 2. Tabella degli offset, in coda ai record
+    uint32_t table_offset = m_write_pos + m_buf_used;
+    uint32_t table_crc = 0;
+    for (uint32_t offset : m_offsets) {
+        if (m_buf_used + sizeof(offset) > VAULT_WRITE_BUFFER_SIZE && !_flush()) break;
+        memcpy(m_buffer + m_buf_used, &offset, sizeof(offset));
+        m_buf_used += sizeof(offset);
+        table_crc = Crc32c::update(table_crc, &offset, sizeof(offset));
+    }
+    if (m_failed || !_flush(true)) {
+        _abort();
+        return false;
+    }
+
+    // 3. Header: e' l'ultima scrittura, rende visibile il nuovo contenuto
+    VaultHeader header = {0};
+    memcpy(header.magic, VAULT_MAGIC, 4);
+    header.version = VAULT_VERSION;
+    header.header_size = sizeof(VaultHeader);
+    header.record_count = m_offsets.size();
+    header.generation = m_generation;
+    header.table_offset = table_offset;
+    header.table_crc = table_crc;
+    header.records_crc = m_records_crc;
+    header.features = VAULT_FEATURE_CRC | VAULT_FEATURE_SECRETS;
+    header.secrets_id = m_secrets_id;
+    bool ok = m_file.seek(0) && m_file.write((uint8_t*)&header, sizeof(header)) == sizeof(header);
+    m_file.flush();
+    _abort(); // Chiude file e buffer
+
+    // Vault esistente con un nuovo file delle password (openAppend): ora che l'header lo indica viene
+    // pubblicato. Un riavvio prima della rename viene completato da _openSecrets(), come per la compattazione.
+    if (ok && m_path == CREDENTIALS_FILE && m_sec_path == CREDENTIALS_SECRETS_TMP_FILE) {
+        SD_MMC.rename(CREDENTIALS_SECRETS_TMP_FILE, CREDENTIALS_SECRETS_FILE);
+    }
+    return ok;
+}
+
+bool CredentialsManager::VaultWriter::_flush(bool final) {
+    return _flushBuffer(m_file, m_buffer, m_buf_used, m_write_pos, final);
+}
+
+bool CredentialsManager::VaultWriter::_flushSecrets(bool final) {
+    return _flushBuffer(m_secrets, m_sec_buffer, m_sec_used, m_sec_pos, final);
+}
+
+bool CredentialsManager::VaultWriter::_flushBuffer(File& file, uint8_t* buffer, size_t& used, uint32_t& write_pos, bool final) {
+    if (used == 0) return true;
+    // Le scritture intermedie si fermano all'ultimo confine di settore; la coda resta nel buffer
+    size_t len = used;
+    if (!final) {
+        uint32_t aligned_end = (write_pos + used) & ~(uint32_t)(VAULT_SECTOR_SIZE - 1);
+        if (aligned_end > write_pos) len = aligned_end - write_pos;
+    }
+    if (file.write(buffer, len) != len) {
+        USBSerial.println("ERRORE CredMan: Scrittura sul vault fallita.");
+        m_failed = true;
+        return false;
+    }
+    write_pos += len;
+    used -= len;
+    if (used > 0) memmove(buffer, buffer + len, used);
+    return true;
+}
+
+void CredentialsManager::VaultWriter::rollback() {
+    _abort();
+    m_offsets.clear();
+    // Header e tabella precedenti non sono stati toccati: anche senza truncate() il vault resta valido, solo piu' lungo
+    if (!m_path.isEmpty()) {
+        if (m_created) {
+            SD_MMC.remove(m_path);
+        } else if (truncate((String(VAULT_MOUNT_POINT) + m_path).c_str(), m_start_size) != 0) {
+            USBSerial.println("ATTENZIONE CredMan: Impossibile ripristinare la lunghezza del vault.");
+        }
+        m_path = "";
+    }
+    if (!m_sec_path.isEmpty()) {
+        if (m_sec_created) {
+            SD_MMC.remove(m_sec_path);
+        } else if (truncate((String(VAULT_MOUNT_POINT) + m_sec_path).c_str(), m_sec_start_size) != 0) {
+            USBSerial.println("ATTENZIONE CredMan: Impossibile ripristinare la lunghezza del file delle password.");
+        }
+        m_sec_path = "";
+    }
+}
+
+void CredentialsManager::VaultWriter::_abort() {
+    if (m_buffer) {
+        heap_caps_free(m_buffer);
+        m_buffer = nullptr;
+    }
+    if (m_sec_buffer) {
+        heap_caps_free(m_sec_buffer);
+        m_sec_buffer = nullptr;
+    }
+    if (m_file) m_file.close();
+    if (m_secrets) m_secrets.close();
+}
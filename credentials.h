@@ -1,28 +1,404 @@
 #pragma once
+#include <vector>
+#include <FS.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
 #include "crypto.h"
+#include "csv_reader.h"
+#include "vault_journal.h"
+#include "title_index.h"
+#include "collation.h"
 
 // Costanti per il file di credenziali
 #define CREDENTIALS_FILE "/credentials.bin"
+#define CREDENTIALS_TMP_FILE "/credentials.bin.tmp"
+// Vault in attesa di sovrascrittura dopo una cancellazione rapida (secureWipe)
+#define CREDENTIALS_WIPE_FILE "/credentials.bin.wipe"
+// Password cifrate dei record con VAULT_FLAG_SECRET_FILE: il vault contiene solo i metadati
+#define CREDENTIALS_SECRETS_FILE "/credentials.sec"
+#define CREDENTIALS_SECRETS_TMP_FILE "/credentials.sec.tmp"
+#define CREDENTIALS_SECRETS_WIPE_FILE "/credentials.sec.wipe"
 #define MAX_TITLE_LEN 64
 #define MAX_USERNAME_LEN 64
 #define MAX_ENCRYPTED_PASS_LEN 256
+// Dimensione del record a lunghezza fissa del formato v1
 #define CREDENTIAL_RECORD_SIZE (MAX_TITLE_LEN + MAX_USERNAME_LEN + MAX_ENCRYPTED_PASS_LEN)
 
+// --- Formato v2 del vault ---
+// [VaultHeader][record a lunghezza variabile ...][tabella degli offset: uint32_t x record_count]
+// Ogni record e' un VaultRecordHeader seguito da titolo, utente e password (senza terminatori)
+// e, con VAULT_FLAG_CRC, dal CRC32C del record. Con VAULT_FLAG_SECRET_FILE al posto della password
+// c'e' un VaultSecretRef: la password cifrata sta in CREDENTIALS_SECRETS_FILE, letto solo quando serve.
+#define VAULT_MAGIC "PWVT"
+#define VAULT_VERSION 2
+
+struct VaultHeader {
+    char magic[4];          // VAULT_MAGIC
+    uint16_t version;       // VAULT_VERSION
+    uint16_t header_size;   // sizeof(VaultHeader), per estensioni future
+    uint32_t record_count;  // Numero di voci nella tabella degli offset
+    uint32_t generation;    // Incrementato a ogni scrittura del vault
+    uint32_t table_offset;  // Posizione della tabella degli offset nel file
+    uint32_t table_crc;     // CRC32C della tabella degli offset (con VAULT_FEATURE_CRC)
+    uint32_t records_crc;   // XOR dei CRC32C di tutti i record della tabella (con VAULT_FEATURE_CRC)
+    uint32_t features;      // VAULT_FEATURE_*; 0 nei vault scritti prima dei CRC
+    uint32_t secrets_id;    // Identificativo di CREDENTIALS_SECRETS_FILE (con VAULT_FEATURE_SECRETS)
+};
+// Header dei vault scritti prima di secrets_id: i campi mancanti valgono 0
+#define VAULT_HEADER_MIN_SIZE offsetof(VaultHeader, secrets_id)
+
+#define VAULT_FEATURE_CRC 0x01      // table_crc e records_crc sono validi
+#define VAULT_FEATURE_SECRETS 0x02  // Esiste il file delle password con identificativo secrets_id
+
+// Header di CREDENTIALS_SECRETS_FILE, seguito dalle password cifrate una dopo l'altra
+#define VAULT_SECRETS_MAGIC "PWSC"
+struct VaultSecretsHeader {
+    char magic[4];        // VAULT_SECRETS_MAGIC
+    uint32_t secrets_id;  // Uguale a VaultHeader::secrets_id del vault a cui appartiene
+};
+
+// Flag del record v2
+#define VAULT_FLAG_BINARY_CIPHER 0x01  // Password salvata come IV+Tag+testo cifrato binario (non base64)
+#define VAULT_FLAG_TOMBSTONE 0x02      // Record eliminato: resta nella tabella (gli indici non cambiano) fino alla compattazione
+#define VAULT_FLAG_CRC 0x04            // Il record termina con il suo CRC32C (calcolato con il flag TOMBSTONE azzerato)
+#define VAULT_FLAG_CORRUPT 0x08        // CRC errato alla lettura; la compattazione lo conserva su disco
+#define VAULT_FLAG_SECRET_FILE 0x10    // Password in CREDENTIALS_SECRETS_FILE (VaultSecretRef nel record)
+
+// Soglie oltre le quali conviene compattare il vault (riscrivendolo senza record eliminati o spostati)
+#define VAULT_COMPACT_TOMBSTONES 16
+#define VAULT_COMPACT_DEAD_BYTES (32 * 1024)
+
+struct VaultRecordHeader {
+    uint16_t slot_len;      // Byte occupati dal record su disco, header compreso
+    uint8_t flags;
+    uint8_t title_len;
+    uint8_t username_len;
+    uint8_t reserved;
+    uint16_t password_len;  // Lunghezza della password cifrata, anche quando sta nel file delle password
+};
+
+// Riferimento alla password nel file delle password: la posizione e il CRC32C dei suoi byte.
+// Il CRC del record copre il riferimento, quindi anche un cambio di password cambia il digest del vault.
+struct VaultSecretRef {
+    uint32_t offset;
+    uint32_t crc;
+};
+
+// Record v2 piu' grande possibile: serve a dimensionare i buffer di lettura
+#define VAULT_MAX_SLOT_SIZE (sizeof(VaultRecordHeader) + MAX_TITLE_LEN + MAX_USERNAME_LEN + MAX_ENCRYPTED_PASS_LEN + sizeof(uint32_t))
+
+// Dimensione del buffer delle scansioni sequenziali (16 record v1)
+#define RANGE_READ_BUFFER_SIZE (16 * CREDENTIAL_RECORD_SIZE)
+// Dimensione del buffer di scrittura del VaultWriter. Le scritture intermedie terminano
+// sempre a un confine di settore, cosi' la SD riceve blocchi interi e allineati.
+#define VAULT_WRITE_BUFFER_SIZE 8192
+#define VAULT_SECTOR_SIZE 512
+
+// Pipeline di importazione: record in volo tra gli stadi e core degli stadi di cifratura e scrittura.
+// Come il VaultWorker che fa il parsing, restano sul core 0: il core 1 e' di loop() e LVGL.
+#define IMPORT_PIPELINE_SLOTS 16
+#define IMPORT_PIPELINE_END 0xFF
+#define IMPORT_PIPELINE_CORE 0
+// Punto di montaggio della SD: serve per le chiamate POSIX che l'API File non offre (truncate)
+#define VAULT_MOUNT_POINT "/sdcard"
+// Blocco scritto per ogni passo della sovrascrittura in background
+#define VAULT_WIPE_CHUNK_SIZE 4096
+
+// Credenziale decodificata in memoria. Con VAULT_FLAG_BINARY_CIPHER 'encrypted_password'
+// contiene byte binari (lunghi 'encrypted_len'), altrimenti una stringa base64 terminata da '\0'.
 struct Credential {
     char title[MAX_TITLE_LEN];
     char username[MAX_USERNAME_LEN];
     char encrypted_password[MAX_ENCRYPTED_PASS_LEN];
+    uint16_t encrypted_len;
+    uint8_t flags;
+    uint32_t crc;  // CRC32C letto dal record (0 se il record non ne ha uno)
+    VaultSecretRef secret;  // Con VAULT_FLAG_SECRET_FILE: dove si trova la password
+};
+
+// APPEND salta le credenziali gia' presenti (stesso titolo e utente); UPDATE ne sostituisce la
+// password se e' cambiata, ri-cifrando solo quelle.
+enum class ImportMode : uint8_t {
+    APPEND,
+    UPDATE
+};
+
+// Esito di una riga del CSV nel piano di ImportMode::UPDATE (i valori >= 0 sono l'indice del record da sostituire)
+#define IMPORT_ROW_ADD -1
+#define IMPORT_ROW_UNCHANGED -2
+#define IMPORT_ROW_DUPLICATE -3
+
+// Avanzamento di un'importazione, aggiornato dal task che la esegue e letto dall'interfaccia.
+// 'cancel' e' l'unico campo scritto dall'interfaccia: il vault torna alla lunghezza precedente.
+struct ImportProgress {
+    volatile uint32_t bytes_total;  // Dimensione del CSV
+    volatile uint32_t bytes_read;   // Byte del CSV gia' analizzati
+    volatile uint32_t parsed;       // Righe lette
+    volatile uint32_t imported;     // Record nuovi scritti nel vault
+    volatile uint32_t updated;      // Record sostituiti (solo ImportMode::UPDATE)
+    volatile uint32_t unchanged;    // Record con la stessa password del vault (solo ImportMode::UPDATE)
+    volatile uint32_t skipped;      // Duplicati saltati
+    volatile bool cancel;           // Richiesta di annullamento
+    volatile bool cancelled;        // L'importazione e' stata annullata e il vault ripristinato
+};
+
+// Voce dell'indice residente in RAM. Titolo e utente non sono copiati qui:
+// si trovano nel pool di stringhe condiviso, la voce ne memorizza solo la posizione.
+struct CredentialIndexEntry {
+    uint32_t file_offset;  // Offset del record dentro credentials.bin
+    uint32_t title_pos;    // Posizione del titolo nel pool di stringhe
+    uint32_t username_pos; // Posizione dell'utente nel pool di stringhe
+    uint8_t title_key[COLLATION_KEY_LEN];  // Chiave di ordinamento del titolo (Collation), calcolata una volta
 };
 
 class CredentialsManager {
 public:
+    // Accesso esclusivo a indice e file: serializza il thread dell'interfaccia e il VaultWorker.
+    // Il mutex e' ricorsivo, quindi i metodi pubblici possono essere chiamati mentre e' gia' preso.
+    // Solo il VaultWorker modifica il vault, e prende il Lock solo mentre l'indice in RAM cambia
+    // (begin(), modifiche sul posto, sostituzione dei file): le lunghe scritture di importazione e
+    // compattazione avvengono senza. Il thread LVGL non deve mai aspettare senza limite: usa la
+    // variante con attesa massima e, se held() e' falso, riprova piu' tardi.
+    class RangeReader;
+    class Lock {
+    public:
+        explicit Lock(const CredentialsManager& manager);
+        // Attende al massimo 'wait' tick (0 = solo se libero)
+        Lock(const CredentialsManager& manager, TickType_t wait);
+        ~Lock();
+        Lock(const Lock&) = delete;
+        Lock& operator=(const Lock&) = delete;
+        bool held() const { return m_held; }
+    private:
+        friend class CredentialsManager::RangeReader;
+        // Con mutex nullptr non prende nulla
+        Lock(SemaphoreHandle_t mutex, TickType_t wait);
+
+        SemaphoreHandle_t m_mutex;
+        bool m_held;
+    };
+
+    // Scansione sequenziale di un intervallo di record: un solo handle aperto
+    // e un unico buffer grande e allineato, ricaricato quando il record successivo non vi e' contenuto.
+    class RangeReader {
+    public:
+        // Con 'secrets' falso le password nel file delle password non vengono lette (encrypted_password vuoto):
+        // basta per indice e ricerca, che cosi' leggono solo i metadati.
+        // Con 'lock' falso il Lock non viene preso: solo per il VaultWorker, l'unico che modifica l'indice,
+        // cosi' una lunga scansione (compattazione, piano di importazione) non blocca l'interfaccia.
+        RangeReader(const CredentialsManager& manager, size_t start = 0, size_t count = SIZE_MAX, bool secrets = true,
+                    bool lock = true);
+        ~RangeReader();
+        RangeReader(const RangeReader&) = delete;
+        RangeReader& operator=(const RangeReader&) = delete;
+
+        // Restituisce il prossimo record (valido fino alla chiamata successiva) o nullptr a fine intervallo
+        const Credential* next();
+        // Indice del record restituito dall'ultima chiamata a next()
+        size_t index() const { return m_next - 1; }
+        bool isOpen() const { return m_buffer != nullptr && m_file; }
+        // Rilascia handle e buffer prima della distruzione (es. prima di rinominare il file)
+        void close();
+
+    private:
+        bool _fill(uint32_t offset);
+
+        Lock m_lock;  // Tenuto per tutta la vita del lettore (se richiesto)
+        const CredentialsManager& m_manager;
+        File m_file;
+        File m_secrets;  // Aperto solo se servono le password
+        uint8_t* m_buffer;
+        bool m_with_secrets;
+        Credential m_current;
+        size_t m_next;         // Indice del prossimo record da restituire
+        size_t m_end;          // Indice di fine intervallo (escluso)
+        uint32_t m_buf_offset; // Offset nel file del primo byte del buffer
+        size_t m_buf_len;      // Byte validi nel buffer
+    };
+
+    // Scrittura di record in formato v2 attraverso un buffer: crea un nuovo file
+    // oppure accoda al vault esistente. Header e tabella degli offset vengono
+    // scritti solo da finish(), quindi un'interruzione lascia valido il vault precedente.
+    // Le password vanno nel file delle password, con un secondo buffer, e il record ne contiene il riferimento.
+    class VaultWriter {
+    public:
+        VaultWriter();
+        ~VaultWriter();
+        VaultWriter(const VaultWriter&) = delete;
+        VaultWriter& operator=(const VaultWriter&) = delete;
+
+        bool create(const char* path, const char* secrets_path = CREDENTIALS_SECRETS_FILE, uint32_t generation = 1);
+        bool openAppend(const CredentialsManager& manager);
+        bool add(const Credential& cred);
+        // Accoda una nuova versione del record 'index' e vi punta la tabella degli offset.
+        // Il record precedente resta nel file ma non e' piu' raggiungibile dopo finish().
+        bool replace(size_t index, const Credential& cred);
+        bool finish();
+        // Scarta i record accodati: il file torna alla lunghezza precedente (o viene rimosso se creato)
+        void rollback();
+        size_t count() const { return m_offsets.size(); }
+
+    private:
+        // 'final' scrive tutto il buffer, anche la parte oltre l'ultimo confine di settore
+        bool _flush(bool final = false);
+        bool _flushSecrets(bool final = false);
+        bool _flushBuffer(File& file, uint8_t* buffer, size_t& used, uint32_t& write_pos, bool final);
+        bool _createSecrets(const char* path, uint32_t secrets_id);
+        bool _append(const Credential& cred, uint32_t* outOffset);
+        // CRC del record gia' presente a 'offset', per aggiornare records_crc quando viene sostituito
+        uint32_t _crcAt(uint32_t offset);
+        void _abort();
+
+        File m_file;
+        uint8_t* m_buffer;
+        size_t m_buf_used;
+        uint32_t m_write_pos;  // Offset nel file del primo byte del buffer
+        std::vector<uint32_t> m_offsets;
+        String m_path;
+        uint32_t m_records_crc; // XOR dei CRC dei record puntati dalla tabella
+        uint32_t m_start_size; // Lunghezza del file prima delle aggiunte
+        bool m_created;
+        // File delle password: stesso schema (buffer, posizione, lunghezza iniziale) del vault
+        File m_secrets;
+        uint8_t* m_sec_buffer;
+        size_t m_sec_used;
+        uint32_t m_sec_pos;
+        String m_sec_path;
+        uint32_t m_sec_start_size;
+        bool m_sec_created;
+        uint32_t m_secrets_id;
+        uint32_t m_generation;
+        bool m_failed;
+    };
+
     CredentialsManager();
     void begin();
-    bool importFromSD(const char* filepath, Crypto& crypto);
+    // Importa un CSV. Senza 'columns' le colonne vengono riconosciute dall'intestazione.
+    // Con 'progress' l'avanzamento e' pubblicato durante il lavoro e l'importazione e' annullabile.
+    bool importFromSD(const char* filepath, Crypto& crypto, const CsvColumnMap* columns = nullptr,
+                      ImportProgress* progress = nullptr, ImportMode mode = ImportMode::APPEND);
     size_t getCount() const;
     bool getCredential(size_t index, Credential* cred) const;
+    // Legge 'count' record consecutivi a partire da 'start' con un'unica apertura del file.
+    // Restituisce il numero di record effettivamente letti.
+    size_t readRange(size_t start, size_t count, Credential* out) const;
     void clear();
 
+    // Modifica di una singola voce senza riscrivere il vault. Se il nuovo record entra nello spazio
+    // del precedente viene scritto sul posto, altrimenti viene accodato e la tabella lo punta.
+    // 'cred' deve contenere la password gia' cifrata (encryptPassword).
+    // Le scritture sul posto passano dal giornale (VaultJournal): un'interruzione non lascia record a meta'.
+    bool updateCredential(size_t index, const Credential& cred);
+    // Marca la voce come eliminata (flag sul record): indici e generazione restano invariati
+    bool deleteCredential(size_t index);
+    bool isDeleted(size_t index) const;
+    // Record il cui CRC32C non corrisponde: verificato durante la costruzione dell'indice
+    bool isCorrupt(size_t index) const;
+    size_t getCorruptCount() const { return m_corrupt_count; }
+    size_t getDeletedCount() const { return m_tombstone_count; }
+    // Vero quando i record eliminati o lo spazio inutilizzato superano le soglie VAULT_COMPACT_*
+    bool needsCompaction() const;
+    // Riscrive il vault senza le voci eliminate e pubblica una nuova generazione: gli indici cambiano
+    bool compact();
+    // Raggruppa piu' modifiche sul posto in un'unica transazione del giornale (un solo flush).
+    // Fino a commitBatch() le modifiche sono visibili nell'indice ma non ancora sulla SD.
+    void beginBatch();
+    bool commitBatch();
+
+    // Cancellazione rapida per l'autodistruzione: da chiamare dopo aver distrutto la chiave dati
+    // (SecurityManager::cryptoErase), che rende gia' illeggibile il vault. Qui il file viene solo
+    // rinominato; la sovrascrittura avviene in un task in background e riprende al riavvio se interrotta.
+    void secureWipe();
+    bool isWipeInProgress() const { return m_wipe_running; }
+
+    // Accesso all'indice in RAM (nessun accesso alla SD). Il puntatore resta valido solo finche' il
+    // chiamante tiene il Lock: begin() ricostruisce il pool di stringhe. Fuori dal VaultWorker va
+    // copiato prima di rilasciarlo.
+    const char* getTitle(size_t index) const;
+    const char* getUsername(size_t index) const;
+    // Ordine alfabetico dei titoli (TitleIndex): indice del record in posizione 'position', 0 <= position < getCount().
+    // Le voci eliminate restano nell'ordine fino alla compattazione.
+    size_t getSortedIndex(size_t position) const;
+    // Prima posizione nell'ordine dei titoli che iniziano con 'letter' (0 = A ... 25 = Z, 26 = dopo la Z).
+    // La lettera e' quella della chiave di ordinamento: "Ärzte" e' tra le A.
+    // Cifre e simboli precedono la A. Le voci eliminate sono comprese, come in getSortedIndex().
+    size_t getLetterStart(uint8_t letter) const;
+
+    // Cifra/decifra la password di una credenziale. La cifratura usa sempre il formato binario,
+    // la decifratura accetta anche i record base64 delle versioni precedenti.
+    static bool encryptPassword(Crypto& crypto, const String& plain_pass, Credential* cred);
+    static String decryptPassword(Crypto& crypto, const Credential& cred);
+    // Varianti senza allocazioni. decryptPassword scrive un testo terminato da '\0' in 'out'
+    // e ne restituisce la lunghezza (0 in caso di errore).
+    static bool encryptPassword(Crypto& crypto, const char* plain_pass, size_t plain_len, Credential* cred);
+    static size_t decryptPassword(Crypto& crypto, const Credential& cred, char* out, size_t out_capacity);
+
+    uint16_t getFormatVersion() const { return m_format_version; }
+    uint32_t getGeneration() const { return m_generation; }
+
 private:
+    void _resetIndex();
+    void _indexStrings(CredentialIndexEntry& entry, const Credential& cred);
+    bool _loadV1Offsets(size_t file_size);
+    bool _loadV2Offsets(File& file, size_t file_size);
+    bool _migrateV1toV2();
+    // Piano di ImportMode::UPDATE: un esito IMPORT_ROW_* (o l'indice da sostituire) per ogni riga del CSV
+    bool _planImportUpdate(const char* filepath, const CsvColumnMap& map, Crypto& crypto,
+                           std::vector<int32_t>& actions, ImportProgress* progress);
+    static size_t _decodeRecord(uint16_t version, const uint8_t* data, size_t avail, Credential* out);
+    static bool _encodeRecordHeader(const Credential& cred, VaultRecordHeader* hdr);
+    // Serializza un record v2 (header gia' codificato) in 'out', CRC compreso; restituisce il CRC
+    static uint32_t _writeRecord(uint8_t* out, const VaultRecordHeader& hdr, const Credential& cred, const VaultSecretRef& secret);
+    // Byte del record esclusi il CRC finale
+    static size_t _recordDataLen(const VaultRecordHeader& hdr);
+    // Byte occupati da un record letto dal vault, password nel file delle password comprese
+    static size_t _recordSize(const Credential& cred);
+    static size_t _recordSize(const VaultRecordHeader& hdr);
+    // Legge la password di un record con VAULT_FLAG_SECRET_FILE; se non corrisponde al CRC marca il record corrotto
+    static bool _readSecret(File& secrets, Credential* cred);
+    // Accoda una password al file delle password fuori da un VaultWriter (modifica sul posto)
+    bool _appendSecret(const Credential& cred, uint32_t length, VaultSecretRef* ref);
+    // Verifica il file delle password del vault caricato, completando una sostituzione interrotta
+    void _openSecrets();
+    // Sostituisce vault e file delle password con i file temporanei appena scritti
+    void _replaceWithTmp();
+    // CRC32C dei primi 'data_len' byte di un record serializzato (header e campi, senza il CRC finale)
+    static uint32_t _recordCrc(const uint8_t* record, size_t data_len);
+    // Legge l'header v2 del record 'index' da un file gia' aperto
+    bool _readRecordHeader(File& file, size_t index, VaultRecordHeader* hdr) const;
+    // Modifica sul posto attraverso il giornale: subito, o a commitBatch() se un batch e' aperto
+    bool _journalWrite(uint32_t offset, const uint8_t* data, uint16_t length);
+    bool _commitJournal();
+    // Dopo la costruzione dell'indice: carica /credentials.idx, oppure aggiorna o ricostruisce l'ordine e lo salva
+    void _loadTitleIndex();
+    void _saveTitleIndex();
+    void _startBackgroundWipe();
+    static void _wipeTask(void* param);
+
     size_t m_credential_count;
-};
\ No newline at end of file
+    size_t m_tombstone_count;
+    uint32_t m_dead_bytes;  // Byte dei record non piu' raggiungibili o eliminati, recuperabili con compact()
+    std::vector<bool> m_deleted;
+    std::vector<bool> m_corrupt;
+    size_t m_corrupt_count;
+    uint32_t m_records_crc;    // XOR dei CRC dei record, calcolato durante la scansione
+    uint32_t m_vault_features; // VaultHeader::features del vault caricato
+    uint32_t m_secrets_id;     // VaultHeader::secrets_id del vault caricato
+    bool m_secrets_ok;         // Il file delle password esiste e appartiene al vault
+    uint32_t m_secrets_size;
+    size_t m_inline_count;     // Record con la password ancora nel vault (scritti prima del file delle password)
+    uint16_t m_format_version;
+    uint32_t m_generation;
+    uint32_t m_table_offset;
+    uint32_t m_header_size;
+    std::vector<CredentialIndexEntry> m_index;
+    std::vector<char> m_string_pool;
+    volatile bool m_wipe_running;
+    SemaphoreHandle_t m_mutex;
+    VaultJournal m_journal;
+    int m_batch_depth;
+    TitleIndex m_title_index;
+    // L'ordine in memoria vale ancora per i primi m_title_index.size() record del vault ricaricato:
+    // il prossimo begin() deve solo aggiungere le voci nuove
+    bool m_title_index_carry;
+};
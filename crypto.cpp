@@ -1,6 +1,7 @@
 #include "crypto.h"
 // L'include di gcm.h non è più necessario qui, perché è già in crypto.h
 #include "mbedtls/base64.h"
+#include "mbedtls/platform_util.h"
 #include "esp_random.h"
 
 extern HWCDC USBSerial; // Aggiungiamo il riferimento a USBSerial
@@ -26,96 +27,105 @@ void Crypto::begin(const unsigned char* key) {
     is_initialized = (ret == 0);
 }
 
-String Crypto::encrypt(const String& plaintext) {
-    if (!is_initialized || plaintext.length() == 0) return "";
-    
-    unsigned char iv[IV_SIZE];
-    esp_fill_random(iv, IV_SIZE);
-    
-    size_t plain_len = plaintext.length();
-    unsigned char* ciphertext = new unsigned char[plain_len];
-    unsigned char tag[TAG_SIZE];
-
-    if (mbedtls_gcm_crypt_and_tag(&aes_ctx, MBEDTLS_GCM_ENCRYPT, plain_len, iv, IV_SIZE, NULL, 0, (unsigned char*)plaintext.c_str(), ciphertext, TAG_SIZE, tag) != 0) {
-        delete[] ciphertext;
-        return "";
-    }
-    
-    // Il resto della funzione rimane identico...
-    size_t combined_len = IV_SIZE + TAG_SIZE + plain_len;
-    unsigned char* combined_buf = new unsigned char[combined_len];
-    memcpy(combined_buf, iv, IV_SIZE);
-    memcpy(combined_buf + IV_SIZE, tag, TAG_SIZE);
-    memcpy(combined_buf + IV_SIZE + TAG_SIZE, ciphertext, plain_len);
-    
-    size_t b64_len;
-    mbedtls_base64_encode(NULL, 0, &b64_len, combined_buf, combined_len);
-    unsigned char* b64_buf = new unsigned char[b64_len];
-    mbedtls_base64_encode(b64_buf, b64_len, &b64_len, combined_buf, combined_len);
-    
-    String result((char*)b64_buf, b64_len);
-    
-    delete[] ciphertext;
-    delete[] combined_buf;
-    delete[] b64_buf;
-    
-    return result;
+size_t Crypto::binarySize(size_t plain_len) {
+    return IV_SIZE + TAG_SIZE + plain_len;
 }
 
+size_t Crypto::encrypt(const uint8_t* in, size_t in_len, uint8_t* out, size_t out_capacity) {
+    if (!is_initialized || !in || in_len == 0 || !out || out_capacity < binarySize(in_len)) return 0;
 
-String Crypto::decrypt(const String& base64_ciphertext) {
-    if (!is_initialized || base64_ciphertext.length() == 0) return "";
-
-    // 1. Decodifica da Base64
-    size_t combined_len;
-    unsigned char* decoded_buf = new unsigned char[base64_ciphertext.length()];
-    int ret = mbedtls_base64_decode(decoded_buf, base64_ciphertext.length(), &combined_len, (unsigned char*)base64_ciphertext.c_str(), base64_ciphertext.length());
-    if (ret != 0) {
-        delete[] decoded_buf;
-        return "";
-    }
+    // Layout: [IV][Tag][Testo cifrato], scritti direttamente nel buffer di uscita
+    uint8_t* iv = out;
+    uint8_t* tag = out + IV_SIZE;
+    uint8_t* ciphertext = out + IV_SIZE + TAG_SIZE;
+    esp_fill_random(iv, IV_SIZE);
 
-    // 2. Controlla che il buffer sia abbastanza grande per IV e Tag
-    if (combined_len <= (IV_SIZE + TAG_SIZE)) {
-        delete[] decoded_buf;
-        return "";
+    if (mbedtls_gcm_crypt_and_tag(&aes_ctx, MBEDTLS_GCM_ENCRYPT, in_len, iv, IV_SIZE, NULL, 0, in, ciphertext, TAG_SIZE, tag) != 0) {
+        return 0;
     }
+    return binarySize(in_len);
+}
 
-    // 3. Estrai IV, Tag e testo cifrato
-    unsigned char iv[IV_SIZE], tag[TAG_SIZE];
-    size_t cipher_len = combined_len - IV_SIZE - TAG_SIZE;
-    unsigned char* ciphertext = new unsigned char[cipher_len];
-    
-    memcpy(iv, decoded_buf, IV_SIZE);
-    memcpy(tag, decoded_buf + IV_SIZE, TAG_SIZE);
-    memcpy(ciphertext, decoded_buf + IV_SIZE + TAG_SIZE, cipher_len);
-    delete[] decoded_buf; // Non più necessario
+size_t Crypto::decrypt(const uint8_t* in, size_t in_len, uint8_t* out, size_t out_capacity) {
+    // 1. Controlla che il buffer sia abbastanza grande per IV e Tag
+    if (!is_initialized || !in || in_len <= (IV_SIZE + TAG_SIZE) || !out) return 0;
+    size_t cipher_len = in_len - IV_SIZE - TAG_SIZE;
+    if (out_capacity < cipher_len) return 0;
 
-    // 4. Decifra e autentica in un unico passaggio con la funzione corretta
-    unsigned char* decrypted_buf = new unsigned char[cipher_len + 1];
+    // 2. IV, Tag e testo cifrato vengono letti sul posto, senza copie
+    const uint8_t* iv = in;
+    const uint8_t* tag = in + IV_SIZE;
+    const uint8_t* ciphertext = in + IV_SIZE + TAG_SIZE;
 
-    ret = mbedtls_gcm_auth_decrypt(
+    // 3. Decifra e autentica in un unico passaggio
+    int ret = mbedtls_gcm_auth_decrypt(
         &aes_ctx,                   // Contesto GCM
         cipher_len,                 // Lunghezza del testo cifrato
         iv, IV_SIZE,                // IV e sua lunghezza
         NULL, 0,                    // Dati aggiuntivi (non usati)
         tag, TAG_SIZE,              // Tag di autenticazione e sua lunghezza
         ciphertext,                 // Input (testo cifrato)
-        decrypted_buf               // Output (buffer per il testo in chiaro)
+        out                         // Output (buffer per il testo in chiaro)
     );
 
-    delete[] ciphertext; // Non più necessario
-
-    // 5. Controlla il risultato
-    if (ret != 0) { // Se ret non è 0, l'autenticazione è fallita
-        delete[] decrypted_buf;
-        return ""; // Restituisce stringa vuota in caso di errore
+    // 4. Se ret non è 0, l'autenticazione è fallita: non lasciare dati parziali nel buffer
+    if (ret != 0) {
+        mbedtls_platform_zeroize(out, cipher_len);
+        return 0;
     }
+    return cipher_len;
+}
+
+size_t Crypto::decryptBase64(const char* in, size_t in_len, uint8_t* out, size_t out_capacity) {
+    if (!in || in_len == 0) return 0;
+
+    // 1. Decodifica da Base64 in un buffer nello stack
+    uint8_t combined[IV_SIZE + TAG_SIZE + CRYPTO_MAX_PLAINTEXT];
+    size_t combined_len;
+    if (mbedtls_base64_decode(combined, sizeof(combined), &combined_len, (const unsigned char*)in, in_len) != 0) return 0;
 
-    // 6. Restituisci il risultato
-    decrypted_buf[cipher_len] = '\0';
-    String result = String((char*)decrypted_buf);
-    delete[] decrypted_buf;
-    
+    // 2. Il resto e' identico alla modalita' binaria
+    return decrypt(combined, combined_len, out, out_capacity);
+}
+
+// --- Wrapper String: buffer nello stack, nessun new[]/delete[] ---
+
+String Crypto::encrypt(const String& plaintext) {
+    if (plaintext.length() > CRYPTO_MAX_PLAINTEXT) return "";
+
+    uint8_t combined[IV_SIZE + TAG_SIZE + CRYPTO_MAX_PLAINTEXT];
+    size_t combined_len = encrypt((const uint8_t*)plaintext.c_str(), plaintext.length(), combined, sizeof(combined));
+    if (combined_len == 0) return "";
+
+    // Base64: 4 caratteri ogni 3 byte, piu' il terminatore
+    unsigned char b64_buf[(sizeof(combined) + 2) / 3 * 4 + 1];
+    size_t b64_len;
+    if (mbedtls_base64_encode(b64_buf, sizeof(b64_buf), &b64_len, combined, combined_len) != 0) return "";
+    return String((char*)b64_buf, b64_len);
+}
+
+String Crypto::decrypt(const String& base64_ciphertext) {
+    char plain[CRYPTO_MAX_PLAINTEXT + 1];
+    size_t plain_len = decryptBase64(base64_ciphertext.c_str(), base64_ciphertext.length(), (uint8_t*)plain, CRYPTO_MAX_PLAINTEXT);
+    if (plain_len == 0) return "";
+
+    plain[plain_len] = '\0';
+    String result(plain);
+    mbedtls_platform_zeroize(plain, plain_len);
     return result;
-}
\ No newline at end of file
+}
+
+size_t Crypto::encryptBinary(const String& plaintext, uint8_t* out, size_t out_capacity) {
+    return encrypt((const uint8_t*)plaintext.c_str(), plaintext.length(), out, out_capacity);
+}
+
+String Crypto::decryptBinary(const uint8_t* data, size_t len) {
+    char plain[CRYPTO_MAX_PLAINTEXT + 1];
+    size_t plain_len = decrypt(data, len, (uint8_t*)plain, CRYPTO_MAX_PLAINTEXT);
+    if (plain_len == 0) return ""; // Restituisce stringa vuota in caso di errore
+
+    plain[plain_len] = '\0';
+    String result(plain);
+    mbedtls_platform_zeroize(plain, plain_len);
+    return result;
+}
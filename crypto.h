@@ -5,15 +5,36 @@
 // Questo risolve il conflitto principale.
 #include "mbedtls/gcm.h"
 
+// Lunghezza massima del testo in chiaro gestita dai wrapper String, che lavorano su buffer
+// nello stack (le password nel vault sono comunque limitate a meno di 256 byte cifrati).
+#define CRYPTO_MAX_PLAINTEXT 256
+
 class Crypto {
 public:
     Crypto();
     ~Crypto();
 
     void begin(const unsigned char* key);
+
+    // API senza allocazioni: il chiamante fornisce input e buffer di uscita.
+    // encrypt scrive [IV][Tag][Testo cifrato] e restituisce i byte scritti;
+    // decrypt verifica il tag e restituisce i byte di testo in chiaro. 0 = errore o buffer insufficiente.
+    size_t encrypt(const uint8_t* in, size_t in_len, uint8_t* out, size_t out_capacity);
+    size_t decrypt(const uint8_t* in, size_t in_len, uint8_t* out, size_t out_capacity);
+    // Come decrypt(), per testi cifrati nel formato base64 legacy
+    size_t decryptBase64(const char* in, size_t in_len, uint8_t* out, size_t out_capacity);
+
+    // Wrapper String (formato base64 legacy), basati sull'API precedente
     String encrypt(const String& plaintext);
     String decrypt(const String& base64_ciphertext);
 
+    // Modalita' binaria con String: IV, tag e testo cifrato nel buffer del chiamante, senza base64.
+    size_t encryptBinary(const String& plaintext, uint8_t* out, size_t out_capacity);
+    String decryptBinary(const uint8_t* data, size_t len);
+
+    // Byte occupati da un testo cifrato binario per un testo in chiaro di 'plain_len' byte
+    static size_t binarySize(size_t plain_len);
+
 private:
     // Non usiamo più un puntatore, ma l'oggetto contesto direttamente.
     // La libreria stessa gestirà l'allocazione della memoria.
@@ -0,0 +1,171 @@
+#include "csv_reader.h"
+#include "mbedtls/platform_util.h"
+
+static const char EMPTY_FIELD[] = "";
+
+CsvReader::CsvReader(File& file, char delimiter)
+    : m_file(file), m_delimiter(delimiter), m_read_len(0), m_read_pos(0), m_at_start(true),
+      m_record_len(0), m_field_count(0), m_field_start(0), m_field_truncated(false),
+      m_column_mask(CSV_ALL_COLUMNS), m_line(0) {}
+
+CsvReader::~CsvReader() {
+    mbedtls_platform_zeroize(m_read_buf, sizeof(m_read_buf));
+    mbedtls_platform_zeroize(m_record, sizeof(m_record));
+}
+
+int CsvReader::_get() {
+    if (m_read_pos >= m_read_len) {
+        m_read_len = m_file.read(m_read_buf, sizeof(m_read_buf));
+        m_read_pos = 0;
+        if (m_read_len == 0) return -1;
+        if (m_at_start) {
+            m_at_start = false;
+            // BOM UTF-8 aggiunto da Excel e da alcuni browser
+            if (m_read_len >= 3 && m_read_buf[0] == 0xEF && m_read_buf[1] == 0xBB && m_read_buf[2] == 0xBF) {
+                m_read_pos = 3;
+                if (m_read_len == 3) return _get();
+            }
+        }
+    }
+    return m_read_buf[m_read_pos++];
+}
+
+bool CsvReader::_keepColumn(size_t index) const {
+    return index < CSV_MAX_FIELDS && (m_column_mask & (1u << index));
+}
+
+void CsvReader::_beginField() {
+    m_field_start = m_record_len;
+    m_field_truncated = false;
+}
+
+void CsvReader::_put(char c) {
+    if (!_keepColumn(m_field_count)) return;
+    // Lascia sempre un byte libero per il terminatore del campo
+    if (m_record_len - m_field_start < CSV_MAX_FIELD_LEN && m_record_len + 1 < sizeof(m_record)) {
+        m_record[m_record_len++] = c;
+    } else {
+        m_field_truncated = true;
+    }
+}
+
+void CsvReader::_endField() {
+    if (m_field_count < CSV_MAX_FIELDS) {
+        CsvField& f = m_fields[m_field_count];
+        if (_keepColumn(m_field_count) && m_record_len < sizeof(m_record)) {
+            m_record[m_record_len] = '\0';
+            f.data = &m_record[m_field_start];
+            f.len = m_record_len - m_field_start;
+            f.truncated = m_field_truncated;
+            m_record_len++;
+        } else {
+            f.data = EMPTY_FIELD;
+            f.len = 0;
+            f.truncated = _keepColumn(m_field_count);
+        }
+    }
+    m_field_count++;
+}
+
+bool CsvReader::next() {
+    enum { FIELD_START, UNQUOTED, QUOTED, QUOTE_IN_QUOTED } state = FIELD_START;
+    m_record_len = 0;
+    m_field_count = 0;
+    bool line_empty = true;
+    _beginField();
+
+    for (;;) {
+        int c = _get();
+        if (c < 0) {
+            // Fine file: l'ultimo record puo' non avere l'a capo finale
+            if (line_empty) return false;
+            m_line++;
+            _endField();
+            break;
+        }
+        if (c != '\r' && c != '\n') line_empty = false;
+
+        if (state == QUOTED) {
+            if (c == '"') {
+                state = QUOTE_IN_QUOTED;
+            } else {
+                if (c == '\n') m_line++;
+                _put((char)c);
+            }
+            continue;
+        }
+        if (state == QUOTE_IN_QUOTED) {
+            if (c == '"') {  // "" = virgolette letterali
+                _put('"');
+                state = QUOTED;
+                continue;
+            }
+            state = UNQUOTED; // Fine del campo tra virgolette: il carattere viene gestito sotto
+        }
+        if (state == FIELD_START && c == '"') {
+            state = QUOTED;
+            continue;
+        }
+
+        // Campo senza virgolette (o dopo la chiusura delle virgolette)
+        if (c == m_delimiter) {
+            _endField();
+            _beginField();
+            state = FIELD_START;
+        } else if (c == '\n') {
+            m_line++;
+            if (line_empty) {  // Riga vuota (anche solo "\r\n"): saltata
+                continue;
+            }
+            _endField();
+            break;
+        } else if (c != '\r') {  // CR fuori dalle virgolette: parte di CRLF, ignorato
+            _put((char)c);
+            state = UNQUOTED;
+        }
+    }
+
+    if (m_field_count > CSV_MAX_FIELDS) m_field_count = CSV_MAX_FIELDS;
+    return true;
+}
+
+CsvField CsvReader::field(int index) const {
+    if (index < 0 || (size_t)index >= m_field_count) return { EMPTY_FIELD, 0, false };
+    return m_fields[index];
+}
+
+CsvColumnMap CsvReader::detectColumns(const CsvReader& header) {
+    CsvColumnMap map = { -1, -1, -1 };
+    int url_column = -1;
+    for (size_t i = 0; i < header.fieldCount(); i++) {
+        const char* name = header.field(i).data;
+        // Gli spazi iniziali sono comuni negli export modificati a mano
+        while (*name == ' ') name++;
+        if (map.title < 0 && (!strcasecmp(name, "name") || !strcasecmp(name, "title") || !strcasecmp(name, "titolo"))) {
+            map.title = i;
+        } else if (map.username < 0 && (!strcasecmp(name, "username") || !strcasecmp(name, "login_username") ||
+                                        !strcasecmp(name, "user") || !strcasecmp(name, "utente"))) {
+            map.username = i;
+        } else if (map.password < 0 && (!strcasecmp(name, "password") || !strcasecmp(name, "login_password"))) {
+            map.password = i;
+        } else if (url_column < 0 && (!strcasecmp(name, "url") || !strcasecmp(name, "login_uri"))) {
+            url_column = i;
+        }
+    }
+    // Export senza nome (es. Firefox): l'indirizzo del sito fa da titolo
+    if (map.title < 0) map.title = url_column;
+
+    // Intestazione non riconosciuta: formato posizionale storico
+    if (map.title < 0) map.title = 0;
+    if (map.username < 0) map.username = 1;
+    if (map.password < 0) map.password = 2;
+    return map;
+}
+
+uint32_t CsvReader::columnMask(const CsvColumnMap& map) {
+    uint32_t mask = 0;
+    if (map.title >= 0 && map.title < 32) mask |= 1u << map.title;
+    if (map.username >= 0 && map.username < 32) mask |= 1u << map.username;
+    if (map.password >= 0 && map.password < 32) mask |= 1u << map.password;
+    return mask;
+}
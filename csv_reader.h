@@ -0,0 +1,72 @@
+#pragma once
+#include <Arduino.h>
+#include <FS.h>
+
+// Dimensioni dei buffer del lettore CSV: la memoria usata non dipende dalla dimensione del file
+#define CSV_READ_BUFFER_SIZE 512    // Blocco letto dalla SD
+#define CSV_RECORD_BUFFER_SIZE 768  // Campi conservati del record corrente, con i terminatori
+#define CSV_MAX_FIELD_LEN 255       // Oltre questa lunghezza un campo viene troncato
+#define CSV_MAX_FIELDS 32           // Le colonne successive vengono lette ma ignorate
+#define CSV_ALL_COLUMNS 0xFFFFFFFFu
+
+// Vista su un campo del record corrente: punta nel buffer del lettore (terminata da '\0')
+// e resta valida fino alla successiva chiamata a next().
+struct CsvField {
+    const char* data;
+    size_t len;
+    bool truncated;
+};
+
+// Colonne da cui leggere titolo, utente e password (-1 = assente)
+struct CsvColumnMap {
+    int8_t title;
+    int8_t username;
+    int8_t password;
+};
+
+// Lettore CSV (RFC 4180) in streaming: campi tra virgolette con separatori, a capo e "" al loro
+// interno, righe terminate da LF o CRLF, BOM UTF-8 iniziale. Nessuna allocazione dinamica.
+class CsvReader {
+public:
+    explicit CsvReader(File& file, char delimiter = ',');
+    ~CsvReader();  // Azzera i buffer: contengono password in chiaro
+
+    // Passa al record successivo. Le righe vuote vengono saltate. false a fine file.
+    bool next();
+    size_t fieldCount() const { return m_field_count; }
+    // Campo 'index' del record corrente; vuoto se assente o escluso dal filtro
+    CsvField field(int index) const;
+    // Riga del file su cui termina il record corrente (da 1)
+    size_t lineNumber() const { return m_line; }
+
+    // Conserva solo le colonne indicate (bit i = colonna i): le altre, ad esempio le note
+    // di un export di Bitwarden, vengono scartate senza occupare il buffer del record.
+    void setColumnFilter(uint32_t mask) { m_column_mask = mask; }
+
+    // Riconosce le colonne dall'intestazione corrente (Chrome, Bitwarden, Firefox o il formato
+    // TITOLO,UTENTE,PASSWORD). Le colonne non riconosciute restano alle posizioni 0, 1 e 2.
+    static CsvColumnMap detectColumns(const CsvReader& header);
+    static uint32_t columnMask(const CsvColumnMap& map);
+
+private:
+    int _get();
+    void _beginField();
+    void _put(char c);
+    void _endField();
+    bool _keepColumn(size_t index) const;
+
+    File& m_file;
+    char m_delimiter;
+    uint8_t m_read_buf[CSV_READ_BUFFER_SIZE];
+    size_t m_read_len;
+    size_t m_read_pos;
+    bool m_at_start;      // Nessun byte ancora letto: controllo del BOM
+    char m_record[CSV_RECORD_BUFFER_SIZE];
+    size_t m_record_len;
+    CsvField m_fields[CSV_MAX_FIELDS];
+    size_t m_field_count;
+    size_t m_field_start; // Inizio del campo in costruzione in m_record
+    bool m_field_truncated;
+    uint32_t m_column_mask;
+    size_t m_line;
+};
@@ -0,0 +1,114 @@
+#include "pbkdf2.h"
+#include "mbedtls/sha256.h"
+#include "mbedtls/pkcs5.h"
+#include "mbedtls/platform_util.h"
+
+extern HWCDC USBSerial;
+
+#define SHA256_BLOCK_SIZE 64
+#define SHA256_DIGEST_SIZE 32
+
+bool Pbkdf2Sha256::derive(const uint8_t* password, size_t password_len,
+                          const uint8_t* salt, size_t salt_len,
+                          uint32_t iterations, uint8_t* out, size_t out_len,
+                          Pbkdf2ProgressCallback progress, void* progress_user) {
+    if (iterations == 0 || !out || out_len == 0) return false;
+    uint32_t blocks = (out_len + SHA256_DIGEST_SIZE - 1) / SHA256_DIGEST_SIZE;
+    uint32_t total = blocks * iterations;
+
+    // Chiave HMAC: le password piu' lunghe di un blocco vengono prima ridotte con SHA-256
+    uint8_t key[SHA256_BLOCK_SIZE] = {0};
+    if (password_len > SHA256_BLOCK_SIZE) {
+        mbedtls_sha256(password, password_len, key, 0);
+    } else if (password_len > 0) {
+        memcpy(key, password, password_len);
+    }
+
+    uint8_t pad[SHA256_BLOCK_SIZE];
+    mbedtls_sha256_context inner_base, outer_base, ctx;
+    mbedtls_sha256_init(&inner_base);
+    mbedtls_sha256_init(&outer_base);
+    mbedtls_sha256_init(&ctx);
+
+    // Stati intermedi dopo ipad e opad: calcolati una volta per tutta la derivazione
+    for (int i = 0; i < SHA256_BLOCK_SIZE; i++) pad[i] = key[i] ^ 0x36;
+    mbedtls_sha256_starts(&inner_base, 0);
+    mbedtls_sha256_update(&inner_base, pad, SHA256_BLOCK_SIZE);
+    for (int i = 0; i < SHA256_BLOCK_SIZE; i++) pad[i] = key[i] ^ 0x5c;
+    mbedtls_sha256_starts(&outer_base, 0);
+    mbedtls_sha256_update(&outer_base, pad, SHA256_BLOCK_SIZE);
+    mbedtls_platform_zeroize(key, sizeof(key));
+    mbedtls_platform_zeroize(pad, sizeof(pad));
+
+    uint8_t u[SHA256_DIGEST_SIZE];
+    uint8_t t[SHA256_DIGEST_SIZE];
+    uint32_t block = 1;
+    size_t produced = 0;
+    while (produced < out_len) {
+        // U1 = HMAC(P, S || INT(block))
+        uint8_t block_be[4] = { (uint8_t)(block >> 24), (uint8_t)(block >> 16), (uint8_t)(block >> 8), (uint8_t)block };
+        mbedtls_sha256_clone(&ctx, &inner_base);
+        mbedtls_sha256_update(&ctx, salt, salt_len);
+        mbedtls_sha256_update(&ctx, block_be, 4);
+        mbedtls_sha256_finish(&ctx, u);
+        mbedtls_sha256_clone(&ctx, &outer_base);
+        mbedtls_sha256_update(&ctx, u, SHA256_DIGEST_SIZE);
+        mbedtls_sha256_finish(&ctx, u);
+        memcpy(t, u, SHA256_DIGEST_SIZE);
+
+        // Uj = HMAC(P, Uj-1): un blocco interno e uno esterno per iterazione
+        for (uint32_t j = 1; j < iterations; j++) {
+            mbedtls_sha256_clone(&ctx, &inner_base);
+            mbedtls_sha256_update(&ctx, u, SHA256_DIGEST_SIZE);
+            mbedtls_sha256_finish(&ctx, u);
+            mbedtls_sha256_clone(&ctx, &outer_base);
+            mbedtls_sha256_update(&ctx, u, SHA256_DIGEST_SIZE);
+            mbedtls_sha256_finish(&ctx, u);
+            for (int k = 0; k < SHA256_DIGEST_SIZE; k++) t[k] ^= u[k];
+            if (progress && (j % PBKDF2_PROGRESS_INTERVAL) == 0) {
+                progress((block - 1) * iterations + j, total, progress_user);
+            }
+        }
+
+        size_t n = out_len - produced;
+        if (n > SHA256_DIGEST_SIZE) n = SHA256_DIGEST_SIZE;
+        memcpy(out + produced, t, n);
+        produced += n;
+        block++;
+    }
+    if (progress) progress(total, total, progress_user);
+
+    mbedtls_platform_zeroize(u, sizeof(u));
+    mbedtls_platform_zeroize(t, sizeof(t));
+    mbedtls_sha256_free(&ctx);
+    mbedtls_sha256_free(&inner_base);
+    mbedtls_sha256_free(&outer_base);
+    return true;
+}
+
+bool Pbkdf2Sha256::selfTest() {
+    // RFC 7914, sezione 11: PBKDF2-HMAC-SHA256(P="passwd", S="salt", c=1, dkLen=64)
+    static const uint8_t expected[64] = {
+        0x55, 0xac, 0x04, 0x6e, 0x56, 0xe3, 0x08, 0x9f, 0xec, 0x16, 0x91, 0xc2, 0x25, 0x44, 0xb6, 0x05,
+        0xf9, 0x41, 0x85, 0x21, 0x6d, 0xde, 0x04, 0x65, 0xe6, 0x8b, 0x9d, 0x57, 0xc2, 0x0d, 0xac, 0xbc,
+        0x49, 0xca, 0x9c, 0xcc, 0xf1, 0x79, 0xb6, 0x45, 0x99, 0x16, 0x64, 0xb3, 0x9d, 0x77, 0xef, 0x31,
+        0x7c, 0x71, 0xb8, 0x45, 0xb1, 0xe3, 0x0b, 0xd5, 0x09, 0x11, 0x20, 0x41, 0xd3, 0xa1, 0x97, 0x83
+    };
+    uint8_t out[64];
+    if (!derive((const uint8_t*)"passwd", 6, (const uint8_t*)"salt", 4, 1, out, sizeof(out)) ||
+        memcmp(out, expected, sizeof(out)) != 0) {
+        USBSerial.println("ERRORE PBKDF2: Vettore di test RFC 7914 non superato.");
+        return false;
+    }
+
+    // Piu' iterazioni, nella forma usata per il PIN: deve coincidere con mbedtls
+    static const uint8_t salt[16] = { 0x00, 0x11, 0x22, 0x33, 0x44, 0x55, 0x66, 0x77, 0x88, 0x99, 0xaa, 0xbb, 0xcc, 0xdd, 0xee, 0xff };
+    uint8_t reference[32];
+    mbedtls_pkcs5_pbkdf2_hmac_ext(MBEDTLS_MD_SHA256, (const unsigned char*)"123456", 6, salt, sizeof(salt), 100, sizeof(reference), reference);
+    if (!derive((const uint8_t*)"123456", 6, salt, sizeof(salt), 100, out, sizeof(reference)) ||
+        memcmp(out, reference, sizeof(reference)) != 0) {
+        USBSerial.println("ERRORE PBKDF2: Risultato diverso da mbedtls.");
+        return false;
+    }
+    return true;
+}
@@ -0,0 +1,23 @@
+#pragma once
+#include <Arduino.h>
+
+// PBKDF2-HMAC-SHA256 dedicato alla derivazione del PIN.
+// Gli stati SHA-256 dopo i blocchi ipad/opad della chiave vengono calcolati una sola volta
+// e clonati a ogni iterazione: ogni HMAC costa 2 compressioni invece di 4.
+// Il risultato e' identico a mbedtls_pkcs5_pbkdf2_hmac_ext con MBEDTLS_MD_SHA256.
+
+// Avanzamento: 'done' iterazioni su 'total', chiamato ogni PBKDF2_PROGRESS_INTERVAL iterazioni
+typedef void (*Pbkdf2ProgressCallback)(uint32_t done, uint32_t total, void* user);
+#define PBKDF2_PROGRESS_INTERVAL 256
+
+class Pbkdf2Sha256 {
+public:
+    static bool derive(const uint8_t* password, size_t password_len,
+                       const uint8_t* salt, size_t salt_len,
+                       uint32_t iterations, uint8_t* out, size_t out_len,
+                       Pbkdf2ProgressCallback progress = nullptr, void* progress_user = nullptr);
+
+    // Confronta l'implementazione con il vettore di test RFC 7914 e con mbedtls.
+    // Se fallisce, il chiamante deve ripiegare su mbedtls.
+    static bool selfTest();
+};
@@ -18,15 +18,20 @@
 #include "security.h"
 #include "crypto.h"
 #include "credentials.h"
+#include "vault_worker.h"
+#include "credential_list.h"
 #include "keyboard_layouts.h"
 #include "USB.h"
 #include "USBHIDKeyboard.h"
 #include <cstring>  // Necessario per strlen e strncmp
 #include "settings.h"
-#include <algorithm>  // Per la funzione di ordinamento std::sort
 #include <WiFi.h>     // Per ottenere l'ora da internet
 #include "time.h"     // Per gestire l'ora
 #include "mbedtls/sha256.h"
+#include "esp_heap_caps.h"  // Per misurare l'heap nei test di backend
+#include "mbedtls/pkcs5.h"   // PBKDF2 di riferimento per il confronto nei test di backend
+#include "pbkdf2.h"
+#include "crc32c.h"
 #include <math.h>
 
 #include "SensorQMI8658.hpp"
@@ -57,6 +62,7 @@ HWCDC USBSerial;
 SecurityManager securityManager;
 Crypto crypto;
 CredentialsManager credManager;
+VaultWorker vaultWorker;  // Accessi alla SD e decifratura fuori dal thread dell'interfaccia
 XPowersPMU pmu;
 SensorQMI8658 qmi;
 IMUdata acc;
@@ -72,12 +78,28 @@ void Arduino_IIC_Touch_Interrupt(void) {
   FT3168->IIC_Interrupt_Flag = true;
 }
 
-// Struttura per l'ordinamento delle credenziali
+// Voce della lista in ordine alfabetico. Il titolo non viene copiato: la lista virtuale lo legge
+// dall'indice di CredentialsManager solo per le righe visibili.
 struct CredentialInfo {
-  String title;
   size_t original_index;
 };
 std::vector<CredentialInfo> sorted_credentials;
+// Record scelto dall'utente: l'indice vale solo nella generazione in cui e' stato letto
+struct CredentialRef {
+  size_t index;
+  uint32_t generation;
+};
+uint32_t sorted_generation = 0;  // Generazione del vault da cui e' stata costruita 'sorted_credentials'
+// Il thread LVGL non aspetta mai il VaultWorker senza limite: attesa massima per il Lock dell'indice,
+// poi la lista resta com'e' e la ricostruzione viene ritentata
+#define UI_INDEX_LOCK_MS 20
+#define UI_INDEX_RETRY_MS 200
+// Tabella di salto della barra alfabetica: prima posizione in 'sorted_credentials' di ogni lettera
+// (0 = A ... 25 = Z, COLLATION_OTHER_LETTER = cifre e simboli). Calcolata con la lista dalla tabella
+// delle lettere di credentials.idx: i callback non la scorrono piu'. Le lettere senza voci puntano
+// alla lettera con voci piu' vicina.
+#define LETTER_JUMP_ENTRIES (COLLATION_OTHER_LETTER + 1)
+size_t letter_jump[LETTER_JUMP_ENTRIES];
 
 enum class ChangePinState {
   AWAITING_OLD_PIN,
@@ -94,9 +116,14 @@ const int daylightOffset_sec = 3600;  // Ora legale
 static lv_disp_draw_buf_t draw_buf;
 static lv_color_t buf[LCD_WIDTH * LCD_HEIGHT / 10];
 static lv_obj_t* pin_display_label;
+static lv_obj_t* unlock_progress_arc = NULL;  // Avanzamento della derivazione della chiave durante lo sblocco
+static lv_obj_t* change_pin_progress_arc = NULL;  // Lo stesso per le due derivazioni del cambio PIN
 static String current_pin_attempt = "";
 static lv_obj_t* time_label;
-static lv_obj_t* credential_roller;
+static CredentialList credential_list;  // Lista virtuale: solo le righe visibili esistono come oggetti LVGL
+static ImportProgress import_progress;            // Scritto dal VaultWorker, letto dal timer dell'interfaccia
+static lv_obj_t* import_progress_bar = NULL;
+static lv_timer_t* import_poll_timer = NULL;
 static ChangePinState current_change_pin_state;
 static lv_obj_t* layout_status_label;
 static lv_obj_t* os_status_label;
@@ -124,18 +151,34 @@ void create_pin_lock_screen();
 void create_main_screen();
 void change_to_main_screen_cb(lv_timer_t* timer);
 void pin_matrix_event_cb(lv_event_t* e);
+void unlock_poll_timer_cb(lv_timer_t* timer);
+void on_unlock_success();
+void on_unlock_failure();
 void create_settings_screen();
 void open_usb_mode_screen_cb(lv_event_t* e);
 void type_password_with_layout(const char* password);
 void create_change_pin_screen();  // Dichiarazione anticipata per la nuova schermata
-void checkForAndRunImport();
+bool checkForAndRunImport(ImportMode mode = ImportMode::APPEND);
+void import_done_cb(const VaultJob& job, void* user);
+void import_close_timer_cb(lv_timer_t* timer);
+void import_poll_timer_cb(lv_timer_t* timer);
+void refresh_credential_list(bool keep_selection = true);
+void refresh_retry_timer_cb(lv_timer_t* timer);
+void credential_details_ready_cb(const VaultJob& job, void* user);
+void confirm_delete_credential(const CredentialRef& credential);
+void credential_deleted_cb(const VaultJob& job, void* user);
+void vault_compacted_cb(const VaultJob& job, void* user);
 void change_pin_keypad_event_cb(lv_event_t* e);
 void create_change_pin_flow_screen();
 void post_pin_change_reboot_cb(lv_timer_t* timer);
+void change_pin_poll_timer_cb(lv_timer_t* timer);
+void change_pin_failed_cb(lv_timer_t* timer);
+lv_obj_t* create_kdf_progress_arc(lv_obj_t* parent);
 void create_layout_selection_screen();
 void create_os_selection_screen();
 void update_status_bar();
 static void quick_jump_event_cb(lv_event_t* e);
+void fill_letter_jump_gaps();
 void show_serial_mode_warning_popup(lv_timer_t* timer);
 void create_wipe_settings_screen();
 void handle_inactivity();
@@ -146,6 +189,8 @@ void handle_inactivity();
 // =================================================================
 void run_sd_storage_test();
 void run_backend_tests();
+void measure_credential_list(uint32_t count);
+void run_update_roundtrip_test();
 //
 // =================================================================
 // SEZIONE 5: SETUP E LOOP
@@ -227,6 +272,7 @@ void setup() {
     USBSerial.println("OK: SD Card montata.");
     credManager.begin();
   }
+  vaultWorker.begin(credManager);  // Con un proprio Crypto: 'crypto' resta del thread dell'interfaccia
 
 
   lv_init();
@@ -259,6 +305,7 @@ void setup() {
 
 void loop() {
   lv_timer_handler();
+  vaultWorker.pump();  // Consegna all'interfaccia le richieste completate dal VaultWorker
 
   // --- LOGICA DI CONTROLLO MOVIMENTO ---
   const float SHAKE_THRESHOLD = 1.5;  // Soglia di attivazione (un valore tra 2.5 e 3.5 è un buon punto di partenza)
@@ -314,6 +361,8 @@ void pin_matrix_event_cb(lv_event_t* e) {
   const char* txt = lv_btnmatrix_get_btn_text(btnm, id);
 
   if (txt == NULL) return;
+  // Tastierino ignorato mentre la chiave viene derivata
+  if (securityManager.isUnlockRunning()) return;
 
   // Gestione del tasto backspace
   if (strcmp(txt, LV_SYMBOL_BACKSPACE) == 0) {
@@ -333,59 +382,107 @@ void pin_matrix_event_cb(lv_event_t* e) {
 
   // Se abbiamo 6 cifre, controlla il PIN
   if (current_pin_attempt.length() == 6) {
-    if (securityManager.checkPin(current_pin_attempt)) {
-      settingsManager.resetFailedAttempts();
+    // La derivazione della chiave gira su un task dedicato: qui si avvia e si mostra l'avanzamento
+    if (securityManager.startUnlock(current_pin_attempt)) {
+      lv_label_set_text(pin_display_label, "Sblocco...");
+      if (unlock_progress_arc) {
+        lv_arc_set_value(unlock_progress_arc, 0);
+        lv_obj_clear_flag(unlock_progress_arc, LV_OBJ_FLAG_HIDDEN);
+      }
+      lv_timer_create(unlock_poll_timer_cb, 50, NULL);
+    } else {
+      current_pin_attempt = "";
+      lv_label_set_text(pin_display_label, "");
+    }
+  }
+}
 
-      // 1. Inizializza la crittografia
+// Aggiorna l'arco di avanzamento e gestisce l'esito dello sblocco asincrono
+void unlock_poll_timer_cb(lv_timer_t* timer) {
+  UnlockResult result = securityManager.pollUnlock();
+  if (result == UnlockResult::RUNNING) {
+    if (unlock_progress_arc) lv_arc_set_value(unlock_progress_arc, securityManager.getUnlockProgress());
+    return;
+  }
+  lv_timer_del(timer);
+  if (unlock_progress_arc) lv_obj_add_flag(unlock_progress_arc, LV_OBJ_FLAG_HIDDEN);
+
+  if (result == UnlockResult::SUCCESS) {
+    // pollUnlock() ha appena pubblicato lo stato UNLOCKED, su questo thread
+    unlock_progress_arc = NULL;  // La schermata del PIN sta per essere distrutta
+    on_unlock_success();
+  } else if (result == UnlockResult::FAILED) {
+    on_unlock_failure();
+  } else if (result == UnlockResult::CANCELLED) {
+    // Bloccato durante la derivazione (es. scossone): si resta sulla schermata del PIN
+    current_pin_attempt = "";
+    if (lv_obj_is_valid(pin_display_label)) lv_label_set_text(pin_display_label, "");
+  }
+}
 
-      crypto.begin(securityManager.getUserKey());
+void on_unlock_success() {
+  settingsManager.resetFailedAttempts();
 
-      // 2. Esegui l'importazione (se c'è il file)
-      //checkForAndRunImport();
+  // 1. Inizializza la crittografia: quella dell'interfaccia e quella del VaultWorker, che la riceve
+  // come job dopo quelli in corso (un'importazione avviata prima del blocco continua con la sua)
+  crypto.begin(securityManager.getUserKey());
+  if (!vaultWorker.requestSetKey(securityManager.getUserKey())) {
+    USBSerial.println("ERRORE: Impossibile passare la chiave al VaultWorker. Lettura delle password non disponibile.");
+  }
 
-      // 3. ESEGUI IL DEBUG QUI
-      debug_print_all_credentials();
+  // 2. Esegui l'importazione (se c'è il file)
+  //checkForAndRunImport();
 
-      // 4. Prosegui con la UI
-      USBSerial.println("SUCCESS: PIN corretto! Sblocco in corso...");
-      lv_timer_create(change_to_main_screen_cb, 50, NULL);
-    } else {
-      settingsManager.incrementFailedAttempts();  // Incrementiamo il contatore
-      uint8_t failed_attempts = settingsManager.getFailedAttempts();
-      uint8_t max_attempts = settingsManager.getMaxPinAttempts();
-
-      if (failed_attempts >= max_attempts) {
-        // SOGLIA SUPERATA: CANCELLA TUTTO
-        USBSerial.println("!!! MASSIMO NUMERO DI TENTATIVI RAGGIUNTO !!!");
-        USBSerial.println("!!! CANCELLAZIONE CREDENZIALI IN CORSO... !!!");
-
-        credManager.clear();  // Cancella il file credentials.bin
-
-        // Mostra un messaggio definitivo e non cancellabile
-        lv_obj_t* mbox = lv_msgbox_create(NULL, "SICUREZZA ATTIVATA",
-                                          "Troppi tentativi errati.\n\n"
-                                          "Le credenziali sono state\n"
-                                          "cancellate in modo sicuro.\n\n"
-                                          "Il dispositivo si riavviera'.",
-                                          NULL, false);
-        lv_obj_center(mbox);
+  // 3. ESEGUI IL DEBUG QUI
+  debug_print_all_credentials();
 
-        // Crea un timer per riavviare il dispositivo dopo 5 secondi
-        lv_timer_create([](lv_timer_t* timer) {
-          pmu.reset();
-        },
-                        5000, NULL)
-          ->repeat_count = 1;
+  // 4. Prosegui con la UI
+  USBSerial.println("SUCCESS: PIN corretto! Sblocco in corso...");
+  lv_timer_create(change_to_main_screen_cb, 50, NULL);
+}
 
-      } else {
-        // Mostra il normale messaggio di errore
-        USBSerial.printf("FAIL: PIN errato! Tentativo %d di %d.\n", failed_attempts, max_attempts);
-        lv_label_set_text_fmt(pin_display_label, "Errato! (%d/%d)", failed_attempts, max_attempts);
-        delay(1000);  // Pausa per mostrare l'errore
-        current_pin_attempt = "";
-        lv_label_set_text(pin_display_label, "");
-      }
-    }
+void on_unlock_failure() {
+  settingsManager.incrementFailedAttempts();  // Incrementiamo il contatore
+  uint8_t failed_attempts = settingsManager.getFailedAttempts();
+  uint8_t max_attempts = settingsManager.getMaxPinAttempts();
+
+  if (failed_attempts >= max_attempts) {
+    // SOGLIA SUPERATA: CANCELLA TUTTO
+    USBSerial.println("!!! MASSIMO NUMERO DI TENTATIVI RAGGIUNTO !!!");
+    USBSerial.println("!!! CANCELLAZIONE CREDENZIALI IN CORSO... !!!");
+
+    // Distrugge la chiave dati (pochi millisecondi): da qui il vault e' illeggibile.
+    // Il file viene poi sovrascritto in background.
+    securityManager.cryptoErase();
+    credManager.secureWipe();
+
+    // Mostra un messaggio definitivo e non cancellabile
+    lv_obj_t* mbox = lv_msgbox_create(NULL, "SICUREZZA ATTIVATA",
+                                      "Troppi tentativi errati.\n\n"
+                                      "Le credenziali sono state\n"
+                                      "cancellate in modo sicuro.\n\n"
+                                      "Il dispositivo si riavviera'.",
+                                      NULL, false);
+    lv_obj_center(mbox);
+
+    // Crea un timer per riavviare il dispositivo dopo 5 secondi
+    lv_timer_create([](lv_timer_t* timer) {
+      pmu.reset();
+    },
+                    5000, NULL)
+      ->repeat_count = 1;
+
+  } else {
+    // Mostra il normale messaggio di errore
+    USBSerial.printf("FAIL: PIN errato! Tentativo %d di %d.\n", failed_attempts, max_attempts);
+    lv_label_set_text_fmt(pin_display_label, "Errato! (%d/%d)", failed_attempts, max_attempts);
+    current_pin_attempt = "";
+    // Cancella il messaggio dopo 1 secondo senza bloccare l'interfaccia (a meno che non si stia gia' riscrivendo)
+    lv_timer_create([](lv_timer_t* timer) {
+      if (current_pin_attempt.length() == 0) lv_label_set_text(pin_display_label, "");
+    },
+                    1000, NULL)
+      ->repeat_count = 1;
   }
 }
 
@@ -423,7 +520,7 @@ void run_backend_tests() {
     Credential test_cred;
     if (credManager.getCredential(1, &test_cred)) {
       USBSerial.printf("OK: Letta credenziale: Titolo='%s', Utente='%s'\n", test_cred.title, test_cred.username);
-      String decrypted_pass = crypto.decrypt(test_cred.encrypted_password);
+      String decrypted_pass = CredentialsManager::decryptPassword(crypto, test_cred);
       USBSerial.printf("Password decifrata: '%s'\n", decrypted_pass.c_str());
       if (decrypted_pass == "UnAltraPasswordComplessa") {
         USBSerial.println("SUCCESS: La decifratura corrisponde! Test superato.");
@@ -434,14 +531,178 @@ void run_backend_tests() {
   } else {
     USBSerial.println("FAIL: Il numero di credenziali salvate non e' corretto.");
   }
+  if (credManager.getCount() == 2) run_update_roundtrip_test();
+
+  // Confronto di latenza tra la decifratura base64 (legacy) e quella binaria
+  const int DECRYPT_RUNS = 100;
+  String test_plain = "UnAltraPasswordComplessa";
+  String legacy_cipher = crypto.encrypt(test_plain);
+  Credential bin_cred = { 0 };
+  if (CredentialsManager::encryptPassword(crypto, test_plain, &bin_cred)) {
+    uint32_t t0 = micros();
+    for (int i = 0; i < DECRYPT_RUNS; i++) crypto.decrypt(legacy_cipher);
+    uint32_t t1 = micros();
+    for (int i = 0; i < DECRYPT_RUNS; i++) CredentialsManager::decryptPassword(crypto, bin_cred);
+    uint32_t t2 = micros();
+    USBSerial.printf("Decifratura: base64 %d us, binaria %d us (media su %d). Dimensione: %d vs %d bytes.\n",
+                     (t1 - t0) / DECRYPT_RUNS, (t2 - t1) / DECRYPT_RUNS, DECRYPT_RUNS, legacy_cipher.length(), bin_cred.encrypted_len);
+  }
+
+  // Ciclo di ri-cifratura con l'API senza allocazioni: l'heap libero deve restare invariato
+  const int REENCRYPT_RUNS = 1000;
+  char plain_buf[MAX_ENCRYPTED_PASS_LEN];
+  size_t heap_before = heap_caps_get_free_size(MALLOC_CAP_8BIT);
+  uint32_t t_start = micros();
+  int reencrypt_ok = 0;
+  for (int i = 0; i < REENCRYPT_RUNS; i++) {
+    size_t len = CredentialsManager::decryptPassword(crypto, bin_cred, plain_buf, sizeof(plain_buf));
+    if (len > 0 && CredentialsManager::encryptPassword(crypto, plain_buf, len, &bin_cred)) reencrypt_ok++;
+  }
+  uint32_t elapsed_us = micros() - t_start;
+  size_t heap_after = heap_caps_get_free_size(MALLOC_CAP_8BIT);
+  USBSerial.printf("Ri-cifratura: %d/%d record, %d record/s, variazione heap %d bytes.\n",
+                   reencrypt_ok, REENCRYPT_RUNS, (int)(REENCRYPT_RUNS * 1000000ULL / (elapsed_us ? elapsed_us : 1)), (int)heap_before - (int)heap_after);
+
+  // PBKDF2 ottimizzato contro mbedtls: stesso risultato, meno compressioni SHA-256 per iterazione
+  const uint32_t PBKDF2_RUNS = 1000;
+  const uint8_t pbkdf2_salt[16] = { 0 };
+  uint8_t pbkdf2_fast[32], pbkdf2_ref[32];
+  uint32_t p0 = micros();
+  mbedtls_pkcs5_pbkdf2_hmac_ext(MBEDTLS_MD_SHA256, (const unsigned char*)"123456", 6, pbkdf2_salt, sizeof(pbkdf2_salt), PBKDF2_RUNS, sizeof(pbkdf2_ref), pbkdf2_ref);
+  uint32_t p1 = micros();
+  Pbkdf2Sha256::derive((const uint8_t*)"123456", 6, pbkdf2_salt, sizeof(pbkdf2_salt), PBKDF2_RUNS, pbkdf2_fast, sizeof(pbkdf2_fast));
+  uint32_t p2 = micros();
+  USBSerial.printf("PBKDF2 (%u iterazioni): mbedtls %u us, ottimizzato %u us, risultato %s.\n",
+                   PBKDF2_RUNS, p1 - p0, p2 - p1, memcmp(pbkdf2_fast, pbkdf2_ref, 32) == 0 ? "identico" : "DIVERSO");
+
+  // CRC32C dei record: deve restare trascurabile rispetto alla lettura dalla SD
+  const size_t CRC_BYTES = 64 * 1024;
+  uint8_t* crc_buf = (uint8_t*)heap_caps_malloc(CRC_BYTES, MALLOC_CAP_8BIT);
+  if (crc_buf) {
+    for (size_t i = 0; i < CRC_BYTES; i++) crc_buf[i] = (uint8_t)i;
+    uint32_t c0 = micros();
+    Crc32c::compute(crc_buf, CRC_BYTES);
+    uint32_t c1 = micros();
+    heap_caps_free(crc_buf);
+    USBSerial.printf("CRC32C: vettore di verifica %s, %u KB/s.\n", Crc32c::selfTest() ? "OK" : "ERRATO",
+                     (uint32_t)(CRC_BYTES * 1000ULL / ((c1 - c0) ? (c1 - c0) : 1)));
+  }
+
+  // Velocita' della derivazione del PIN e iterazioni per l'obiettivo di sblocco.
+  // Solo misura: la calibrazione salvata (e quindi il costo del prossimo sblocco) non cambia.
+  uint32_t kdf_per_second = 0;
+  uint32_t kdf_iterations = securityManager.measureKdf(SEC_KDF_TARGET_MS, &kdf_per_second);
+  USBSerial.printf("KDF: %u iterazioni/s, %u iterazioni per ~%d ms di sblocco (in uso: %u).\n",
+                   kdf_per_second, kdf_iterations, SEC_KDF_TARGET_MS, securityManager.getKdfIterations());
+  measure_credential_list(100);
+  measure_credential_list(50000);
   USBSerial.println("--- Fine Test Backend ---");
 }
 
+// Rilegge dalla SD il record 'index' e ne decifra la password
+static bool verify_credential(size_t index, const char* title, const char* username, const char* password) {
+  Credential cred;
+  if (!credManager.getCredential(index, &cred)) return false;
+  String plain = CredentialsManager::decryptPassword(crypto, cred);
+  return strcmp(cred.title, title) == 0 && strcmp(cred.username, username) == 0 && plain == password;
+}
+
+static bool update_credential(size_t index, const char* title, const char* username, const char* password) {
+  Credential cred = { 0 };
+  strncpy(cred.title, title, MAX_TITLE_LEN - 1);
+  strncpy(cred.username, username, MAX_USERNAME_LEN - 1);
+  return CredentialsManager::encryptPassword(crypto, String(password), &cred) && credManager.updateCredential(index, cred);
+}
+
+// Modifica di un record sul posto e in coda, eliminazione e compattazione sul vault appena importato
+// (0 = "Sito Web Famoso", 1 = "Account Google"). Modifica il vault direttamente: il VaultWorker deve essere inattivo.
+void run_update_roundtrip_test() {
+  USBSerial.println("--- Test modifica, eliminazione e compattazione ---");
+  uint32_t generation = credManager.getGeneration();
+
+  // 1. Stessa dimensione: scrittura sul posto attraverso il giornale, generazione invariata
+  bool ok = update_credential(0, "Sito Web Famoso", "test@email.com", "PasswordSuperSegreta124!") &&
+            credManager.getGeneration() == generation &&
+            verify_credential(0, "Sito Web Famoso", "test@email.com", "PasswordSuperSegreta124!");
+  USBSerial.println(ok ? "OK: Modifica sul posto riletta e decifrata." : "FAIL: Modifica sul posto.");
+  bool all_ok = ok;
+
+  // 2. Record piu' grande: nuova versione in coda al vault, stesso indice
+  ok = update_credential(1, "Account Google (lavoro)", "daniele.lavoro@example.com", "UnaPasswordDecisamentePiuLungaDiPrima#2024") &&
+       credManager.getCount() == 2 &&
+       verify_credential(1, "Account Google (lavoro)", "daniele.lavoro@example.com", "UnaPasswordDecisamentePiuLungaDiPrima#2024");
+  USBSerial.println(ok ? "OK: Modifica in coda riletta e decifrata." : "FAIL: Modifica in coda.");
+  all_ok = all_ok && ok;
+
+  // 3. Eliminazione: il record resta nella tabella fino alla compattazione
+  ok = credManager.deleteCredential(0) && credManager.isDeleted(0) && credManager.getCount() == 2;
+  USBSerial.println(ok ? "OK: Record eliminato." : "FAIL: Eliminazione.");
+  all_ok = all_ok && ok;
+
+  // 4. Compattazione: nuova generazione, il record modificato in coda diventa l'indice 0
+  ok = credManager.compact() && credManager.getCount() == 1 && credManager.getGeneration() != generation &&
+       !credManager.isDeleted(0) &&
+       verify_credential(0, "Account Google (lavoro)", "daniele.lavoro@example.com", "UnaPasswordDecisamentePiuLungaDiPrima#2024");
+  USBSerial.println(ok ? "OK: Compattazione riletta e decifrata." : "FAIL: Compattazione.");
+  all_ok = all_ok && ok;
+
+  // 5. Dopo un nuovo caricamento dalla SD il risultato non cambia
+  credManager.begin();
+  ok = credManager.getCount() == 1 &&
+       verify_credential(0, "Account Google (lavoro)", "daniele.lavoro@example.com", "UnaPasswordDecisamentePiuLungaDiPrima#2024");
+  USBSerial.println(ok ? "OK: Vault ricaricato invariato." : "FAIL: Vault ricaricato.");
+  all_ok = all_ok && ok;
+  USBSerial.println(all_ok ? "SUCCESS: Test modifica/eliminazione/compattazione superato." : "FAIL: Test modifica/eliminazione/compattazione.");
+}
+
+static bool measure_row_text(uint32_t row, char* buffer, size_t len, void* user) {
+  snprintf(buffer, len, "Credenziale di prova %u", row);
+  return true;
+}
+
+// Lista virtuale con 'count' voci fittizie su una schermata non visibile (richiede lv_init()):
+// heap occupata dal widget e tempo di aggiornamento delle righe per ogni riga di scorrimento.
+// Il tempo non comprende il disegno sul display, che dipende solo dalle righe visibili.
+void measure_credential_list(uint32_t count) {
+  const uint32_t STEPS = 500;
+  size_t heap_before = heap_caps_get_free_size(MALLOC_CAP_8BIT);
+  lv_obj_t* scr = lv_obj_create(NULL);
+  lv_obj_set_size(scr, LCD_WIDTH, LCD_HEIGHT);
+  CredentialList list;
+  lv_obj_t* obj = list.create(scr, 44, measure_row_text, NULL);
+  lv_obj_set_size(obj, lv_pct(80), 220);
+  lv_obj_set_style_text_font(obj, &lv_font_montserrat_22, 0);
+  list.setCount(count);
+  size_t heap_used = heap_before - heap_caps_get_free_size(MALLOC_CAP_8BIT);
+
+  uint32_t total_us = 0;
+  uint32_t max_us = 0;
+  for (uint32_t step = 1; step <= STEPS; step++) {
+    uint32_t t0 = micros();
+    list.setSelected(step % count, LV_ANIM_OFF);  // Una riga per passo, come durante lo scorrimento
+    uint32_t us = micros() - t0;
+    total_us += us;
+    if (us > max_us) max_us = us;
+  }
+  lv_obj_del(scr);
+  USBSerial.printf("Lista virtuale: %u voci, %u bytes di heap, aggiornamento per passo %u us medi (max %u us, %d ms per fotogramma).\n",
+                   count, (uint32_t)heap_used, total_us / STEPS, max_us, CREDENTIAL_LIST_FRAME_MS);
+}
+
 // Aggiungi questa funzione di debug al tuo file .ino
 
 void debug_print_all_credentials() {
   USBSerial.println("\n--- INIZIO DEBUG CREDENZIALI SALVATE ---");
 
+  // Chiamata dal thread LVGL: se il VaultWorker sta lavorando sul vault non si aspetta.
+  // Un'importazione in corso accoda al vault senza tenere il Lock: anche in quel caso si salta.
+  CredentialsManager::Lock lock(credManager, pdMS_TO_TICKS(UI_INDEX_LOCK_MS));
+  if (!lock.held() || vaultWorker.isBusy()) {
+    USBSerial.println("ATTENZIONE: Vault occupato dal VaultWorker. Debug saltato.");
+    USBSerial.println("--- FINE DEBUG ---");
+    return;
+  }
+
   size_t count = credManager.getCount();
   if (count == 0) {
     USBSerial.println("RISULTATO: Nessuna credenziale trovata da CredentialsManager (getCount() == 0).");
@@ -451,27 +712,25 @@ void debug_print_all_credentials() {
 
   USBSerial.printf("Trovate %d credenziali da CredentialsManager.\n", count);
 
-  // Inizializza crypto con la chiave per poter decifrare
-  // Assicurati che il dispositivo sia sbloccato prima di chiamare questa funzione
-  crypto.begin(securityManager.getUserKey());
-
-  for (size_t i = 0; i < count; i++) {
-    Credential temp_cred;
-    if (credManager.getCredential(i, &temp_cred)) {
-      USBSerial.printf("\n--- Credenziale #%d ---\n", i);
-      USBSerial.printf("  - Titolo: '%s'\n", temp_cred.title);
-      USBSerial.printf("  - Utente: '%s'\n", temp_cred.username);
-
-      String decrypted_pass = crypto.decrypt(temp_cred.encrypted_password);
-      if (decrypted_pass.length() > 0) {
-        USBSerial.printf("  - Password (decifrata): '%s'\n", decrypted_pass.c_str());
-      } else {
-        USBSerial.println("  - ERRORE: Impossibile decifrare la password!");
-      }
+  // 'crypto' è già stato inizializzato con la chiave in on_unlock_success()
+  // Un'unica scansione sequenziale del file invece di un open/seek/read per record
+  CredentialsManager::RangeReader reader(credManager);
+  const Credential* temp_cred;
+  while ((temp_cred = reader.next()) != nullptr) {
+    USBSerial.printf("\n--- Credenziale #%d ---\n", reader.index());
+    USBSerial.printf("  - Titolo: '%s'\n", temp_cred->title);
+    USBSerial.printf("  - Utente: '%s'\n", temp_cred->username);
+
+    String decrypted_pass = CredentialsManager::decryptPassword(crypto, *temp_cred);
+    if (decrypted_pass.length() > 0) {
+      USBSerial.printf("  - Password (decifrata): '%s'\n", decrypted_pass.c_str());
     } else {
-      USBSerial.printf("\nERRORE: Impossibile leggere la credenziale #%d dal file.\n", i);
+      USBSerial.println("  - ERRORE: Impossibile decifrare la password!");
     }
   }
+  if (reader.index() + 1 != count) {
+    USBSerial.printf("\nERRORE: Lettura interrotta, lette %d credenziali su %d.\n", reader.index() + 1, count);
+  }
   USBSerial.println("\n--- FINE DEBUG CREDENZIALI SALVATE ---");
 }
 
@@ -491,13 +750,11 @@ void run_sd_storage_test() {
   USBSerial.println("Step 2: Credenziale di test creata in memoria.");
 
   // 3. Scrive la credenziale sul file binario
-  File binFile = SD_MMC.open(CREDENTIALS_FILE, FILE_WRITE);
-  if (!binFile) {
-    USBSerial.println("ERRORE: Impossibile aprire credentials.bin in scrittura!");
+  CredentialsManager::VaultWriter writer;
+  if (!writer.create(CREDENTIALS_FILE) || !writer.add(cred_da_scrivere) || !writer.finish()) {
+    USBSerial.println("ERRORE: Impossibile scrivere credentials.bin!");
     return;
   }
-  binFile.write((uint8_t*)&cred_da_scrivere, sizeof(Credential));
-  binFile.close();
   USBSerial.println("Step 3: La credenziale e' stata scritta su credentials.bin.");
 
   // 4. Legge la credenziale appena scritta dal file
@@ -558,6 +815,9 @@ void create_pin_lock_screen() {
   lv_obj_set_style_text_letter_space(pin_display_label, 5, 0);
   lv_obj_set_style_text_color(pin_display_label, lv_color_white(), 0);  // Rendiamo bianchi anche i puntini
 
+  // --- Avanzamento dello sblocco (nascosto finche' non si inseriscono 6 cifre) ---
+  unlock_progress_arc = create_kdf_progress_arc(scr);
+
   // --- Tastierino numerico (il resto della funzione rimane invariato) ---
   static const char* btnm_map[] = { "1", "2", "3", "\n",
                                     "4", "5", "6", "\n",
@@ -578,19 +838,112 @@ void create_pin_lock_screen() {
 }
 
 
-// Funzione per preparare e ordinare i dati per la UI
-void prepare_credential_data() {
+// Funzione per preparare i dati per la UI, gia' in ordine alfabetico.
+// Restituisce false, lasciando invariati i dati precedenti, se il VaultWorker sta modificando l'indice.
+bool prepare_credential_data() {
+  // Titoli e ordine arrivano dall'indice di CredentialsManager (credentials.idx): nessun ordinamento qui
+  CredentialsManager::Lock lock(credManager, pdMS_TO_TICKS(UI_INDEX_LOCK_MS));  // L'indice non deve cambiare durante la copia
+  if (!lock.held()) return false;
   sorted_credentials.clear();
-  for (size_t i = 0; i < credManager.getCount(); ++i) {
-    Credential temp;
-    if (credManager.getCredential(i, &temp)) {
-      sorted_credentials.push_back({ String(temp.title), i });
+  sorted_generation = credManager.getGeneration();
+  size_t count = credManager.getCount();
+  sorted_credentials.reserve(count);
+
+  // Inizio di ogni lettera nell'ordine del vault (tabella di credentials.idx), convertito in posizione
+  // della lista: le voci eliminate che lo precedono non sono nella lista
+  size_t vault_start[TITLE_INDEX_LETTERS];
+  size_t list_start[TITLE_INDEX_LETTERS + 1];
+  for (uint8_t letter = 0; letter < TITLE_INDEX_LETTERS; ++letter) vault_start[letter] = credManager.getLetterStart(letter);
+  uint8_t next_letter = 0;
+  for (size_t pos = 0; pos < count; ++pos) {
+    while (next_letter < TITLE_INDEX_LETTERS && vault_start[next_letter] <= pos) list_start[next_letter++] = sorted_credentials.size();
+    size_t i = credManager.getSortedIndex(pos);
+    if (credManager.isDeleted(i)) continue;  // Resta nel vault fino alla compattazione
+    sorted_credentials.push_back({ i });
+  }
+  while (next_letter <= TITLE_INDEX_LETTERS) list_start[next_letter++] = sorted_credentials.size();
+
+  // Una lettera ha voci se la lista cresce tra il suo inizio e quello della successiva
+  for (uint8_t letter = 0; letter < COLLATION_OTHER_LETTER; ++letter) {
+    letter_jump[letter] = list_start[letter + 1] > list_start[letter] ? list_start[letter] : SIZE_MAX;
+  }
+  // Cifre e simboli vengono prima della A, gli altri alfabeti dopo la Z
+  if (list_start[0] > 0) {
+    letter_jump[COLLATION_OTHER_LETTER] = 0;
+  } else if (list_start[TITLE_INDEX_LETTERS] > list_start[COLLATION_OTHER_LETTER]) {
+    letter_jump[COLLATION_OTHER_LETTER] = list_start[COLLATION_OTHER_LETTER];
+  } else {
+    letter_jump[COLLATION_OTHER_LETTER] = SIZE_MAX;
+  }
+  fill_letter_jump_gaps();
+  return true;
+}
+
+// Le lettere A-Z senza voci prendono la posizione della lettera con voci piu' vicina
+// (a parita' di distanza quella successiva); senza alcuna voce si resta in cima alla lista
+void fill_letter_jump_gaps() {
+  size_t filled[COLLATION_OTHER_LETTER];
+  for (int letter = 0; letter < COLLATION_OTHER_LETTER; ++letter) {
+    filled[letter] = letter_jump[letter];
+    for (int d = 1; filled[letter] == SIZE_MAX && d < COLLATION_OTHER_LETTER; ++d) {
+      if (letter + d < COLLATION_OTHER_LETTER && letter_jump[letter + d] != SIZE_MAX) filled[letter] = letter_jump[letter + d];
+      else if (letter - d >= 0 && letter_jump[letter - d] != SIZE_MAX) filled[letter] = letter_jump[letter - d];
+    }
+  }
+  for (int letter = 0; letter < COLLATION_OTHER_LETTER; ++letter) {
+    letter_jump[letter] = filled[letter] == SIZE_MAX ? 0 : filled[letter];
+  }
+  if (letter_jump[COLLATION_OTHER_LETTER] == SIZE_MAX) letter_jump[COLLATION_OTHER_LETTER] = 0;
+}
+
+// Porta la lista sulla prima voce della lettera: una lettura della tabella, nessuna scansione
+static void jump_to_letter(uint8_t letter, lv_anim_enable_t anim) {
+  if (sorted_credentials.empty() || letter >= LETTER_JUMP_ENTRIES) return;
+  credential_list.setSelected(letter_jump[letter], anim);
+}
+
+// Testo di una riga della lista, chiesto da CredentialList solo quando la riga diventa visibile.
+// Gira durante il disegno: se il VaultWorker tiene l'indice (begin() dopo importazione o compattazione)
+// non aspetta e la riga resta provvisoria. Lo stesso se l'indice e' gia' di una generazione successiva
+// alla lista: gli indici dei record non corrispondono piu', fino a refresh_credential_list().
+static bool credential_row_text(uint32_t row, char* buffer, size_t len, void* user) {
+  if (row >= sorted_credentials.size()) return true;
+  CredentialsManager::Lock lock(credManager, 0);
+  if (!lock.held() || credManager.getGeneration() != sorted_generation) return false;
+  size_t i = sorted_credentials[row].original_index;
+  // Titolo copiato finche' il Lock e' preso. CRC non valido: la password potrebbe non decifrarsi
+  snprintf(buffer, len, credManager.isCorrupt(i) ? "%s " LV_SYMBOL_WARNING : "%s", credManager.getTitle(i));
+  return true;
+}
+
+// Ricarica le voci della lista dall'indice, senza ricreare la schermata.
+// Con 'keep_selection' la voce selezionata resta la stessa, se esiste ancora.
+void refresh_credential_list(bool keep_selection) {
+  // Il testo mostrato, non l'indice: dopo una compattazione gli indici dei record cambiano
+  String selected_text;
+  if (keep_selection) selected_text = credential_list.getSelectedText();
+
+  // Lock tenuto anche per la ricerca della selezione: righe e titoli della stessa generazione
+  CredentialsManager::Lock lock(credManager, pdMS_TO_TICKS(UI_INDEX_LOCK_MS));
+  if (!lock.held() || !prepare_credential_data()) {
+    // Indice occupato dal VaultWorker: la lista mostra ancora i dati precedenti, si riprova tra poco
+    lv_timer_create(refresh_retry_timer_cb, UI_INDEX_RETRY_MS, (void*)(uintptr_t)keep_selection)->repeat_count = 1;
+    return;
+  }
+  credential_list.setCount(sorted_credentials.size());
+
+  char text[CREDENTIAL_LIST_TEXT_LEN];
+  for (size_t row = 0; row < sorted_credentials.size() && !selected_text.isEmpty(); row++) {
+    if (credential_row_text(row, text, sizeof(text), NULL) && selected_text == text) {
+      credential_list.setSelected(row, LV_ANIM_OFF);
+      break;
     }
   }
-  // Ordina il vettore 'sorted_credentials' in base al titolo, ignorando maiuscole/minuscole.
-  std::sort(sorted_credentials.begin(), sorted_credentials.end(), [](const CredentialInfo& a, const CredentialInfo& b) {
-    return strcasecmp(a.title.c_str(), b.title.c_str()) < 0;
-  });
+}
+
+void refresh_retry_timer_cb(lv_timer_t* timer) {
+  bool keep_selection = (uintptr_t)timer->user_data != 0;
+  if (credential_list.isValid()) refresh_credential_list(keep_selection);  // La schermata potrebbe essere cambiata
 }
 
 // Funzione per aggiornare l'orologio
@@ -645,42 +998,35 @@ void create_main_screen() {
   update_status_bar();
   // ------------------------------------
 
-  // --- 2. Lista Credenziali a Rullo (leggermente modificato) ---
-  prepare_credential_data();
-  String roller_options = "";
-  for (const auto& info : sorted_credentials) {
-    roller_options += info.title;
-    roller_options += "\n";
-  }
-  if (!roller_options.isEmpty()) {
-    roller_options.remove(roller_options.length() - 1);
-  }
-  credential_roller = lv_roller_create(scr);
-  lv_roller_set_options(credential_roller, roller_options.c_str(), LV_ROLLER_MODE_NORMAL);
+  // --- 2. Lista Credenziali (lista virtuale: 5 righe intere da 44 px, la selezionata al centro) ---
+  lv_obj_t* list = credential_list.create(scr, 44, credential_row_text, NULL);
   // Riduciamo leggermente la larghezza per fare più spazio
-  lv_obj_set_width(credential_roller, lv_pct(88));
-  lv_obj_set_height(credential_roller, 220);
+  lv_obj_set_width(list, lv_pct(88));
+  lv_obj_set_height(list, 220);
   // Spostiamo un po' più a sinistra per bilanciare
-  lv_obj_align(credential_roller, LV_ALIGN_CENTER, -25, 15);
-  // Stili (invariati)
-  lv_roller_set_visible_row_count(credential_roller, 4);
-  lv_obj_set_style_bg_color(credential_roller, lv_color_black(), 0);
-  lv_obj_set_style_border_width(credential_roller, 0, 0);
-  lv_obj_set_style_text_font(credential_roller, &lv_font_montserrat_22, 0);
-  lv_obj_set_style_text_color(credential_roller, lv_color_white(), 0);
-  lv_obj_set_style_text_opa(credential_roller, LV_OPA_70, 0);
-  lv_obj_set_style_text_align(credential_roller, LV_TEXT_ALIGN_LEFT, 0);
-  lv_obj_set_style_pad_left(credential_roller, 10, 0);
-  lv_obj_set_style_text_font(credential_roller, &lv_font_montserrat_28, LV_PART_SELECTED);
-  lv_obj_set_style_text_opa(credential_roller, LV_OPA_COVER, LV_PART_SELECTED);
-  lv_obj_set_style_bg_color(credential_roller, lv_color_hex(0x282828), LV_PART_SELECTED);
+  lv_obj_align(list, LV_ALIGN_CENTER, -25, 15);
+  // Stili (gli stessi del rullo precedente)
+  lv_obj_set_style_bg_color(list, lv_color_black(), 0);
+  lv_obj_set_style_border_width(list, 0, 0);
+  lv_obj_set_style_radius(list, 0, 0);
+  lv_obj_set_style_pad_ver(list, 0, 0);
+  lv_obj_set_style_pad_right(list, 0, 0);
+  lv_obj_set_style_text_font(list, &lv_font_montserrat_22, 0);
+  lv_obj_set_style_text_color(list, lv_color_white(), 0);
+  lv_obj_set_style_text_opa(list, LV_OPA_70, 0);
+  lv_obj_set_style_text_align(list, LV_TEXT_ALIGN_LEFT, 0);
+  lv_obj_set_style_pad_left(list, 10, 0);
+  lv_obj_set_style_text_font(list, &lv_font_montserrat_28, LV_PART_SELECTED);
+  lv_obj_set_style_text_opa(list, LV_OPA_COVER, LV_PART_SELECTED);
+  lv_obj_set_style_bg_color(list, lv_color_hex(0x282828), LV_PART_SELECTED);
+  refresh_credential_list(false);  // Dopo gli stili: altezza e font decidono quante righe servono
 
 
   // --- 3. SCROLLER ALFABETICO IBRIDO (NUOVA LOGICA) ---
   lv_obj_t* jump_bar = lv_obj_create(scr);
   lv_obj_remove_style_all(jump_bar);
   lv_obj_set_size(jump_bar, 45, 220);
-  lv_obj_align_to(jump_bar, credential_roller, LV_ALIGN_OUT_RIGHT_MID, 5, 0);
+  lv_obj_align_to(jump_bar, list, LV_ALIGN_OUT_RIGHT_MID, 5, 0);
 
   // Aggiungiamo l'area di tocco invisibile che cattura l'evento di trascinamento
   lv_obj_add_event_cb(jump_bar, continuous_alphabet_scroller_cb, LV_EVENT_PRESSING, NULL);
@@ -732,8 +1078,8 @@ void create_main_screen() {
   lv_obj_set_size(btn_view, 60, 50);
   lv_obj_add_event_cb(
     btn_view, [](lv_event_t* e) {
-      if (credential_roller == NULL) return;
-      uint16_t selected_idx = lv_roller_get_selected(credential_roller);
+      if (!credential_list.isValid() || sorted_credentials.empty()) return;
+      uint32_t selected_idx = credential_list.getSelected();
       size_t original_idx = sorted_credentials[selected_idx].original_index;
       show_credential_details_popup(original_idx);
     },
@@ -765,18 +1111,17 @@ void create_main_screen() {
       }
 
 
-      if (credential_roller == NULL) return;
-      uint16_t selected_idx = lv_roller_get_selected(credential_roller);
+      if (!credential_list.isValid() || sorted_credentials.empty()) return;
+      uint32_t selected_idx = credential_list.getSelected();
       size_t original_idx = sorted_credentials[selected_idx].original_index;
-      Credential cred;
-      if (credManager.getCredential(original_idx, &cred)) {
-        USBSerial.printf("Pulsante 'Invia' premuto. Digitazione password per: %s\n", cred.title);
-        String password = crypto.decrypt(cred.encrypted_password);
-        if (password.length() > 0) {
-          type_password_with_layout(password.c_str());
-        }
+      // Lettura e decifratura sul VaultWorker; la digitazione parte quando la password e' pronta
+      vaultWorker.requestCredential(original_idx, sorted_generation, [](const VaultJob& job, void* user) {
+        // Il dispositivo potrebbe essere stato bloccato mentre la richiesta era in corso
+        if (!job.success || securityManager.getState() != SecurityState::UNLOCKED) return;
+        USBSerial.printf("Pulsante 'Invia' premuto. Digitazione password per: %s\n", job.cred.title);
+        type_password_with_layout(job.password);
         USBSerial.println("INFO: Digitazione completata.");
-      }
+      });
     },
     LV_EVENT_CLICKED, NULL);
 
@@ -970,19 +1315,21 @@ void create_settings_screen() {
     lv_obj_t* import_btn = lv_list_add_btn(settings_list, LV_SYMBOL_DOWNLOAD, "Importa da CSV");
     lv_obj_add_event_cb(import_btn, [](lv_event_t* e){
         // Mostra un popup di conferma
-        static const char* btns[] = {"Annulla", "Importa", ""};
+        static const char* btns[] = {"Annulla", "Importa", "Aggiorna", ""};
         lv_obj_t* mbox = lv_msgbox_create(NULL, "Importa Credenziali", 
-                                          "Cercare il file 'import.csv' sulla SD Card e aggiungere le nuove credenziali?\n\n(Le credenziali esistenti non verranno modificate)", 
+                                          "Cercare il file 'import.csv' sulla SD Card e aggiungere le nuove credenziali?\n\n"
+                                          "Importa: le credenziali esistenti non verranno modificate.\n"
+                                          "Aggiorna: sostituisce anche le password cambiate.", 
                                           btns, true);
         lv_obj_center(mbox);
 
         lv_obj_add_event_cb(mbox, [](lv_event_t * event) {
             lv_obj_t* current_mbox = lv_event_get_current_target(event);
             uint16_t btn_id = lv_msgbox_get_active_btn(current_mbox);
-            if (btn_id == 1) { // Se l'utente preme "Importa"
-                checkForAndRunImport(); // Avvia l'importazione
-                // Dopo l'importazione, torniamo alla schermata principale che si aggiornerà
+            if (btn_id == 1 || btn_id == 2) { // "Importa" oppure "Aggiorna"
+                // L'importazione procede sopra la schermata principale, che al termine viene solo aggiornata
                 create_main_screen();
+                checkForAndRunImport(btn_id == 2 ? ImportMode::UPDATE : ImportMode::APPEND);
             }
             lv_msgbox_close(current_mbox);
         }, LV_EVENT_VALUE_CHANGED, NULL);
@@ -1095,43 +1442,85 @@ void open_usb_mode_screen_cb(lv_event_t* e) {
 }
 
 
-void checkForAndRunImport() {
+// Avvia l'importazione in background. Restituisce false se non c'e' nessun file da importare.
+bool checkForAndRunImport(ImportMode mode) {
   const char* import_filepath = "/passwords.csv";
-  if (SD_MMC.exists(import_filepath)) {
-    USBSerial.printf("Trovato file da importare dopo sblocco: %s\n", import_filepath);
-
-    lv_obj_t* mbox = lv_msgbox_create(NULL, "Importazione", "Trovato file 'import.csv'.\nImportazione in corso...", NULL, false);
-    lv_obj_center(mbox);
-    lv_timer_handler();
-    delay(50);
+  if (!SD_MMC.exists(import_filepath)) return false;
+  if (import_poll_timer) return true;  // Importazione gia' in corso
 
-    bool import_success = credManager.importFromSD(import_filepath, crypto);
+  USBSerial.printf("Trovato file da importare dopo sblocco: %s\n", import_filepath);
 
-    if (import_success) {
-      // --- ECCO IL PASSAGGIO CHIAVE ---
-      // Ora che l'importazione è finita, diciamo esplicitamente
-      // al manager di ricaricare il suo stato dal file.
-      USBSerial.println("INFO: L'importazione sembra riuscita. Ricarico lo stato del CredentialsManager...");
-      credManager.begin();
-      // -----------------------------
-
-      USBSerial.println("SUCCESS: Importazione e ricarica completate!");
-
-      String imported_path = String(import_filepath) + ".imported";
-      if (SD_MMC.exists(imported_path)) {
-        SD_MMC.remove(imported_path);
-      }
-      SD_MMC.rename(import_filepath, imported_path);
-      lv_label_set_text(lv_msgbox_get_text(mbox), "Importazione completata con successo!");
+  static const char* btns[] = { "Annulla", "" };
+  lv_obj_t* mbox = lv_msgbox_create(NULL, "Importazione", "Importazione in corso...", btns, false);
+  lv_obj_center(mbox);
+  import_progress_bar = lv_bar_create(lv_msgbox_get_content(mbox));
+  lv_obj_set_width(import_progress_bar, lv_pct(100));
+  lv_bar_set_range(import_progress_bar, 0, 100);
+
+  // Annulla: il worker si ferma al record successivo e riporta il vault alla lunghezza precedente
+  lv_obj_add_event_cb(mbox, [](lv_event_t* event) {
+    lv_obj_t* current_mbox = lv_event_get_current_target(event);
+    import_progress.cancel = true;
+    lv_label_set_text(lv_msgbox_get_text(current_mbox), "Annullamento in corso...");
+    lv_obj_add_flag(lv_msgbox_get_btns(current_mbox), LV_OBJ_FLAG_HIDDEN);
+  }, LV_EVENT_VALUE_CHANGED, NULL);
+
+  memset((void*)&import_progress, 0, sizeof(import_progress));
+  // L'importazione (che ricarica anche l'indice e rinomina il file) gira sul VaultWorker
+  if (!vaultWorker.requestImport(import_filepath, import_done_cb, mbox, &import_progress, mode)) {
+    lv_label_set_text(lv_msgbox_get_text(mbox), "Errore durante l'importazione.\nControlla la console seriale.");
+    lv_obj_add_flag(lv_msgbox_get_btns(mbox), LV_OBJ_FLAG_HIDDEN);
+    lv_timer_create(import_close_timer_cb, 2500, mbox)->repeat_count = 1;
+    return true;
+  }
+  import_poll_timer = lv_timer_create(import_poll_timer_cb, 100, mbox);
+  return true;
+}
 
-    } else {
-      USBSerial.println("FAIL: Errore durante l'importazione.");
-      lv_label_set_text(lv_msgbox_get_text(mbox), "Errore durante l'importazione.\nControlla la console seriale.");
-    }
+// Aggiorna barra e contatori del popup con l'avanzamento pubblicato dal worker
+void import_poll_timer_cb(lv_timer_t* timer) {
+  lv_obj_t* mbox = (lv_obj_t*)timer->user_data;
+  if (import_progress.cancel) return;
+  uint32_t total = import_progress.bytes_total;
+  lv_bar_set_value(import_progress_bar, total ? (int32_t)((uint64_t)import_progress.bytes_read * 100 / total) : 0, LV_ANIM_OFF);
+  lv_label_set_text_fmt(lv_msgbox_get_text(mbox), "Righe lette: %u\nImportate: %u\nAggiornate: %u\nDuplicati saltati: %u",
+                        (unsigned)import_progress.parsed, (unsigned)import_progress.imported,
+                        (unsigned)import_progress.updated, (unsigned)import_progress.skipped);
+}
 
-    delay(2500);
-    lv_msgbox_close(mbox);
+void import_done_cb(const VaultJob& job, void* user) {
+  lv_obj_t* mbox = (lv_obj_t*)user;
+  if (import_poll_timer) {
+    lv_timer_del(import_poll_timer);
+    import_poll_timer = NULL;
+  }
+  lv_obj_add_flag(lv_msgbox_get_btns(mbox), LV_OBJ_FLAG_HIDDEN);
+  if (job.success) {
+    USBSerial.println("SUCCESS: Importazione e ricarica completate!");
+    lv_bar_set_value(import_progress_bar, 100, LV_ANIM_OFF);
+    lv_label_set_text_fmt(lv_msgbox_get_text(mbox), "Importazione completata!\nAggiunte: %u\nAggiornate: %u\nInvariate: %u\nDuplicati saltati: %u",
+                          (unsigned)import_progress.imported, (unsigned)import_progress.updated,
+                          (unsigned)import_progress.unchanged, (unsigned)import_progress.skipped);
+  } else if (import_progress.cancelled) {
+    USBSerial.println("INFO: Importazione annullata dall'utente.");
+    lv_label_set_text(lv_msgbox_get_text(mbox), "Importazione annullata.\nNessuna credenziale aggiunta.");
+  } else {
+    USBSerial.println("FAIL: Errore durante l'importazione.");
+    lv_label_set_text(lv_msgbox_get_text(mbox), "Errore durante l'importazione.\nControlla la console seriale.");
   }
+  // L'importazione ha cambiato la generazione del vault: la lista va ricaricata subito, non alla chiusura
+  // del popup, altrimenti Visualizza e Invia chiederebbero record con la generazione vecchia e fallirebbero
+  if (credential_list.isValid() && securityManager.getState() == SecurityState::UNLOCKED) refresh_credential_list();
+  lv_timer_create(import_close_timer_cb, 2500, mbox)->repeat_count = 1;
+}
+
+// Chiude il popup dell'importazione. La lista e' gia' stata aggiornata da import_done_cb().
+void import_close_timer_cb(lv_timer_t* timer) {
+  lv_msgbox_close((lv_obj_t*)timer->user_data);
+  import_progress_bar = NULL;
+  if (securityManager.getState() != SecurityState::UNLOCKED || is_screensaver_active) return;
+  // Se nel frattempo si e' cambiata schermata, la lista non esiste piu': la principale viene ricreata
+  if (!credential_list.isValid()) create_main_screen();
 }
 
 // Callback per il tastierino numerico della schermata di cambio PIN
@@ -1140,6 +1529,8 @@ void change_pin_keypad_event_cb(lv_event_t* e) {
   uint32_t id = lv_btnmatrix_get_selected_btn(btnm);
   const char* txt = lv_btnmatrix_get_btn_text(btnm, id);
   if (txt == NULL) return;
+  // Tastierino ignorato mentre le chiavi vengono derivate
+  if (securityManager.isUnlockRunning()) return;
 
   if (strcmp(txt, LV_SYMBOL_BACKSPACE) == 0) {
     if (change_pin_input_buffer.length() > 0) {
@@ -1177,23 +1568,18 @@ void change_pin_keypad_event_cb(lv_event_t* e) {
       case ChangePinState::AWAITING_CONFIRM_PIN:
         {
           if (change_pin_input_buffer == new_pin_storage) {
-            bool success = securityManager.changePin(old_pin_input, new_pin_storage, credManager, crypto);
-            if (success) {
-              lv_obj_t* mbox = lv_msgbox_create(NULL, "Successo!", "PIN cambiato.\n\nIl dispositivo si blocchera' a breve.", NULL, false);
-              lv_obj_center(mbox);
-
-              // --- CORREZIONE DEL BUG DEL WATCHDOG ---
-              // Usiamo un timer non bloccante invece di delay()
-              lv_timer_create(post_pin_change_reboot_cb, 2000, mbox);
-
+            // Le due derivazioni (vecchio e nuovo PIN) girano sul task di sblocco: qui si avvia e si mostra l'avanzamento
+            if (securityManager.startChangePin(old_pin_input, new_pin_storage)) {
+              lv_label_set_text(change_pin_label_title, "Cambio PIN in corso...");
+              lv_arc_set_value(change_pin_progress_arc, 0);
+              lv_obj_clear_flag(change_pin_progress_arc, LV_OBJ_FLAG_HIDDEN);
+              lv_timer_create(change_pin_poll_timer_cb, 50, NULL);
             } else {
-              // Mostra un popup di errore
-              lv_obj_t* mbox = lv_msgbox_create(NULL, "Errore", "Cambio PIN fallito.\nControlla il vecchio PIN.", NULL, true);
-              lv_obj_center(mbox);
-              // Dopo l'errore, torna alla schermata impostazioni per ricominciare
-              delay(2000);  // Qui un delay è accettabile perché è un caso di errore terminale per questo flusso
-              create_settings_screen();
+              lv_label_set_text(change_pin_label_title, "Operazione in corso.\n\nRiprova con il VECCHIO PIN");
+              current_change_pin_state = ChangePinState::AWAITING_OLD_PIN;
             }
+            old_pin_input = "";
+            new_pin_storage = "";
           } else {
             lv_label_set_text(change_pin_label_title, "I PIN non corrispondono!\n\nRiprova con il NUOVO PIN");
             current_change_pin_state = ChangePinState::AWAITING_NEW_PIN;
@@ -1237,6 +1623,8 @@ void create_change_pin_flow_screen() {
   lv_obj_align(change_pin_label_dots, LV_ALIGN_TOP_MID, 0, 85);
   lv_obj_set_style_text_color(change_pin_label_dots, lv_color_white(), 0);  // Rendiamo bianchi anche i pallini
 
+  change_pin_progress_arc = create_kdf_progress_arc(scr);
+
   // --- Tastierino numerico e pulsante Annulla (il resto della funzione rimane invariato) ---
   static const char* btnm_map[] = { "1", "2", "3", "\n",
                                     "4", "5", "6", "\n",
@@ -1253,6 +1641,7 @@ void create_change_pin_flow_screen() {
   lv_obj_align(cancel_btn, LV_ALIGN_TOP_LEFT, 10, 10);
   lv_obj_add_event_cb(
     cancel_btn, [](lv_event_t* e) {
+      if (securityManager.isUnlockRunning()) return;  // L'esito del cambio PIN va mostrato su questa schermata
       create_settings_screen();
     },
     LV_EVENT_CLICKED, NULL);
@@ -1260,6 +1649,54 @@ void create_change_pin_flow_screen() {
   lv_label_set_text(cancel_label, LV_SYMBOL_LEFT);
 }
 
+// Arco di avanzamento della derivazione del PIN, nascosto finche' non parte
+lv_obj_t* create_kdf_progress_arc(lv_obj_t* parent) {
+  lv_obj_t* arc = lv_arc_create(parent);
+  lv_obj_set_size(arc, 60, 60);
+  lv_arc_set_rotation(arc, 270);
+  lv_arc_set_bg_angles(arc, 0, 360);
+  lv_arc_set_range(arc, 0, 100);
+  lv_arc_set_value(arc, 0);
+  lv_obj_remove_style(arc, NULL, LV_PART_KNOB);
+  lv_obj_clear_flag(arc, LV_OBJ_FLAG_CLICKABLE);
+  lv_obj_align(arc, LV_ALIGN_TOP_RIGHT, -15, 40);
+  lv_obj_add_flag(arc, LV_OBJ_FLAG_HIDDEN);
+  return arc;
+}
+
+// Aggiorna l'arco e gestisce l'esito del cambio PIN asincrono
+void change_pin_poll_timer_cb(lv_timer_t* timer) {
+  UnlockResult result = securityManager.pollChangePin();
+  // Un blocco durante la derivazione cambia schermata: gli oggetti del cambio PIN possono non esistere piu'
+  bool on_screen = lv_obj_is_valid(change_pin_progress_arc);
+  if (result == UnlockResult::RUNNING) {
+    if (on_screen) lv_arc_set_value(change_pin_progress_arc, securityManager.getUnlockProgress());
+    return;
+  }
+  lv_timer_del(timer);
+  if (on_screen) lv_obj_add_flag(change_pin_progress_arc, LV_OBJ_FLAG_HIDDEN);
+  change_pin_progress_arc = NULL;
+
+  if (result == UnlockResult::SUCCESS) {
+    lv_obj_t* mbox = lv_msgbox_create(NULL, "Successo!", "PIN cambiato.\n\nIl dispositivo si blocchera' a breve.", NULL, false);
+    lv_obj_center(mbox);
+    lv_timer_create(post_pin_change_reboot_cb, 2000, mbox);
+  } else if (result == UnlockResult::FAILED && on_screen) {
+    lv_obj_t* mbox = lv_msgbox_create(NULL, "Errore", "Cambio PIN fallito.\nControlla il vecchio PIN.", NULL, true);
+    lv_obj_center(mbox);
+    // Dopo l'errore si torna alle impostazioni per ricominciare, senza bloccare il loop
+    lv_timer_create(change_pin_failed_cb, 2000, mbox)->repeat_count = 1;
+  }
+  // CANCELLED: bloccato durante la derivazione, la schermata del PIN e' gia' attiva e il PIN e' invariato
+}
+
+void change_pin_failed_cb(lv_timer_t* timer) {
+  lv_obj_t* mbox = (lv_obj_t*)timer->user_data;
+  if (lv_obj_is_valid(mbox)) lv_msgbox_close(mbox);  // Puo' essere gia' stato chiuso dal suo pulsante
+  if (securityManager.getState() != SecurityState::UNLOCKED || is_screensaver_active) return;
+  create_settings_screen();
+}
+
 void post_pin_change_reboot_cb(lv_timer_t* timer) {
   // 1. Recupera l'oggetto mbox dai dati utente del timer
   lv_obj_t* mbox = (lv_obj_t*)timer->user_data;
@@ -1387,17 +1824,8 @@ static void alphabet_scroller_event_cb(lv_event_t* e) {
     if (letter_index == last_letter_index) return;
     last_letter_index = letter_index;
 
-    // Ottieni il carattere selezionato
-    char selected_char = 'A' + letter_index;
-
-    // Cerca la prima credenziale che inizia con quella lettera
-    for (size_t i = 0; i < sorted_credentials.size(); ++i) {
-      if (sorted_credentials[i].title.length() > 0 && toupper(sorted_credentials[i].title[0]) == selected_char) {
-        // Trovata! Imposta il roller su questa posizione
-        lv_roller_set_selected(credential_roller, i, LV_ANIM_OFF);  // LV_ANIM_OFF per un salto istantaneo
-        return;                                                     // Esci dopo aver trovato la prima occorrenza
-      }
-    }
+    // Prima credenziale che inizia con quella lettera (anche accentata: "Été" e' tra le E)
+    jump_to_letter(letter_index, LV_ANIM_OFF);  // LV_ANIM_OFF per un salto istantaneo
   }
 }
 
@@ -1406,16 +1834,11 @@ static void quick_jump_event_cb(lv_event_t* e) {
   // Ottieni la lettera dal testo del pulsante che è stato premuto
   const char* letter_char = lv_label_get_text(lv_obj_get_child(lv_event_get_target(e), 0));
   if (!letter_char) return;
-  char selected_char = letter_char[0];
+  char selected_char = toupper(letter_char[0]);
+  uint8_t selected_letter = (selected_char >= 'A' && selected_char <= 'Z') ? selected_char - 'A' : COLLATION_OTHER_LETTER;
 
-  // Cerca la prima credenziale che inizia con quella lettera
-  for (size_t i = 0; i < sorted_credentials.size(); ++i) {
-    if (sorted_credentials[i].title.length() > 0 && toupper(sorted_credentials[i].title[0]) == selected_char) {
-      // Trovata! Imposta il roller su questa posizione
-      lv_roller_set_selected(credential_roller, i, LV_ANIM_ON);  // Usiamo un'animazione per un effetto più gradevole
-      return;
-    }
-  }
+  // Prima credenziale che inizia con quella lettera
+  jump_to_letter(selected_letter, LV_ANIM_ON);  // Usiamo un'animazione per un effetto più gradevole
 }
 
 // Aggiungi o sostituisci questa funzione nel tuo .ino
@@ -1444,15 +1867,7 @@ static void continuous_alphabet_scroller_cb(lv_event_t* e) {
   if (letter_index == last_letter_index) return;
   last_letter_index = letter_index;
 
-  char selected_char = 'A' + letter_index;
-
-  // Cerca la prima credenziale che inizia con quella lettera
-  for (size_t i = 0; i < sorted_credentials.size(); ++i) {
-    if (sorted_credentials[i].title.length() > 0 && toupper(sorted_credentials[i].title[0]) == selected_char) {
-      lv_roller_set_selected(credential_roller, i, LV_ANIM_OFF);  // Salto istantaneo per reattività
-      return;
-    }
-  }
+  jump_to_letter(letter_index, LV_ANIM_OFF);  // Salto istantaneo per reattività
 }
 
 void show_serial_mode_warning_popup(lv_timer_t* timer) {
@@ -1474,25 +1889,34 @@ void show_serial_mode_warning_popup(lv_timer_t* timer) {
 // Aggiungi questa nuova funzione al tuo file .ino
 
 void show_credential_details_popup(size_t credential_index) {
+  // Lettura e decifratura avvengono sul VaultWorker: il popup viene creato al completamento.
+  // L'indice viene da 'sorted_credentials', quindi dalla generazione con cui e' stata costruita.
+  vaultWorker.requestCredential(credential_index, sorted_generation, credential_details_ready_cb);
+}
+
+static void free_credential_ref_cb(lv_event_t* e) {
+  delete (CredentialRef*)lv_event_get_user_data(e);
+}
+
+void credential_details_ready_cb(const VaultJob& job, void* user) {
+  if (securityManager.getState() != SecurityState::UNLOCKED) return;
+
   // 1. Recupera la credenziale completa
-  Credential cred;
-  if (!credManager.getCredential(credential_index, &cred)) {
+  if (job.cred.title[0] == '\0') {
     // Mostra un errore se non riusciamo a leggere la credenziale
     lv_obj_t* err_box = lv_msgbox_create(NULL, "Errore", "Impossibile recuperare i dati della credenziale.", NULL, true);
     lv_obj_center(err_box);
     return;
   }
+  const Credential& cred = job.cred;
 
-  // 2. Decifra la password
-  String password = crypto.decrypt(cred.encrypted_password);
-  if (password.length() == 0) {
-    password = "[Errore Decifratura]";
-  }
+  // 2. La password e' gia' stata decifrata dal VaultWorker
+  const char* password = job.success ? job.password : "[Errore Decifratura]";
 
   // --- NUOVA LOGICA DI CREAZIONE DEL POPUP ---
 
-  // 2. Crea un "message box" di base senza testo, solo con il titolo e il pulsante Chiudi.
-  static const char* btns[] = { "Chiudi", "" };
+  // 2. Crea un "message box" di base senza testo, solo con il titolo e i pulsanti Chiudi/Elimina.
+  static const char* btns[] = { "Chiudi", "Elimina", "" };
   lv_obj_t* mbox = lv_msgbox_create(NULL, cred.title, "", btns, true);
 
   // Impostiamo la larghezza del popup all'85% dello schermo
@@ -1500,12 +1924,19 @@ void show_credential_details_popup(size_t credential_index) {
   lv_obj_center(mbox);  // Ria-centriamo dopo aver impostato la larghezza
 
 
-  // Aggiungi subito l'evento per chiudere il popup
+  // Aggiungi subito l'evento per chiudere il popup. Il pulsante Elimina usa indice e generazione
+  // della lettura appena completata, non quella del vault al momento della conferma.
+  CredentialRef* ref = new CredentialRef{ job.index, job.generation };
   lv_obj_add_event_cb(
     mbox, [](lv_event_t* event) {
-      lv_msgbox_close(lv_event_get_current_target(event));
+      lv_obj_t* current_mbox = lv_event_get_current_target(event);
+      CredentialRef ref = *(CredentialRef*)lv_event_get_user_data(event);  // Liberato con il popup
+      bool remove = lv_msgbox_get_active_btn(current_mbox) == 1;
+      lv_msgbox_close(current_mbox);
+      if (remove) confirm_delete_credential(ref);
     },
-    LV_EVENT_VALUE_CHANGED, NULL);
+    LV_EVENT_VALUE_CHANGED, ref);
+  lv_obj_add_event_cb(mbox, free_credential_ref_cb, LV_EVENT_DELETE, ref);
 
   // Ottieni il contenitore del testo del message box
   lv_obj_t* content = lv_msgbox_get_content(mbox);
@@ -1535,10 +1966,53 @@ void show_credential_details_popup(size_t credential_index) {
 
   // Etichetta con la password effettiva
   lv_obj_t* pass_value_label = lv_label_create(content);
-  lv_label_set_text(pass_value_label, password.c_str());
+  lv_label_set_text(pass_value_label, password);
   lv_obj_set_style_text_font(pass_value_label, &montserrat_18_extended, 0);
 }
 
+// Chiede conferma prima di eliminare una credenziale
+void confirm_delete_credential(const CredentialRef& credential) {
+  static const char* btns[] = { "Annulla", "Elimina", "" };
+  lv_obj_t* mbox = lv_msgbox_create(NULL, "Elimina Credenziale", "Eliminare definitivamente questa credenziale?", btns, false);
+  lv_obj_center(mbox);
+  CredentialRef* ref = new CredentialRef(credential);
+  lv_obj_add_event_cb(
+    mbox, [](lv_event_t* event) {
+      lv_obj_t* current_mbox = lv_event_get_current_target(event);
+      if (lv_msgbox_get_active_btn(current_mbox) == 1) {
+        // Se nel frattempo una compattazione ha rinumerato i record, il VaultWorker rifiuta la richiesta
+        const CredentialRef* ref = (const CredentialRef*)lv_event_get_user_data(event);
+        vaultWorker.requestDelete(ref->index, ref->generation, credential_deleted_cb);
+      }
+      lv_msgbox_close(current_mbox);
+    },
+    LV_EVENT_VALUE_CHANGED, ref);
+  lv_obj_add_event_cb(mbox, free_credential_ref_cb, LV_EVENT_DELETE, ref);
+}
+
+// L'eliminazione non cambia gli indici: basta togliere la voce dalla lista.
+// Oltre la soglia dei record eliminati parte la compattazione in background.
+void credential_deleted_cb(const VaultJob& job, void* user) {
+  if (!job.success) {
+    lv_obj_t* err_box = lv_msgbox_create(NULL, "Errore", "Impossibile eliminare la credenziale.", NULL, true);
+    lv_obj_center(err_box);
+    return;
+  }
+  if (credential_list.isValid()) {
+    refresh_credential_list();
+  }
+  if (credManager.needsCompaction()) vaultWorker.requestCompact(vault_compacted_cb);
+}
+
+// La compattazione ha pubblicato una nuova generazione: gli indici in 'sorted_credentials' vanno ricalcolati
+void vault_compacted_cb(const VaultJob& job, void* user) {
+  if (!job.success) return;  // Il vault precedente resta valido, si riprovera' alla prossima eliminazione
+  if (securityManager.getState() != SecurityState::UNLOCKED || is_screensaver_active) return;
+  if (credential_list.isValid()) {
+    refresh_credential_list();
+  }
+}
+
 void create_wipe_settings_screen() {
   lv_obj_clean(lv_scr_act());
   lv_obj_t* scr = lv_scr_act();
@@ -1,30 +1,77 @@
 #include "security.h"
 #include <Arduino.h>
 #include "mbedtls/sha256.h"
-#include <SD_MMC.h>
 #include "mbedtls/pkcs5.h" // Aggiungi per PBKDF2
+#include "mbedtls/md.h"
+#include "pbkdf2.h"
 #include "esp_random.h"    // Aggiungi per generare il salt
+#include "mbedtls/platform_util.h"
 
 extern HWCDC USBSerial;
 
-// Impostazioni per PBKDF2
-#define PBKDF2_ITERATIONS 10000 // Numero di iterazioni. Più alto è, più è sicuro.
 
 SecurityManager::SecurityManager() : 
     m_currentState(SecurityState::LOCKED), 
     m_isPinSet(false),
-    m_isSaltSet(false)
+    m_isSaltSet(false),
+    m_hasKeySlot(false),
+    m_kdfIterations(SEC_KDF_LEGACY_ITERATIONS),
+    m_kdfIterationsPerSecond(0),
+    m_fastKdf(false),
+    m_lockGeneration(0),
+    m_unlockGeneration(0),
+    m_unlockResult(UnlockResult::NONE),
+    m_unlockProgress(0),
+    m_progressBase(0),
+    m_progressSpan(100)
 {
-    memset(m_storedPinHash, 0, 32);
-    memset(m_salt, 0, 16);
-    memset(m_userKey, 0, 32);
+    memset(&m_keySlot, 0, sizeof(m_keySlot));
+    memset(m_pinVerifier, 0, SEC_VERIFIER_SIZE);
+    memset(m_salt, 0, SEC_SALT_SIZE);
+    memset(m_userKey, 0, SEC_KEY_SIZE);
 }
 
 void SecurityManager::begin() {
     USBSerial.println("Inizializzazione SecurityManager (modalita' PIN)...");
+
+    // PBKDF2 ottimizzato solo se produce esattamente gli stessi byte di mbedtls
+    m_fastKdf = Pbkdf2Sha256::selfTest();
+    if (!m_fastKdf) USBSerial.println("ATTENZIONE: PBKDF2 ottimizzato non valido. Uso mbedtls.");
+
     m_preferences.begin("security", false);
-    
-    m_isPinSet = m_preferences.getBytes("pin_hash", m_storedPinHash, 32) == 32;
+
+    // Parametri KDF desiderati. Alla prima accensione (o dopo un'autodistruzione) vengono calibrati.
+    bool calibrated = m_preferences.getUChar("kdf_id", SEC_KDF_LEGACY) == SEC_KDF_PBKDF2_SHA256 && m_preferences.isKey("kdf_iter");
+    if (calibrated) {
+        m_kdfIterations = m_preferences.getUInt("kdf_iter", SEC_KDF_LEGACY_ITERATIONS);
+        USBSerial.printf("OK: Parametri KDF caricati (%u iterazioni).\n", m_kdfIterations);
+    }
+
+    // Formato attuale: un unico slot con salt, parametri KDF, verificatore del PIN e chiave dati cifrata
+    memset(&m_keySlot, 0, sizeof(m_keySlot));
+    size_t slotLen = m_preferences.getBytesLength("keyslot");
+    if ((slotLen == sizeof(KeySlot) || slotLen == SEC_KEYSLOT_SIZE_NO_KDF_PARAMS) &&
+        m_preferences.getBytes("keyslot", &m_keySlot, slotLen) == slotLen &&
+        (m_keySlot.version == SEC_KEYSLOT_VERSION || m_keySlot.version == SEC_KEYSLOT_VERSION_SHA256)) {
+        memcpy(m_salt, m_keySlot.salt, SEC_SALT_SIZE);
+        memcpy(m_pinVerifier, m_keySlot.pin_verifier, SEC_VERIFIER_SIZE);
+        m_hasKeySlot = true;
+        m_isPinSet = true;
+        m_isSaltSet = true;
+        USBSerial.printf("OK: Trovato lo slot delle chiavi (versione %d, %u iterazioni).\n", m_keySlot.version, _slotIterations());
+    } else {
+        _loadLegacyPin();
+    }
+    m_preferences.end();
+
+    if (!calibrated) calibrateKdf();
+}
+
+void SecurityManager::_loadLegacyPin() {
+
+    // Installazioni precedenti: hash e salt separati, vault cifrato direttamente con la chiave del PIN.
+    // Lo slot viene creato al primo sblocco riuscito.
+    m_isPinSet = m_preferences.getBytes("pin_hash", m_pinVerifier, 32) == 32;
 
     // Carica il salt. Se non esiste, ne crea uno nuovo.
     if (m_preferences.getBytes("pin_salt", m_salt, 16) == 16) {
@@ -38,147 +85,373 @@ void SecurityManager::begin() {
     }
 
     if (m_isPinSet) {
-        USBSerial.println("OK: Trovato un PIN di sblocco e un salt salvati.");
+        USBSerial.println("OK: Trovato un PIN di sblocco e un salt salvati (formato precedente).");
     } else {
         USBSerial.println("ATTENZIONE: Nessun PIN trovato. Il primo inserimento verra' salvato.");
     }
-    m_preferences.end();
 }
 
 bool SecurityManager::checkPin(const String& attempt) {
+    PinCheck check;
+    if (!_verifyPin(attempt, &check)) return false;
+    return _applyPinCheck(&check);
+}
+
+bool SecurityManager::_verifyPin(const String& attempt, PinCheck* check) {
+    memset(check, 0, sizeof(*check));
     if (attempt.length() != 6) return false;
 
     USBSerial.print("Controllo PIN: "); USBSerial.println(attempt);
 
-    unsigned char attemptHash[32];
-    _hashPin(attempt, attemptHash);
-
+    unsigned char master[SEC_KEY_SIZE];
     if (m_isPinSet) {
-        if (memcmp(attemptHash, m_storedPinHash, 32) == 0) {
-            USBSerial.println("OK: PIN corretto. Derivazione chiave in corso...");
-            _deriveKey(attempt, m_salt, m_userKey); // Deriva la chiave
-            m_currentState = SecurityState::UNLOCKED;
-            USBSerial.println("OK: Chiave derivata. Dispositivo sbloccato.");
-            return true;
+        bool legacy = false;
+        if (!_recoverDataKey(attempt, check->key, master, &legacy)) return false;
+
+        if (_slotIterations() != m_kdfIterations) {
+            // Parametri KDF cambiati (calibrazione): nuovo salt e nuova derivazione,
+            // che migra anche gli slot dei formati precedenti
+            USBSerial.printf("INFO: Aggiornamento KDF da %u a %u iterazioni...\n", _slotIterations(), m_kdfIterations);
+            esp_fill_random(check->salt, SEC_SALT_SIZE);
+            check->iterations = m_kdfIterations;
+            _deriveMaster(attempt, check->salt, check->iterations, master);
+            _splitMaster(master, check->verifier, check->kek);
+            check->storeSlot = true;
+            check->removeLegacy = true;
+        } else if (legacy) {
+            // Migrazione: la chiave master coincide con la vecchia chiave PBKDF2, quindi
+            // il nuovo slot si ottiene senza ulteriori derivazioni. La chiave dati non cambia.
+            USBSerial.println("INFO: Migrazione dello slot al verificatore derivato...");
+            memcpy(check->salt, m_salt, SEC_SALT_SIZE);
+            check->iterations = m_kdfIterations;
+            _splitMaster(master, check->verifier, check->kek);
+            check->storeSlot = true;
+            check->removeLegacy = true;
         }
-        return false;
-    } else {
-        USBSerial.println("Nessun PIN master trovato. Questo verra' salvato.");
-        
-        // Se non c'è un salt, crealo ora
-        if (!m_isSaltSet) {
-            esp_fill_random(m_salt, 16);
-            m_isSaltSet = true;
+        mbedtls_platform_zeroize(master, sizeof(master));
+        return true;
+    }
+
+    USBSerial.println("Nessun PIN master trovato. Questo verra' salvato.");
+    // Nuovo vault: salt e chiave dati casuali
+    check->newPin = true;
+    check->storeSlot = true;
+    esp_fill_random(check->salt, SEC_SALT_SIZE);
+    esp_fill_random(check->key, SEC_KEY_SIZE);
+    check->iterations = m_kdfIterations;
+
+    USBSerial.println("Derivazione chiave in corso...");
+    _deriveMaster(attempt, check->salt, check->iterations, master);
+    _splitMaster(master, check->verifier, check->kek);
+    mbedtls_platform_zeroize(master, sizeof(master));
+    return true;
+}
+
+bool SecurityManager::_applyPinCheck(PinCheck* check) {
+    memcpy(m_userKey, check->key, SEC_KEY_SIZE);
+    bool check_new_pin = check->newPin;
+    bool ok = true;
+    if (check->storeSlot) {
+        if (_storeKeySlot(check->salt, check->iterations, check->verifier, check->kek)) {
+            if (check->newPin) m_isSaltSet = true;
+            if (check->removeLegacy) {
+                m_preferences.begin("security", false);
+                m_preferences.remove("pin_hash");
+                m_preferences.remove("pin_salt");
+                m_preferences.end();
+            }
+        } else if (check->newPin) {
+            USBSerial.println("ERRORE: Impossibile salvare il nuovo PIN.");
+            mbedtls_platform_zeroize(m_userKey, sizeof(m_userKey));
+            ok = false;
+        } else {
+            // Lo slot precedente resta valido: si riprovera' al prossimo sblocco
+            USBSerial.println("ATTENZIONE: Impossibile aggiornare lo slot delle chiavi.");
         }
+    }
+    mbedtls_platform_zeroize(check, sizeof(*check));
+    if (!ok) return false;
 
-        m_preferences.begin("security", false);
-        m_preferences.putBytes("pin_hash", attemptHash, 32);
-        m_preferences.putBytes("pin_salt", m_salt, 16); // Salva anche il salt
-        m_preferences.end();
-        
-        memcpy(m_storedPinHash, attemptHash, 32);
-        m_isPinSet = true;
-        
-        USBSerial.println("OK: Nuovo PIN salvato. Derivazione chiave in corso...");
-        _deriveKey(attempt, m_salt, m_userKey); // Deriva la chiave per la prima volta
-        m_currentState = SecurityState::UNLOCKED;
-        USBSerial.println("OK: Chiave derivata. Dispositivo sbloccato.");
-        return true;
+    m_currentState = SecurityState::UNLOCKED;
+    USBSerial.println(check_new_pin ? "OK: Nuovo PIN e chiave dati salvati. Dispositivo sbloccato."
+                                    : "OK: PIN corretto. Dispositivo sbloccato.");
+    return true;
+}
+
+bool SecurityManager::startUnlock(const String& attempt) {
+    return _startPending(attempt, String());
+}
+
+bool SecurityManager::startChangePin(const String& oldPin, const String& newPin) {
+    if (newPin.length() != 6) return false;
+    return _startPending(oldPin, newPin);
+}
+
+bool SecurityManager::_startPending(const String& oldPin, const String& newPin) {
+    if (m_unlockResult != UnlockResult::NONE) return false;  // In corso, o esito non ancora consegnato
+    m_unlockAttempt = oldPin;
+    m_newPin = newPin;
+    m_unlockProgress = 0;
+    m_progressBase = 0;
+    m_progressSpan = newPin.length() > 0 ? 50 : 100;
+    m_unlockGeneration = m_lockGeneration;
+    m_unlockResult = UnlockResult::RUNNING;
+    if (xTaskCreatePinnedToCore(_unlockTask, "pin_unlock", SEC_UNLOCK_TASK_STACK, this, 1, NULL, SEC_UNLOCK_TASK_CORE) != pdPASS) {
+        USBSerial.println("ERRORE SecMan: Impossibile avviare il task di sblocco.");
+        m_unlockAttempt = "";
+        m_newPin = "";
+        m_unlockResult = UnlockResult::NONE;
+        return false;
     }
+    return true;
+}
+
+UnlockResult SecurityManager::pollUnlock() {
+    return _pollPending();
+}
+
+UnlockResult SecurityManager::pollChangePin() {
+    return _pollPending();
+}
+
+UnlockResult SecurityManager::_pollPending() {
+    UnlockResult result = m_unlockResult;
+    if (result == UnlockResult::NONE || result == UnlockResult::RUNNING) return result;
+
+    // Lo stato cambia solo qui, sul thread dell'interfaccia: un lock() arrivato dopo l'avvio
+    // (anche a derivazione gia' finita) annulla l'operazione
+    bool changing = m_newPin.length() > 0;
+    m_newPin = "";
+    if (result == UnlockResult::SUCCESS) {
+        if (m_lockGeneration != m_unlockGeneration) {
+            USBSerial.println(changing ? "INFO SecMan: Dispositivo bloccato durante il cambio PIN. PIN invariato."
+                                       : "INFO SecMan: Dispositivo bloccato durante lo sblocco. Esito scartato.");
+            mbedtls_platform_zeroize(&m_unlockCheck, sizeof(m_unlockCheck));
+            result = UnlockResult::CANCELLED;
+        } else if (!(changing ? _applyPinChange(&m_unlockCheck) : _applyPinCheck(&m_unlockCheck))) {
+            result = UnlockResult::FAILED;
+        }
+    }
+    m_unlockResult = UnlockResult::NONE;
+    return result;
+}
+
+void SecurityManager::_unlockTask(void* param) {
+    SecurityManager* self = static_cast<SecurityManager*>(param);
+    bool ok = self->m_newPin.length() > 0
+                  ? self->_verifyPinChange(self->m_unlockAttempt, self->m_newPin, &self->m_unlockCheck)
+                  : self->_verifyPin(self->m_unlockAttempt, &self->m_unlockCheck);
+    self->m_unlockAttempt = "";
+    self->m_unlockProgress = 100;
+    if (!ok) mbedtls_platform_zeroize(&self->m_unlockCheck, sizeof(self->m_unlockCheck));
+    // Ultima scrittura: pollUnlock() legge m_unlockCheck solo dopo aver visto l'esito
+    self->m_unlockResult = ok ? UnlockResult::SUCCESS : UnlockResult::FAILED;
+    vTaskDelete(NULL);
 }
 
-bool SecurityManager::changePin(const String& oldPin, const String& newPin, CredentialsManager& credManager, Crypto& crypto) {
+void SecurityManager::_kdfProgress(uint32_t done, uint32_t total, void* user) {
+    SecurityManager* self = static_cast<SecurityManager*>(user);
+    self->m_unlockProgress = (uint8_t)(self->m_progressBase + (uint64_t)done * self->m_progressSpan / total);
+}
+
+bool SecurityManager::changePin(const String& oldPin, const String& newPin) {
+    // Il task di sblocco legge slot e salt senza lock: non devono cambiare mentre gira
+    if (m_unlockResult != UnlockResult::NONE) return false;
+    PinCheck check;
+    if (!_verifyPinChange(oldPin, newPin, &check)) return false;
+    return _applyPinChange(&check);
+}
+
+bool SecurityManager::_verifyPinChange(const String& oldPin, const String& newPin, PinCheck* check) {
+    memset(check, 0, sizeof(*check));
     USBSerial.println("Inizio procedura di cambio PIN...");
 
-    unsigned char oldPinHash[32];
-    _hashPin(oldPin, oldPinHash);
-    if (!m_isPinSet || memcmp(oldPinHash, m_storedPinHash, 32) != 0) {
+    // Recupera la chiave dati con il vecchio PIN
+    unsigned char master[SEC_KEY_SIZE];
+    bool legacy = false;
+    if (!_recoverDataKey(oldPin, check->key, master, &legacy)) {
         USBSerial.println("ERRORE: Il vecchio PIN non è corretto.");
         return false;
     }
+    m_progressBase = 50;  // Seconda derivazione: seconda meta' dell'arco
+
+    // Si ri-cifrano solo i 32 byte della chiave dati, con nuovo salt e parametri KDF correnti
+    esp_fill_random(check->salt, SEC_SALT_SIZE);
+    check->iterations = m_kdfIterations;
+    _deriveMaster(newPin, check->salt, check->iterations, master);
+    _splitMaster(master, check->verifier, check->kek);
+    mbedtls_platform_zeroize(master, sizeof(master));
+    check->storeSlot = true;
+    check->removeLegacy = true;
+    return true;
+}
+
+bool SecurityManager::_applyPinChange(PinCheck* check) {
+    memcpy(m_userKey, check->key, SEC_KEY_SIZE);
+    bool stored = _storeKeySlot(check->salt, check->iterations, check->verifier, check->kek);
+    mbedtls_platform_zeroize(check, sizeof(*check));
+    if (!stored) {
+        USBSerial.println("ERRORE: Impossibile salvare il nuovo slot delle chiavi. PIN invariato.");
+        return false;
+    }
+
+    m_preferences.begin("security", false);
+    m_preferences.remove("pin_hash");
+    m_preferences.remove("pin_salt");
+    m_preferences.end();
+    USBSerial.println("SUCCESS: PIN cambiato. La chiave dati e le credenziali restano invariate.");
+    return true;
+}
+
+uint32_t SecurityManager::_slotIterations() const {
+    if (m_hasKeySlot && m_keySlot.kdf_id == SEC_KDF_PBKDF2_SHA256 && m_keySlot.kdf_iterations > 0) {
+        return m_keySlot.kdf_iterations;
+    }
+    return SEC_KDF_LEGACY_ITERATIONS;
+}
+
+uint32_t SecurityManager::measureKdf(uint32_t target_ms, uint32_t* perSecond) {
+    // Derivazione di prova su dati fittizi: il costo di PBKDF2 e' lineare nelle iterazioni
+    static const unsigned char probeSalt[SEC_SALT_SIZE] = {0};
+    unsigned char probeOut[SEC_KEY_SIZE];
+    unsigned long start = micros();
+    _deriveMaster(String("000000"), probeSalt, SEC_KDF_PROBE_ITERATIONS, probeOut);
+    unsigned long elapsed = micros() - start;
+    if (elapsed == 0) elapsed = 1;
 
-    // Deriva la vecchia e la nuova chiave
-    unsigned char oldKey[32];
-    unsigned char newKey[32];
-    _deriveKey(oldPin, m_salt, oldKey);
-    _deriveKey(newPin, m_salt, newKey);
-    USBSerial.println("OK: Vecchia e nuova chiave derivate.");
+    uint64_t iterationsPerSecond = (uint64_t)SEC_KDF_PROBE_ITERATIONS * 1000000ULL / elapsed;
+    uint64_t iterations = iterationsPerSecond * target_ms / 1000;
+    iterations -= iterations % 1000; // Valori arrotondati, piu' leggibili nei log
+    if (iterations < SEC_KDF_MIN_ITERATIONS) iterations = SEC_KDF_MIN_ITERATIONS;
+    if (iterations > SEC_KDF_MAX_ITERATIONS) iterations = SEC_KDF_MAX_ITERATIONS;
+    if (perSecond) *perSecond = (uint32_t)iterationsPerSecond;
+    return (uint32_t)iterations;
+}
+
+uint32_t SecurityManager::calibrateKdf(uint32_t target_ms) {
+    m_kdfIterations = measureKdf(target_ms, &m_kdfIterationsPerSecond);
+
+    m_preferences.begin("security", false);
+    m_preferences.putUChar("kdf_id", SEC_KDF_PBKDF2_SHA256);
+    m_preferences.putUInt("kdf_iter", m_kdfIterations);
+    m_preferences.end();
+
+    USBSerial.printf("INFO SecMan: Calibrazione KDF: %u iterazioni/s, %u iterazioni per ~%u ms.\n",
+                     m_kdfIterationsPerSecond, m_kdfIterations, target_ms);
+    return m_kdfIterations;
+}
 
-    size_t count = credManager.getCount();
-    if (count > 0) {
-        USBSerial.printf("Trovate %d credenziali da ri-cifrare...\n", count);
+bool SecurityManager::_recoverDataKey(const String& pin, unsigned char* outKey, unsigned char* outMaster, bool* outLegacy) {
+    if (!m_isPinSet) return false;
 
-        File file = SD_MMC.open(CREDENTIALS_FILE, FILE_READ);
-        if (!file) {
-            USBSerial.println("ERRORE: Impossibile aprire il file delle credenziali per la lettura.");
-            return false;
+    bool legacy = !m_hasKeySlot || m_keySlot.version == SEC_KEYSLOT_VERSION_SHA256;
+    *outLegacy = legacy;
+
+    if (legacy) {
+        // Formati precedenti: l'hash SHA-256 permette di scartare subito un PIN errato
+        unsigned char pinHash[32];
+        _hashPin(pin, pinHash);
+        bool match = memcmp(pinHash, m_pinVerifier, 32) == 0;
+        mbedtls_platform_zeroize(pinHash, sizeof(pinHash));
+        if (!match) return false;
+    }
+
+    USBSerial.println("Derivazione chiave in corso...");
+    _deriveMaster(pin, m_salt, _slotIterations(), outMaster);
+
+    bool ok;
+    if (legacy) {
+        // La vecchia KEK (o la chiave del vault, senza slot) e' la chiave master stessa
+        if (m_hasKeySlot) {
+            ok = _unwrapDataKey(outMaster, outKey);
+        } else {
+            memcpy(outKey, outMaster, SEC_KEY_SIZE);
+            ok = true;
         }
-        String tempFilePath = String(CREDENTIALS_FILE) + ".tmp";
-        File tempFile = SD_MMC.open(tempFilePath.c_str(), FILE_WRITE);
-        if (!tempFile) {
-            USBSerial.println("ERRORE: Impossibile creare il file temporaneo.");
-            file.close();
-            return false;
+    } else {
+        unsigned char verifier[SEC_VERIFIER_SIZE];
+        unsigned char kek[SEC_KEY_SIZE];
+        _splitMaster(outMaster, verifier, kek);
+        ok = memcmp(verifier, m_pinVerifier, SEC_VERIFIER_SIZE) == 0;
+        if (ok && !_unwrapDataKey(kek, outKey)) {
+            USBSerial.println("ERRORE: Impossibile decifrare la chiave dati. Slot delle chiavi danneggiato?");
+            ok = false;
         }
+        mbedtls_platform_zeroize(verifier, sizeof(verifier));
+        mbedtls_platform_zeroize(kek, sizeof(kek));
+    }
+    if (!ok) mbedtls_platform_zeroize(outMaster, SEC_KEY_SIZE);
+    return ok;
+}
 
-        // Usa due oggetti Crypto per rendere la logica più pulita
-        Crypto crypto_old;
-        crypto_old.begin(oldKey);
-
-        Crypto crypto_new;
-        crypto_new.begin(newKey);
-
-        for (size_t i = 0; i < count; i++) {
-            Credential cred;
-            file.read((uint8_t*)&cred, sizeof(Credential));
-            
-            // Decifra con l'oggetto crypto che usa la VECCHIA chiave
-            String plain_pass = crypto_old.decrypt(cred.encrypted_password);
-            
-            if (plain_pass.length() > 0) {
-                // Ri-cifra con l'oggetto crypto che usa la NUOVA chiave
-                String new_encrypted_pass = crypto_new.encrypt(plain_pass);
-                strncpy(cred.encrypted_password, new_encrypted_pass.c_str(), MAX_ENCRYPTED_PASS_LEN - 1);
-            } else {
-                 USBSerial.printf("ATTENZIONE: Impossibile decifrare la credenziale #%d con la vecchia chiave. Verrà copiata così com'è.\n", i);
-            }
-            // Scrivi il record (modificato o no) nel file temporaneo
-            tempFile.write((uint8_t*)&cred, sizeof(Credential));
-        }
-        file.close();
-        tempFile.close();
-        USBSerial.println("OK: Tutte le credenziali sono state processate nel file temporaneo.");
+bool SecurityManager::_storeKeySlot(const unsigned char* salt, uint32_t iterations, const unsigned char* verifier, const unsigned char* kek) {
+    KeySlot slot;
+    memset(&slot, 0, sizeof(slot));
+    slot.version = SEC_KEYSLOT_VERSION;
+    slot.kdf_id = SEC_KDF_PBKDF2_SHA256;
+    slot.kdf_iterations = iterations;
+    memcpy(slot.salt, salt, SEC_SALT_SIZE);
+    memcpy(slot.pin_verifier, verifier, SEC_VERIFIER_SIZE);
 
-        // Sostituisci il vecchio file con quello nuovo
-        SD_MMC.remove(CREDENTIALS_FILE);
-        SD_MMC.rename(tempFilePath.c_str(), CREDENTIALS_FILE);
+    Crypto wrapper;
+    wrapper.begin(kek);
+    if (wrapper.encrypt(m_userKey, SEC_KEY_SIZE, slot.wrapped_key, sizeof(slot.wrapped_key)) != SEC_WRAPPED_KEY_SIZE) {
+        return false;
     }
 
-    // Aggiorna il PIN e la chiave master del dispositivo
-    unsigned char newPinHash[32];
-    _hashPin(newPin, newPinHash);
     m_preferences.begin("security", false);
-    m_preferences.putBytes("pin_hash", newPinHash, 32);
+    bool ok = m_preferences.putBytes("keyslot", &slot, sizeof(slot)) == sizeof(slot);
     m_preferences.end();
-    memcpy(m_storedPinHash, newPinHash, 32);
-    memcpy(m_userKey, newKey, 32); 
+    if (!ok) return false;
 
-    // Infine, aggiorna l'oggetto crypto principale con la nuova chiave per le operazioni future
-    crypto.begin(m_userKey);
-
-    USBSerial.println("SUCCESS: PIN cambiato e credenziali ri-cifrate con successo!");
+    memcpy(&m_keySlot, &slot, sizeof(slot));
+    memcpy(m_salt, salt, SEC_SALT_SIZE);
+    memcpy(m_pinVerifier, verifier, SEC_VERIFIER_SIZE);
+    m_hasKeySlot = true;
+    m_isPinSet = true;
     return true;
 }
 
+bool SecurityManager::_unwrapDataKey(const unsigned char* kek, unsigned char* outKey) {
+    Crypto wrapper;
+    wrapper.begin(kek);
+    return wrapper.decrypt(m_keySlot.wrapped_key, SEC_WRAPPED_KEY_SIZE, outKey, SEC_KEY_SIZE) == SEC_KEY_SIZE;
+}
+
 bool SecurityManager::isPinSet() {
     return m_isPinSet;
 }
 
 void SecurityManager::lock() {
+    m_lockGeneration++;  // Uno sblocco in corso non potra' piu' pubblicare UNLOCKED
     m_currentState = SecurityState::LOCKED;
     USBSerial.println("INFO SecMan: Dispositivo bloccato.");
 }
 
+bool SecurityManager::cryptoErase() {
+    // Prima la copia in NVS: e' l'unica che sopravvive a un riavvio
+    m_preferences.begin("security", false);
+    bool ok = m_preferences.clear();
+    m_preferences.end();
+
+    mbedtls_platform_zeroize(m_userKey, sizeof(m_userKey));
+    mbedtls_platform_zeroize(&m_keySlot, sizeof(m_keySlot));
+    mbedtls_platform_zeroize(m_pinVerifier, sizeof(m_pinVerifier));
+    mbedtls_platform_zeroize(m_salt, sizeof(m_salt));
+    m_hasKeySlot = false;
+    m_isPinSet = false;
+    m_isSaltSet = false;
+    m_lockGeneration++;
+    m_currentState = SecurityState::LOCKED;
+
+    if (ok) {
+        USBSerial.println("INFO SecMan: Chiavi distrutte. Il vault non e' piu' decifrabile.");
+    } else {
+        USBSerial.println("ERRORE SecMan: Impossibile cancellare lo slot delle chiavi da NVS!");
+    }
+    return ok;
+}
+
 SecurityState SecurityManager::getState() const {
     return m_currentState;
 }
@@ -191,19 +464,27 @@ const unsigned char* SecurityManager::getUserKey() const {
     return m_userKey;
 }
 
-void SecurityManager::_deriveKey(const String& pin, const unsigned char* salt, unsigned char* outKey) {
-    //mbedtls_md_context_t sha_ctx;
-    //mbedtls_md_init(&sha_ctx);
-    //mbedtls_md_setup(&sha_ctx, mbedtls_md_info_from_type(MBEDTLS_MD_SHA256), 1);
-    
-  mbedtls_pkcs5_pbkdf2_hmac_ext(
+void SecurityManager::_deriveMaster(const String& pin, const unsigned char* salt, uint32_t iterations, unsigned char* outMaster) {
+    if (m_fastKdf) {
+        Pbkdf2Sha256::derive((const uint8_t*)pin.c_str(), pin.length(), salt, SEC_SALT_SIZE, iterations, outMaster, SEC_KEY_SIZE,
+                             _kdfProgress, this);
+        return;
+    }
+    mbedtls_pkcs5_pbkdf2_hmac_ext(
         MBEDTLS_MD_SHA256,          // Tipo di hash da usare (passato direttamente)
         (const unsigned char*)pin.c_str(), pin.length(), // Il PIN
-        salt, 16,                   // Il salt e la sua lunghezza
-        PBKDF2_ITERATIONS,          // Numero di iterazioni
-        32,                         // Lunghezza della chiave di output in byte (256 bit)
-        outKey                      // Buffer di output per la chiave
+        salt, SEC_SALT_SIZE,        // Il salt e la sua lunghezza
+        iterations,                 // Numero di iterazioni (da calibrazione o dallo slot)
+        SEC_KEY_SIZE,               // Un solo blocco PBKDF2 (256 bit): un secondo blocco raddoppierebbe il costo
+        outMaster                   // Buffer di output per la chiave master
     );
+}
 
-    //mbedtls_md_free(&sha_ctx);
-}
\ No newline at end of file
+void SecurityManager::_splitMaster(const unsigned char* master, unsigned char* outVerifier, unsigned char* outKek) {
+    // Espansione con etichette distinte: conoscere il verificatore non rivela nulla sulla KEK
+    static const char VERIFIER_LABEL[] = "pwvault-pin-verifier";
+    static const char KEK_LABEL[] = "pwvault-key-encryption-key";
+    const mbedtls_md_info_t* sha256 = mbedtls_md_info_from_type(MBEDTLS_MD_SHA256);
+    mbedtls_md_hmac(sha256, master, SEC_KEY_SIZE, (const unsigned char*)VERIFIER_LABEL, sizeof(VERIFIER_LABEL) - 1, outVerifier);
+    mbedtls_md_hmac(sha256, master, SEC_KEY_SIZE, (const unsigned char*)KEK_LABEL, sizeof(KEK_LABEL) - 1, outKek);
+}
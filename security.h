@@ -1,11 +1,11 @@
 #pragma once
 
 #include <vector>
+#include <cstddef>
 #include <Preferences.h>
 #include "HWCDC.h"
 
-// Includi questi due file per avere accesso alle altre classi
-#include "credentials.h"
+// La classe Crypto serve per cifrare la chiave dati con la chiave derivata dal PIN
 #include "crypto.h"
 
 enum class SecurityState {
@@ -13,6 +13,57 @@ enum class SecurityState {
     UNLOCKED
 };
 
+// Esito di uno sblocco o di un cambio PIN asincrono (startUnlock/pollUnlock, startChangePin/pollChangePin)
+enum class UnlockResult {
+    NONE,     // Nessuno sblocco avviato o esito gia' consegnato
+    RUNNING,
+    SUCCESS,
+    FAILED,
+    CANCELLED // PIN corretto, ma il dispositivo e' stato bloccato durante la derivazione: resta bloccato
+};
+
+// Il task di sblocco gira sul core 0, lasciando il core 1 a loop() e LVGL
+#define SEC_UNLOCK_TASK_CORE 0
+#define SEC_UNLOCK_TASK_STACK 8192
+
+// Dimensioni delle chiavi e del materiale salvato in NVS
+#define SEC_SALT_SIZE 16
+#define SEC_KEY_SIZE 32
+#define SEC_WRAPPED_KEY_SIZE (12 + 16 + SEC_KEY_SIZE) // IV + Tag + chiave dati cifrata
+#define SEC_VERIFIER_SIZE 32
+// Versioni dello slot: la 1 usava un hash SHA-256 non salato del PIN e la chiave PBKDF2 come KEK,
+// la 2 ricava verificatore e KEK dalla stessa derivazione PBKDF2
+#define SEC_KEYSLOT_VERSION_SHA256 1
+#define SEC_KEYSLOT_VERSION 2
+
+// Parametri della derivazione del PIN. SEC_KDF_LEGACY indica uno slot scritto prima della
+// calibrazione (campi a zero): PBKDF2-HMAC-SHA256 con il numero di iterazioni storico.
+#define SEC_KDF_LEGACY 0
+#define SEC_KDF_PBKDF2_SHA256 1
+#define SEC_KDF_LEGACY_ITERATIONS 10000
+#define SEC_KDF_MIN_ITERATIONS SEC_KDF_LEGACY_ITERATIONS // La calibrazione non scende mai sotto il valore storico
+#define SEC_KDF_MAX_ITERATIONS 1000000
+#define SEC_KDF_TARGET_MS 800        // Durata desiderata della derivazione allo sblocco
+#define SEC_KDF_PROBE_ITERATIONS 1000 // Iterazioni usate per misurare la velocita' del dispositivo
+
+// Cifratura a busta: il vault e' cifrato con una chiave dati (DEK) casuale, salvata
+// in NVS solo cifrata con la chiave derivata dal PIN (KEK). Salt, hash del PIN e DEK
+// cifrata stanno in un unico blob, scritto con una sola putBytes: un'interruzione
+// lascia sempre lo slot vecchio o quello nuovo, mai un misto dei due.
+// I parametri KDF stanno nello stesso blob, cosi' non possono mai disallinearsi dal salt.
+// 'kdf_iterations' e' in coda: gli slot salvati prima della calibrazione ne sono un prefisso.
+struct KeySlot {
+    uint8_t version;
+    uint8_t kdf_id;       // SEC_KDF_*
+    uint8_t reserved[2];
+    unsigned char salt[SEC_SALT_SIZE];
+    unsigned char pin_verifier[SEC_VERIFIER_SIZE]; // Nella versione 1: SHA-256 del PIN
+    unsigned char wrapped_key[SEC_WRAPPED_KEY_SIZE];
+    uint32_t kdf_iterations;
+};
+// Dimensione degli slot salvati prima dell'aggiunta di 'kdf_iterations'
+#define SEC_KEYSLOT_SIZE_NO_KDF_PARAMS offsetof(KeySlot, kdf_iterations)
+
 class SecurityManager {
 public:
     SecurityManager();
@@ -21,27 +72,114 @@ public:
     // Controlla un PIN. Se nessun PIN è salvato, lo salva come master.
     bool checkPin(const String& attempt);
 
+    // Sblocco asincrono: la verifica del PIN (la derivazione costosa) gira su un task FreeRTOS e non
+    // modifica lo stato. pollUnlock(), dal thread dell'interfaccia, applica l'esito (chiave dati,
+    // slot in NVS, stato UNLOCKED) e lo restituisce una sola volta, poi torna a NONE.
+    // Un lock() durante la derivazione annulla lo sblocco: l'esito diventa CANCELLED.
+    bool startUnlock(const String& attempt);
+    UnlockResult pollUnlock();
+    bool isUnlockRunning() const { return m_unlockResult == UnlockResult::RUNNING; }
+    // Avanzamento della derivazione in corso, da 0 a 100
+    uint8_t getUnlockProgress() const { return m_unlockProgress; }
+
     // Controlla se un PIN è già stato impostato
     bool isPinSet();
 
-    // Processo di cambio PIN che gestisce la ri-cifratura
-    bool changePin(const String& oldPin, const String& newPin, CredentialsManager& credManager, Crypto& crypto);
+    // Cambio PIN (rifiutato durante uno sblocco asincrono): ri-cifra solo la chiave dati, in tempo costante qualunque sia la dimensione del vault
+    bool changePin(const String& oldPin, const String& newPin);
+    // Cambio PIN asincrono: le due derivazioni (vecchio e nuovo PIN) girano sul task di sblocco,
+    // pollChangePin() salva il nuovo slot dal thread dell'interfaccia. Stesso ciclo di vita di
+    // startUnlock()/pollUnlock(): una sola operazione alla volta, annullata da lock().
+    bool startChangePin(const String& oldPin, const String& newPin);
+    UnlockResult pollChangePin();
 
-    void lock(); 
+    void lock();
+
+    // Misura la velocita' di HMAC-SHA256 sul dispositivo e salva il numero di iterazioni che
+    // porta la derivazione a circa 'target_ms'. Il PIN corrente viene ri-derivato con i nuovi
+    // parametri al prossimo sblocco riuscito. Restituisce le iterazioni scelte.
+    uint32_t calibrateKdf(uint32_t target_ms = SEC_KDF_TARGET_MS);
+    // Solo misura: stesse iterazioni di calibrateKdf(), ma niente viene salvato in NVS ne' cambiato
+    // nei parametri in uso (per i test). 'perSecond', se non nullo, riceve le iterazioni al secondo.
+    uint32_t measureKdf(uint32_t target_ms = SEC_KDF_TARGET_MS, uint32_t* perSecond = nullptr);
+    uint32_t getKdfIterations() const { return m_kdfIterations; }
+    // Iterazioni di PBKDF2 al secondo misurate dall'ultima calibrazione (0 se non eseguita)
+    uint32_t getKdfIterationsPerSecond() const { return m_kdfIterationsPerSecond; }
+
+    // Autodistruzione: cancella lo slot delle chiavi da NVS e azzera le chiavi in RAM.
+    // Senza la chiave dati il vault sulla SD diventa illeggibile all'istante.
+    bool cryptoErase();
 
     SecurityState getState() const;
-    const unsigned char* getUserKey() const; // Getter per la chiave derivata
+    const unsigned char* getUserKey() const; // Getter per la chiave dati del vault
 
 private:
+    // Esito della verifica di un PIN, calcolato senza toccare lo stato e applicato da _applyPinCheck()
+    struct PinCheck {
+        unsigned char key[SEC_KEY_SIZE];            // Chiave dati recuperata (o generata per il primo PIN)
+        bool newPin;                                // Primo PIN: senza slot salvato lo sblocco fallisce
+        bool storeSlot;                             // Slot da salvare: primo PIN, nuovi parametri KDF o migrazione
+        bool removeLegacy;                          // Dopo il salvataggio: rimuove pin_hash e pin_salt
+        unsigned char salt[SEC_SALT_SIZE];
+        uint32_t iterations;
+        unsigned char verifier[SEC_VERIFIER_SIZE];
+        unsigned char kek[SEC_KEY_SIZE];
+    };
+    // Parte costosa di checkPin(): legge lo slot ma non scrive ne' membri ne' NVS
+    bool _verifyPin(const String& attempt, PinCheck* check);
+    // Parte veloce: chiave dati in RAM, eventuale slot in NVS, stato UNLOCKED. Azzera 'check'.
+    bool _applyPinCheck(PinCheck* check);
+    // Come _verifyPin() per il cambio PIN: chiave dati dal vecchio PIN, nuovo slot dal nuovo
+    bool _verifyPinChange(const String& oldPin, const String& newPin, PinCheck* check);
+    // Salva il nuovo slot senza cambiare lo stato di blocco. Azzera 'check'.
+    bool _applyPinChange(PinCheck* check);
+    // Avvia il task di sblocco: verifica di 'oldPin', piu' il cambio PIN se 'newPin' non e' vuoto
+    bool _startPending(const String& oldPin, const String& newPin);
+    // Esito dell'operazione asincrona in corso, applicato sul thread dell'interfaccia
+    UnlockResult _pollPending();
+
+    static void _unlockTask(void* param);
+    static void _kdfProgress(uint32_t done, uint32_t total, void* user);
+
+    // Carica PIN e salt dalle chiavi separate delle installazioni precedenti allo slot
+    void _loadLegacyPin();
+    // Hash SHA-256 non salato dei formati precedenti, usato solo per la migrazione
     void _hashPin(const String& pin, unsigned char* outHash);
-    
-    void _deriveKey(const String& pin, const unsigned char* salt, unsigned char* outKey);
+
+    // Unica derivazione costosa (PBKDF2) da PIN e salt: il risultato e' la chiave master
+    void _deriveMaster(const String& pin, const unsigned char* salt, uint32_t iterations, unsigned char* outMaster);
+    // Iterazioni con cui e' stato derivato lo slot corrente
+    uint32_t _slotIterations() const;
+    // Divide la chiave master in verificatore del PIN e chiave di cifratura (KEK), con due HMAC
+    void _splitMaster(const unsigned char* master, unsigned char* outVerifier, unsigned char* outKek);
+    // Verifica il PIN e recupera la chiave dati, per qualunque formato salvato.
+    // 'outMaster' riceve la chiave master, 'outLegacy' indica se lo slot va migrato.
+    bool _recoverDataKey(const String& pin, unsigned char* outKey, unsigned char* outMaster, bool* outLegacy);
+
+    // Cifra m_userKey con 'kek' e salva lo slot completo in NVS
+    bool _storeKeySlot(const unsigned char* salt, uint32_t iterations, const unsigned char* verifier, const unsigned char* kek);
+    // Decifra la chiave dati dello slot corrente con 'kek'
+    bool _unwrapDataKey(const unsigned char* kek, unsigned char* outKey);
 
     SecurityState m_currentState;
     Preferences m_preferences;
-    unsigned char m_storedPinHash[32];
-    unsigned char m_salt[16]; // Memorizziamo il salt per PBKDF2
-    unsigned char m_userKey[32]; // La chiave di cifratura derivata
+    KeySlot m_keySlot;
+    unsigned char m_pinVerifier[SEC_VERIFIER_SIZE]; // Verificatore (o hash, nei formati precedenti) del PIN
+    unsigned char m_salt[SEC_SALT_SIZE]; // Memorizziamo il salt per PBKDF2
+    unsigned char m_userKey[SEC_KEY_SIZE]; // La chiave dati (DEK) che cifra il vault
     bool m_isPinSet;
     bool m_isSaltSet;
-};
\ No newline at end of file
+    bool m_hasKeySlot; // false per le installazioni precedenti alla cifratura a busta
+    uint32_t m_kdfIterations; // Iterazioni desiderate (da calibrazione), salvate in "kdf_iter"
+    uint32_t m_kdfIterationsPerSecond;
+    bool m_fastKdf; // true se Pbkdf2Sha256 ha superato l'autotest
+    String m_unlockAttempt;
+    String m_newPin;                         // Non vuoto: l'operazione in corso e' un cambio PIN
+    PinCheck m_unlockCheck;                  // Scritto dal task di sblocco, applicato da pollUnlock()
+    volatile uint32_t m_lockGeneration;      // Incrementato da lock(): annulla gli sblocchi in corso
+    uint32_t m_unlockGeneration;             // m_lockGeneration all'avvio dello sblocco in corso
+    volatile UnlockResult m_unlockResult;
+    volatile uint8_t m_unlockProgress;
+    uint8_t m_progressBase;                  // Il cambio PIN fa due derivazioni: ciascuna vale meta' dell'arco
+    uint8_t m_progressSpan;
+};
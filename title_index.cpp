@@ -0,0 +1,161 @@
+#include "title_index.h"
+#include <SD_MMC.h>
+#include <algorithm>
+#include "credentials.h"
+#include "crc32c.h"
+#include "collation.h"
+
+extern HWCDC USBSerial;
+
+TitleIndex::TitleIndex() {
+    memset(m_letter_start, 0, sizeof(m_letter_start));
+}
+
+// Chiavi di ordinamento precalcolate (Collation), senza distinzione tra maiuscole, minuscole e accenti;
+// a parita' di titolo l'ordine dei record (cosi' fusione e ordinamento completo coincidono)
+bool TitleIndex::_less(uint32_t a, uint32_t b, const std::vector<CredentialIndexEntry>& index, const char* pool) {
+    const uint8_t* key_a = index[a].title_key;
+    const uint8_t* key_b = index[b].title_key;
+    int cmp = memcmp(key_a, key_b, COLLATION_KEY_LEN);
+    // Chiavi piene e uguali: i titoli possono ancora differire oltre il COLLATION_KEY_LEN-esimo byte
+    if (cmp == 0 && key_a[COLLATION_KEY_LEN - 1] != 0) {
+        cmp = Collation::compare(pool + index[a].title_pos, pool + index[b].title_pos);
+    }
+    return cmp < 0 || (cmp == 0 && a < b);
+}
+
+void TitleIndex::_computeLetters(const std::vector<CredentialIndexEntry>& index) {
+    // In ordine di chiave il primo byte non decresce mai: basta una passata
+    size_t pos = 0;
+    for (uint8_t letter = 0; letter < TITLE_INDEX_LETTERS; letter++) {
+        uint8_t first = 'a' + letter;  // Per letter == 26 e' '{', il primo byte dopo la 'z'
+        while (pos < m_order.size() && index[m_order[pos]].title_key[0] < first) pos++;
+        m_letter_start[letter] = pos;
+    }
+}
+
+uint32_t TitleIndex::_crc() const {
+    uint32_t crc = Crc32c::update(0, m_letter_start, sizeof(m_letter_start));
+    return Crc32c::update(crc, m_order.data(), m_order.size() * sizeof(uint32_t));
+}
+
+void TitleIndex::rebuild(const std::vector<CredentialIndexEntry>& index, const char* pool) {
+    m_order.resize(index.size());
+    for (size_t i = 0; i < m_order.size(); i++) m_order[i] = i;
+    std::sort(m_order.begin(), m_order.end(), [&](uint32_t a, uint32_t b) { return _less(a, b, index, pool); });
+    _computeLetters(index);
+}
+
+bool TitleIndex::extend(const std::vector<CredentialIndexEntry>& index, const char* pool) {
+    size_t old_size = m_order.size();
+    if (old_size > index.size()) return false;
+    for (uint32_t record : m_order) {
+        if (record >= old_size) return false;
+    }
+
+    // Solo le voci nuove vengono ordinate: O(k log k) per k voci, poi una fusione lineare
+    std::vector<uint32_t> added(index.size() - old_size);
+    for (size_t i = 0; i < added.size(); i++) added[i] = old_size + i;
+    auto less = [&](uint32_t a, uint32_t b) { return _less(a, b, index, pool); };
+    std::sort(added.begin(), added.end(), less);
+
+    std::vector<uint32_t> merged(index.size());
+    std::merge(m_order.begin(), m_order.end(), added.begin(), added.end(), merged.begin(), less);
+    m_order.swap(merged);
+    _computeLetters(index);
+    return true;
+}
+
+void TitleIndex::reposition(uint32_t record, const std::vector<CredentialIndexEntry>& index, const char* pool) {
+    auto it = std::find(m_order.begin(), m_order.end(), record);
+    if (it == m_order.end()) return;
+    m_order.erase(it);
+    auto pos = std::lower_bound(m_order.begin(), m_order.end(), record,
+                                [&](uint32_t a, uint32_t b) { return _less(a, b, index, pool); });
+    m_order.insert(pos, record);
+    _computeLetters(index);
+}
+
+void TitleIndex::compact(const std::vector<bool>& removed) {
+    // Nuovo indice di ogni record: il vecchio meno i record rimossi che lo precedono
+    std::vector<uint32_t> renumber(removed.size());
+    uint32_t next = 0;
+    for (size_t i = 0; i < removed.size(); i++) {
+        renumber[i] = next;
+        if (!removed[i]) next++;
+    }
+    // L'inizio di ogni lettera scala dei record rimossi che lo precedono: i titoli non servono
+    size_t kept = 0;
+    uint8_t letter = 0;
+    for (size_t pos = 0; pos < m_order.size(); pos++) {
+        while (letter < TITLE_INDEX_LETTERS && m_letter_start[letter] == pos) m_letter_start[letter++] = kept;
+        uint32_t record = m_order[pos];
+        if (record < removed.size() && !removed[record]) m_order[kept++] = renumber[record];
+    }
+    while (letter < TITLE_INDEX_LETTERS) m_letter_start[letter++] = kept;
+    m_order.resize(kept);
+}
+
+void TitleIndex::clear() {
+    m_order.clear();
+    memset(m_letter_start, 0, sizeof(m_letter_start));
+}
+
+bool TitleIndex::load(uint32_t generation, uint32_t record_count, uint32_t records_crc) {
+    File file = SD_MMC.open(TITLE_INDEX_FILE, FILE_READ);
+    if (!file) return false;
+    TitleIndexHeader header;
+    bool ok = file.read((uint8_t*)&header, sizeof(header)) == sizeof(header) &&
+              header.magic == TITLE_INDEX_MAGIC && header.version == TITLE_INDEX_VERSION &&
+              header.letters == TITLE_INDEX_LETTERS && header.generation == generation &&
+              header.record_count == record_count && header.records_crc == records_crc &&
+              file.size() == sizeof(header) + record_count * sizeof(uint32_t);
+    if (!ok) {
+        file.close();
+        return false;
+    }
+
+    // L'ordine in memoria viene sostituito solo se il file e' integro
+    TitleIndex loaded;
+    loaded.m_order.resize(record_count);
+    memcpy(loaded.m_letter_start, header.letter_start, sizeof(loaded.m_letter_start));
+    size_t bytes = record_count * sizeof(uint32_t);
+    ok = file.read((uint8_t*)loaded.m_order.data(), bytes) == bytes && loaded._crc() == header.order_crc;
+    file.close();
+    if (!ok) {
+        USBSerial.println("ATTENZIONE TitleIndex: File dell'indice dei titoli danneggiato. Verra' ricostruito.");
+        return false;
+    }
+    m_order.swap(loaded.m_order);
+    memcpy(m_letter_start, loaded.m_letter_start, sizeof(m_letter_start));
+    return true;
+}
+
+bool TitleIndex::save(uint32_t generation, uint32_t records_crc) const {
+    TitleIndexHeader header = {0};
+    header.magic = TITLE_INDEX_MAGIC;
+    header.version = TITLE_INDEX_VERSION;
+    header.letters = TITLE_INDEX_LETTERS;
+    header.generation = generation;
+    header.record_count = m_order.size();
+    header.records_crc = records_crc;
+    header.order_crc = _crc();
+    memcpy(header.letter_start, m_letter_start, sizeof(header.letter_start));
+
+    // Un salvataggio interrotto lascia un file che non supera il controllo del CRC: nessun file temporaneo
+    File file = SD_MMC.open(TITLE_INDEX_FILE, FILE_WRITE);
+    if (!file) return false;
+    size_t bytes = m_order.size() * sizeof(uint32_t);
+    bool ok = file.write((const uint8_t*)&header, sizeof(header)) == sizeof(header) &&
+              file.write((const uint8_t*)m_order.data(), bytes) == bytes;
+    file.close();
+    if (!ok) {
+        USBSerial.println("ERRORE TitleIndex: Salvataggio dell'indice dei titoli fallito.");
+        remove();
+    }
+    return ok;
+}
+
+void TitleIndex::remove() {
+    if (SD_MMC.exists(TITLE_INDEX_FILE)) SD_MMC.remove(TITLE_INDEX_FILE);
+}
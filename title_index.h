@@ -0,0 +1,62 @@
+#pragma once
+#include <Arduino.h>
+#include <vector>
+
+struct CredentialIndexEntry;
+
+// Ordine alfabetico dei titoli salvato accanto al vault, per mostrare la lista senza ordinarla a ogni avvio.
+// Il file vale solo per il vault con la stessa generazione, lo stesso numero di record e lo stesso
+// digest dei record (che cambia anche con le modifiche sul posto): altrimenti viene ricostruito.
+// Dopo un'importazione solo le voci nuove vengono ordinate e poi fuse con l'ordine esistente.
+#define TITLE_INDEX_FILE "/credentials.idx"
+#define TITLE_INDEX_MAGIC 0x58495750u  // "PWIX"
+#define TITLE_INDEX_VERSION 2  // 2: ordine delle chiavi Collation (1: strcasecmp)
+// Prima posizione di ogni lettera A-Z, piu' la prima posizione dopo la Z
+#define TITLE_INDEX_LETTERS 27
+
+// Header del file, seguito da record_count indici di record (uint32_t) in ordine alfabetico
+struct TitleIndexHeader {
+    uint32_t magic;         // TITLE_INDEX_MAGIC
+    uint16_t version;       // TITLE_INDEX_VERSION
+    uint16_t letters;       // TITLE_INDEX_LETTERS
+    uint32_t generation;    // Generazione del vault ordinato
+    uint32_t record_count;
+    uint32_t records_crc;   // Digest dei record del vault al momento del salvataggio
+    uint32_t order_crc;     // CRC32C di letter_start e dell'ordine
+    uint32_t letter_start[TITLE_INDEX_LETTERS];
+};
+
+class TitleIndex {
+public:
+    TitleIndex();
+
+    // Carica il file se descrive il vault indicato. In caso contrario l'ordine in memoria non cambia.
+    bool load(uint32_t generation, uint32_t record_count, uint32_t records_crc);
+    bool save(uint32_t generation, uint32_t records_crc) const;
+    static void remove();
+
+    // Ordina tutte le voci dell'indice (titoli nel pool di stringhe 'pool')
+    void rebuild(const std::vector<CredentialIndexEntry>& index, const char* pool);
+    // Le voci da size() in poi sono nuove: vengono ordinate da sole e fuse con l'ordine esistente.
+    // False se l'ordine in memoria non e' coerente con 'index' (va usato rebuild()).
+    bool extend(const std::vector<CredentialIndexEntry>& index, const char* pool);
+    // Il titolo della voce 'record' e' cambiato: la sposta nella nuova posizione
+    void reposition(uint32_t record, const std::vector<CredentialIndexEntry>& index, const char* pool);
+    // Compattazione: toglie le voci marcate in 'removed' e rinumera le altre, senza riordinare
+    void compact(const std::vector<bool>& removed);
+    void clear();
+
+    size_t size() const { return m_order.size(); }
+    // Indice del record in posizione 'position' dell'ordine alfabetico
+    uint32_t at(size_t position) const { return m_order[position]; }
+    // Prima posizione dei titoli che iniziano con la lettera 'letter' (0 = A ... 25 = Z, 26 = dopo la Z)
+    uint32_t letterStart(uint8_t letter) const { return m_letter_start[letter]; }
+
+private:
+    static bool _less(uint32_t a, uint32_t b, const std::vector<CredentialIndexEntry>& index, const char* pool);
+    void _computeLetters(const std::vector<CredentialIndexEntry>& index);
+    uint32_t _crc() const;
+
+    std::vector<uint32_t> m_order;
+    uint32_t m_letter_start[TITLE_INDEX_LETTERS];
+};
@@ -0,0 +1,212 @@
+#include "vault_journal.h"
+#include <SD_MMC.h>
+#include "esp_heap_caps.h"
+#include "crc32c.h"
+#include "mbedtls/platform_util.h"
+#include <unistd.h>
+#include "credentials.h"  // VAULT_MOUNT_POINT, per truncate()
+
+extern HWCDC USBSerial;
+
+VaultJournal::VaultJournal()
+    : m_buffer(nullptr), m_used(0), m_sequence(1), m_txn_sequence(1), m_file_size(0), m_torn(false), m_torn_size(0) {}
+
+VaultJournal::~VaultJournal() {
+    discard();
+    if (m_buffer) heap_caps_free(m_buffer);
+}
+
+uint32_t VaultJournal::_crc(const JournalEntryHeader& header, const uint8_t* data) {
+    JournalEntryHeader h = header;
+    h.crc = 0;
+    uint32_t crc = Crc32c::update(0, &h, sizeof(h));
+    return Crc32c::update(crc, data, header.length);
+}
+
+bool VaultJournal::_append(uint8_t type, uint32_t generation, uint32_t offset, const uint8_t* data, uint16_t length) {
+    if (!m_buffer) {
+        m_buffer = (uint8_t*)heap_caps_malloc(JOURNAL_BATCH_SIZE, MALLOC_CAP_8BIT);
+        if (!m_buffer) return false;
+    }
+    if (m_used + sizeof(JournalEntryHeader) + length > JOURNAL_BATCH_SIZE) return false;
+    if (m_used == 0) m_txn_sequence = m_sequence;
+
+    JournalEntryHeader header = {0};
+    header.magic = JOURNAL_MAGIC;
+    header.sequence = m_sequence++;
+    header.generation = generation;
+    header.offset = offset;
+    header.length = length;
+    header.type = type;
+    header.crc = _crc(header, data);
+    memcpy(m_buffer + m_used, &header, sizeof(header));
+    if (length > 0) memcpy(m_buffer + m_used + sizeof(header), data, length);
+    m_used += sizeof(header) + length;
+    return true;
+}
+
+bool VaultJournal::stage(uint32_t generation, uint32_t offset, const uint8_t* data, uint16_t length) {
+    // Resta sempre spazio per il record di commit
+    if (m_used + 2 * sizeof(JournalEntryHeader) + length > JOURNAL_BATCH_SIZE) return false;
+    return _append(JOURNAL_ENTRY_WRITE, generation, offset, data, length);
+}
+
+void VaultJournal::discard() {
+    if (m_used > 0) m_sequence = m_txn_sequence;
+    _clear();
+}
+
+void VaultJournal::_clear() {
+    if (m_buffer) mbedtls_platform_zeroize(m_buffer, m_used);
+    m_used = 0;
+}
+
+bool VaultJournal::_apply(File& vault, const uint8_t* entries, size_t len) {
+    size_t pos = 0;
+    while (pos + sizeof(JournalEntryHeader) <= len) {
+        JournalEntryHeader header;
+        memcpy(&header, entries + pos, sizeof(header));
+        pos += sizeof(header);
+        if (header.type == JOURNAL_ENTRY_WRITE) {
+            if (!vault.seek(header.offset) || vault.write(entries + pos, header.length) != header.length) return false;
+        }
+        pos += header.length;
+    }
+    vault.flush();
+    return true;
+}
+
+bool VaultJournal::commit(File& vault) {
+    if (m_used == 0) return true;
+    JournalEntryHeader last;
+    memcpy(&last, m_buffer, sizeof(last));  // Generazione della transazione: e' la stessa per tutte le voci
+    if (!_append(JOURNAL_ENTRY_COMMIT, last.generation, 0, nullptr, 0)) {
+        discard();
+        return false;
+    }
+
+    // Coda parziale di una scrittura fallita in precedenza: va tolta prima di accodare altro
+    if (m_torn && !_truncate(m_torn_size)) {
+        USBSerial.println("ERRORE Journal: Il giornale contiene una scrittura parziale. Modifica annullata.");
+        discard();
+        return false;
+    }
+
+    // 1. Giornale: una sola scrittura per l'intera transazione, resa persistente prima di toccare il vault
+    File journal = SD_MMC.open(JOURNAL_FILE, FILE_APPEND);
+    size_t start_size = journal ? journal.size() : 0;
+    bool ok = journal && journal.write(m_buffer, m_used) == m_used;
+    if (journal) {
+        journal.flush();
+        journal.close();
+    }
+    if (!ok) {
+        USBSerial.println("ERRORE Journal: Scrittura del giornale fallita. Modifica annullata.");
+        discard();
+        if (journal) _truncate(start_size);  // Le voci scritte a meta' non devono restare in coda
+        return false;
+    }
+    m_file_size = start_size + m_used;
+
+    // 2. Vault: se questa fase si interrompe, replay() la completa al riavvio
+    ok = _apply(vault, m_buffer, m_used);
+    _clear();  // Le voci sono nel giornale: la sequenza resta avanzata
+    if (!ok) {
+        USBSerial.println("ERRORE Journal: Scrittura del vault fallita. Verra' ripetuta al riavvio.");
+        return false;
+    }
+
+    // Checkpoint: tutte le transazioni nel giornale sono gia' nel vault
+    if (m_file_size >= JOURNAL_CHECKPOINT_SIZE) {
+        reset();
+        m_file_size = 0;
+    }
+    return true;
+}
+
+int VaultJournal::replay(File& vault, uint32_t generation, uint32_t limit) {
+    File journal = SD_MMC.open(JOURNAL_FILE, FILE_READ);
+    if (!journal) return 0;
+    uint8_t* pending = (uint8_t*)heap_caps_malloc(JOURNAL_BATCH_SIZE, MALLOC_CAP_8BIT);
+    if (!pending) {
+        journal.close();
+        return -1;
+    }
+
+    size_t pending_len = 0;
+    int replayed = 0;
+    int skipped = 0;
+    bool first = true;
+    uint32_t expected = 0;
+    bool write_failed = false;
+    JournalEntryHeader header;
+    // La lettura si ferma alla prima voce incompleta o non valida: e' la coda di una scrittura interrotta
+    while (journal.read((uint8_t*)&header, sizeof(header)) == sizeof(header)) {
+        if (header.magic != JOURNAL_MAGIC || (!first && header.sequence != expected)) break;
+        if (pending_len + sizeof(header) + header.length > JOURNAL_BATCH_SIZE) break;
+        uint8_t* data = pending + pending_len + sizeof(header);
+        if (header.length > 0 && journal.read(data, header.length) != header.length) break;
+        if (_crc(header, data) != header.crc) break;
+        first = false;
+        expected = header.sequence + 1;
+
+        if (header.type == JOURNAL_ENTRY_WRITE) {
+            if ((uint64_t)header.offset + header.length > limit) break;  // Fuori dall'area dei record: dati non affidabili
+            memcpy(pending + pending_len, &header, sizeof(header));
+            pending_len += sizeof(header) + header.length;
+        } else if (header.type == JOURNAL_ENTRY_COMMIT) {
+            // Transazione completa. Se il vault e' stato riscritto nel frattempo, era gia' stata applicata.
+            if (header.generation == generation) {
+                if (!_apply(vault, pending, pending_len)) {
+                    write_failed = true;
+                    break;
+                }
+                replayed++;
+            } else {
+                skipped++;
+            }
+            pending_len = 0;
+        } else {
+            break;
+        }
+    }
+    journal.close();
+    mbedtls_platform_zeroize(pending, JOURNAL_BATCH_SIZE);
+    heap_caps_free(pending);
+
+    if (write_failed) {
+        USBSerial.println("ERRORE Journal: Impossibile riapplicare il giornale. Lo conservo per il prossimo avvio.");
+        return -1;
+    }
+    if (pending_len > 0) {
+        USBSerial.println("ATTENZIONE Journal: Scartata una transazione senza commit (scrittura interrotta).");
+    }
+    if (replayed > 0 || skipped > 0) {
+        USBSerial.printf("INFO Journal: %d transazioni riapplicate, %d di generazioni precedenti ignorate.\n", replayed, skipped);
+    }
+    reset();
+    return replayed;
+}
+
+bool VaultJournal::_truncate(size_t size) {
+    File journal = SD_MMC.open(JOURNAL_FILE, FILE_READ);
+    size_t current = journal ? journal.size() : 0;
+    if (journal) journal.close();
+    // Gia' piu' corto (azzerato da replay() o dal checkpoint): non c'e' niente da togliere
+    bool ok = current <= size;
+    if (!ok && size == 0) {
+        reset();  // Il giornale conteneva solo la scrittura fallita
+        ok = !SD_MMC.exists(JOURNAL_FILE);
+    } else if (!ok) {
+        ok = truncate((String(VAULT_MOUNT_POINT) + JOURNAL_FILE).c_str(), size) == 0;
+    }
+    if (!ok) USBSerial.println("ERRORE Journal: Impossibile togliere la scrittura parziale dal giornale.");
+    m_torn = !ok;
+    m_torn_size = size;
+    m_file_size = ok ? size : m_file_size;
+    return ok;
+}
+
+void VaultJournal::reset() {
+    if (SD_MMC.exists(JOURNAL_FILE)) SD_MMC.remove(JOURNAL_FILE);
+}
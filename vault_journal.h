@@ -0,0 +1,73 @@
+#pragma once
+#include <Arduino.h>
+#include <FS.h>
+
+// Giornale (write-ahead log) delle modifiche sul posto del vault: eliminazioni e aggiornamenti
+// che riscrivono byte gia' esistenti. Ogni transazione viene prima scritta per intero nel giornale,
+// chiusa da un record di commit e resa persistente; solo dopo i byte vengono scritti nel vault.
+// Un'interruzione durante la scrittura del vault viene riparata al riavvio rieseguendo la transazione.
+#define JOURNAL_FILE "/credentials.wal"
+#define JOURNAL_WIPE_FILE "/credentials.wal.wipe"  // Titoli e utenti in chiaro: sovrascritto come il vault da secureWipe()
+#define JOURNAL_MAGIC 0x4C4A5750u       // "PWJL"
+#define JOURNAL_BATCH_SIZE 4096         // Byte massimi di una transazione (voci comprese)
+#define JOURNAL_CHECKPOINT_SIZE 16384   // Oltre questa dimensione il giornale, gia' applicato, viene azzerato
+
+#define JOURNAL_ENTRY_WRITE 1   // Scrivi 'length' byte a 'offset' nel vault
+#define JOURNAL_ENTRY_COMMIT 2  // Le voci precedenti formano una transazione completa
+
+// Voce del giornale, seguita da 'length' byte di dati. Il CRC32C copre header (con crc = 0) e dati.
+struct JournalEntryHeader {
+    uint32_t magic;
+    uint32_t sequence;    // Consecutivo dentro il file: un salto indica la fine dei dati validi
+    uint32_t generation;  // Generazione del vault a cui si riferisce l'offset
+    uint32_t offset;
+    uint16_t length;
+    uint8_t type;         // JOURNAL_ENTRY_*
+    uint8_t reserved;
+    uint32_t crc;
+};
+
+class VaultJournal {
+public:
+    VaultJournal();
+    ~VaultJournal();
+    VaultJournal(const VaultJournal&) = delete;
+    VaultJournal& operator=(const VaultJournal&) = delete;
+
+    // Aggiunge una scrittura alla transazione in corso (solo RAM). False se la transazione e' piena.
+    bool stage(uint32_t generation, uint32_t offset, const uint8_t* data, uint16_t length);
+    bool hasPending() const { return m_used > 0; }
+    // Commit di gruppo: tutte le voci in sospeso e il record di commit con una sola scrittura
+    // seguita da flush, poi le scritture vengono applicate a 'vault' (aperto in "r+").
+    bool commit(File& vault);
+    // Annulla la transazione in corso, restituendo i suoi numeri di sequenza
+    void discard();
+
+    // All'avvio: riesegue su 'vault' le transazioni complete della generazione 'generation'
+    // e azzera il giornale. Il costo dipende dalla lunghezza del giornale, non da quella del vault.
+    // 'limit' e' il primo byte del vault che il giornale non puo' toccare (la tabella degli offset).
+    // Restituisce il numero di transazioni rieseguite, -1 in caso di errore di scrittura.
+    static int replay(File& vault, uint32_t generation, uint32_t limit);
+    static void reset();
+
+private:
+    static uint32_t _crc(const JournalEntryHeader& header, const uint8_t* data);
+    bool _append(uint8_t type, uint32_t generation, uint32_t offset, const uint8_t* data, uint16_t length);
+    static bool _apply(File& vault, const uint8_t* entries, size_t len);
+    // Riporta il giornale a 'size' byte, togliendo la coda di una scrittura fallita
+    bool _truncate(size_t size);
+    // Azzera le voci in RAM senza toccare la sequenza: per le transazioni gia' scritte nel giornale
+    void _clear();
+
+    uint8_t* m_buffer;    // Voci serializzate della transazione in corso
+    size_t m_used;
+    uint32_t m_sequence;  // Prossimo numero di sequenza
+    // Sequenza della prima voce della transazione in corso. Una transazione annullata non deve lasciare
+    // un salto: replay() si fermerebbe li' e ignorerebbe le transazioni successive
+    uint32_t m_txn_sequence;
+    size_t m_file_size;   // Dimensione del giornale dall'ultimo azzeramento
+    // Una scrittura fallita ha lasciato byte parziali oltre m_torn_size e non e' stato possibile toglierli:
+    // replay() si fermerebbe li' e ignorerebbe le transazioni successive, quindi commit() le rifiuta
+    bool m_torn;
+    size_t m_torn_size;
+};
@@ -0,0 +1,152 @@
+#include "vault_worker.h"
+#include <SD_MMC.h>
+#include "mbedtls/platform_util.h"
+
+extern HWCDC USBSerial;
+
+VaultWorker::VaultWorker()
+    : m_manager(nullptr), m_requests(NULL), m_results(NULL), m_pending(0) {}
+
+bool VaultWorker::begin(CredentialsManager& manager) {
+    if (m_requests) return true;
+    m_manager = &manager;
+
+    // Le code trasportano puntatori: il job resta in heap fino alla consegna
+    m_requests = xQueueCreate(VAULT_WORKER_QUEUE_LEN, sizeof(VaultJob*));
+    m_results = xQueueCreate(VAULT_WORKER_QUEUE_LEN, sizeof(VaultJob*));
+    if (!m_requests || !m_results) {
+        USBSerial.println("ERRORE VaultWorker: Impossibile creare le code.");
+        return false;
+    }
+    if (xTaskCreatePinnedToCore(_task, "vault_worker", VAULT_WORKER_STACK, this, 1, NULL, VAULT_WORKER_CORE) != pdPASS) {
+        USBSerial.println("ERRORE VaultWorker: Impossibile avviare il task.");
+        return false;
+    }
+    USBSerial.println("OK: VaultWorker avviato.");
+    return true;
+}
+
+bool VaultWorker::requestCredential(size_t index, uint32_t generation, VaultJobCallback callback, void* user) {
+    VaultJob* job = new VaultJob();
+    job->type = VaultJobType::READ_CREDENTIAL;
+    job->index = index;
+    job->generation = generation;
+    job->callback = callback;
+    job->user = user;
+    return _post(job);
+}
+
+bool VaultWorker::requestDelete(size_t index, uint32_t generation, VaultJobCallback callback, void* user) {
+    VaultJob* job = new VaultJob();
+    job->type = VaultJobType::DELETE_CREDENTIAL;
+    job->index = index;
+    job->generation = generation;
+    job->callback = callback;
+    job->user = user;
+    return _post(job);
+}
+
+bool VaultWorker::requestCompact(VaultJobCallback callback, void* user) {
+    VaultJob* job = new VaultJob();
+    job->type = VaultJobType::COMPACT;
+    job->callback = callback;
+    job->user = user;
+    return _post(job);
+}
+
+bool VaultWorker::requestSetKey(const uint8_t* key, VaultJobCallback callback, void* user) {
+    VaultJob* job = new VaultJob();
+    job->type = VaultJobType::SET_KEY;
+    memcpy(job->key, key, VAULT_WORKER_KEY_SIZE);
+    job->callback = callback;
+    job->user = user;
+    return _post(job);
+}
+
+bool VaultWorker::requestImport(const char* path, VaultJobCallback callback, void* user, ImportProgress* progress,
+                                ImportMode mode) {
+    if (!path || strlen(path) >= VAULT_WORKER_MAX_PATH) return false;
+    VaultJob* job = new VaultJob();
+    job->type = VaultJobType::IMPORT_CSV;
+    strncpy(job->path, path, VAULT_WORKER_MAX_PATH - 1);
+    job->progress = progress;
+    job->import_mode = mode;
+    job->callback = callback;
+    job->user = user;
+    return _post(job);
+}
+
+bool VaultWorker::_post(VaultJob* job) {
+    // Coda piena: la richiesta viene rifiutata subito, l'interfaccia non attende
+    if (!m_requests || xQueueSend(m_requests, &job, 0) != pdTRUE) {
+        USBSerial.println("ERRORE VaultWorker: Coda delle richieste piena o non inizializzata.");
+        mbedtls_platform_zeroize(job, sizeof(VaultJob));
+        delete job;
+        return false;
+    }
+    m_pending++;
+    return true;
+}
+
+void VaultWorker::pump() {
+    if (!m_results) return;
+    VaultJob* job;
+    while (xQueueReceive(m_results, &job, 0) == pdTRUE) {
+        m_pending--;
+        if (job->callback) job->callback(*job, job->user);
+        mbedtls_platform_zeroize(job, sizeof(VaultJob));
+        delete job;
+    }
+}
+
+void VaultWorker::_run(VaultJob& job) {
+    bool index_based = job.type == VaultJobType::READ_CREDENTIAL || job.type == VaultJobType::DELETE_CREDENTIAL;
+    if (index_based && job.generation != m_manager->getGeneration()) {
+        // Una compattazione eseguita dopo la richiesta ha rinumerato i record
+        USBSerial.printf("ATTENZIONE VaultWorker: Indice %d riferito alla generazione %d, il vault e' alla %d.\n",
+                         job.index, job.generation, m_manager->getGeneration());
+        job.success = false;
+        return;
+    }
+
+    switch (job.type) {
+        case VaultJobType::READ_CREDENTIAL:
+            job.success = m_manager->getCredential(job.index, &job.cred) &&
+                          CredentialsManager::decryptPassword(m_crypto, job.cred, job.password, sizeof(job.password)) > 0;
+            break;
+
+        case VaultJobType::IMPORT_CSV:
+            job.success = m_manager->importFromSD(job.path, m_crypto, nullptr, job.progress, job.import_mode);
+            if (job.success) {
+                // Il file importato viene conservato con un altro nome, per non reimportarlo
+                String imported_path = String(job.path) + ".imported";
+                if (SD_MMC.exists(imported_path)) SD_MMC.remove(imported_path);
+                SD_MMC.rename(job.path, imported_path);
+            }
+            break;
+
+        case VaultJobType::DELETE_CREDENTIAL:
+            job.success = m_manager->deleteCredential(job.index);
+            break;
+
+        case VaultJobType::COMPACT:
+            job.success = m_manager->compact();
+            break;
+
+        case VaultJobType::SET_KEY:
+            m_crypto.begin(job.key);
+            mbedtls_platform_zeroize(job.key, sizeof(job.key));
+            job.success = true;
+            break;
+    }
+}
+
+void VaultWorker::_task(void* param) {
+    VaultWorker* self = static_cast<VaultWorker*>(param);
+    VaultJob* job;
+    for (;;) {
+        if (xQueueReceive(self->m_requests, &job, portMAX_DELAY) != pdTRUE) continue;
+        self->_run(*job);
+        xQueueSend(self->m_results, &job, portMAX_DELAY);
+    }
+}
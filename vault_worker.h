@@ -0,0 +1,77 @@
+#pragma once
+#include <Arduino.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/queue.h"
+#include "credentials.h"
+#include "crypto.h"
+
+// Impostazioni del task di lavoro
+#define VAULT_WORKER_QUEUE_LEN 4
+#define VAULT_WORKER_STACK 8192
+#define VAULT_WORKER_CORE 0 // Il core 1 resta a loop() e LVGL
+#define VAULT_WORKER_MAX_PATH 64
+#define VAULT_WORKER_KEY_SIZE 32 // Chiave dati AES-256 (SEC_KEY_SIZE)
+
+enum class VaultJobType : uint8_t {
+    READ_CREDENTIAL, // Legge un record e ne decifra la password
+    IMPORT_CSV,      // Importa un file CSV dalla SD e lo rinomina in .imported
+    DELETE_CREDENTIAL, // Marca un record come eliminato
+    COMPACT,         // Riscrive il vault senza i record eliminati (gli indici cambiano)
+    SET_KEY          // Imposta la chiave dati del Crypto del task, tra un job e l'altro
+};
+
+struct VaultJob;
+// Callback di completamento: eseguita da pump() sul thread dell'interfaccia, mai dal task di lavoro
+typedef void (*VaultJobCallback)(const VaultJob& job, void* user);
+
+struct VaultJob {
+    VaultJobType type;
+    bool success;
+    size_t index;                          // READ_CREDENTIAL/DELETE_CREDENTIAL: indice del record
+    uint32_t generation;                   // Generazione del vault a cui si riferisce 'index'
+    char path[VAULT_WORKER_MAX_PATH];      // IMPORT_CSV: file da importare
+    ImportProgress* progress;              // IMPORT_CSV: avanzamento e annullamento (facoltativo)
+    ImportMode import_mode;                // IMPORT_CSV: accoda o aggiorna le password cambiate
+    Credential cred;                       // READ_CREDENTIAL: record letto
+    char password[MAX_ENCRYPTED_PASS_LEN]; // READ_CREDENTIAL: password in chiaro, azzerata dopo la callback
+    uint8_t key[VAULT_WORKER_KEY_SIZE];    // SET_KEY: chiave dati, azzerata appena usata
+    VaultJobCallback callback;
+    void* user;
+};
+
+// Esegue accessi alla SD e operazioni crittografiche su un task FreeRTOS dedicato.
+// L'interfaccia invia richieste e riceve l'esito tramite callback, senza mai bloccarsi.
+// Il task ha un proprio Crypto, usato anche dalla pipeline di importazione: il contesto GCM non e'
+// condiviso con l'interfaccia e la chiave cambia solo con un job SET_KEY, mai durante un altro job.
+class VaultWorker {
+public:
+    VaultWorker();
+    bool begin(CredentialsManager& manager);
+
+    // Le richieste per indice portano la generazione del vault da cui l'indice e' stato preso (la lista
+    // della schermata, l'esito di una lettura) e falliscono se una compattazione ha cambiato gli indici
+    bool requestCredential(size_t index, uint32_t generation, VaultJobCallback callback, void* user = nullptr);
+    bool requestDelete(size_t index, uint32_t generation, VaultJobCallback callback, void* user = nullptr);
+    bool requestCompact(VaultJobCallback callback, void* user = nullptr);
+    // Da chiamare a ogni sblocco: la chiave viene copiata nel job, 'key' puo' essere azzerata subito dopo
+    bool requestSetKey(const uint8_t* key, VaultJobCallback callback = nullptr, void* user = nullptr);
+    // 'progress' deve restare valido fino alla consegna dell'esito
+    bool requestImport(const char* path, VaultJobCallback callback, void* user = nullptr,
+                       ImportProgress* progress = nullptr, ImportMode mode = ImportMode::APPEND);
+
+    // Consegna le richieste completate alle rispettive callback. Da chiamare in loop().
+    void pump();
+    // Richieste inviate e non ancora consegnate
+    bool isBusy() const { return m_pending > 0; }
+
+private:
+    bool _post(VaultJob* job);
+    void _run(VaultJob& job);
+    static void _task(void* param);
+
+    CredentialsManager* m_manager;
+    Crypto m_crypto;  // Usato solo dal task di lavoro
+    QueueHandle_t m_requests;
+    QueueHandle_t m_results;
+    size_t m_pending; // Modificato solo dal thread dell'interfaccia
+};